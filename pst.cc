@@ -1,9 +1,15 @@
+#include <algorithm>
 #include <cmath>
+#include <csignal>
+#include <cstdio>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "pst.h"
 
@@ -19,6 +25,27 @@ int main(int argc, char** argv)
   const char* filename = nullptr;
   std::string fontname = "Helvetica-Narrow";
   double fontsize = 6.0;
+  collapse_limits limits;
+  bool stream = false;
+  bool pipeline = false;
+  bool serve = false;
+  std::string socket_path;
+  bool forest = false;
+  bool pdf = false;
+  bool svg = false;
+  bool tiles = false;
+  bool watch = false;
+  bool batch_paths = false;
+  bool measure = false;
+  bool stats_only = false;
+  bool gzip = false;
+  int shard_depth = 0;
+  int shard = -1;
+  bool merge = false;
+  std::string subtree;
+  std::string trace_file;
+  page_budget budget;
+  int threads = static_cast<int>(std::thread::hardware_concurrency());
   bool have_file_name = false;
 
   for (int i = 1; i < argc; i++)
@@ -32,6 +59,66 @@ int main(int argc, char** argv)
 	case 's':
 	  fontsize = std::stod(&argv[i][2]);
 	  break;
+	case 'c':
+	  limits.min_nodes = std::stol(&argv[i][2]);
+	  break;
+	case 'd':
+	  limits.max_levels = std::stoi(&argv[i][2]);
+	  break;
+	case '-':
+	  if (std::string(argv[i]) == "--stream")
+	    stream = true;
+	  else if (std::string(argv[i]) == "--pipeline")
+	    pipeline = true;
+	  else if (std::string(argv[i]) == "--forest")
+	    forest = true;
+	  else if (std::string(argv[i]) == "--pdf")
+	    pdf = true;
+	  else if (std::string(argv[i]) == "--svg")
+	    svg = true;
+	  else if (std::string(argv[i]) == "--tiles")
+	    tiles = true;
+	  else if (std::string(argv[i]) == "--watch")
+	    watch = true;
+	  else if (std::string(argv[i]) == "--batch-paths")
+	    batch_paths = true;
+	  else if (std::string(argv[i]) == "--measure" ||
+                   std::string(argv[i]) == "--dry-run")
+	    measure = true;
+	  else if (std::string(argv[i]) == "--stats-only")
+	    stats_only = true;
+	  else if (std::string(argv[i]) == "--gzip")
+	    gzip = true;
+	  else if (std::string(argv[i]).compare(0, 8, "--pages=") == 0)
+	    budget.pages = std::stoi(&argv[i][8]);
+	  else if (std::string(argv[i]).compare(0, 6, "--fit=") == 0) {
+	    std::string size = &argv[i][6];
+	    auto x = size.find('x');
+	    budget.width = std::stod(size.substr(0, x));
+	    if (x != std::string::npos)
+	      budget.height = std::stod(size.substr(x + 1));
+	  }
+	  else if (std::string(argv[i]).compare(0, 10, "--threads=") == 0)
+	    threads = std::stoi(&argv[i][10]);
+	  else if (std::string(argv[i]).compare(0, 14, "--shard-depth=") == 0)
+	    shard_depth = std::stoi(&argv[i][14]);
+	  else if (std::string(argv[i]).compare(0, 8, "--shard=") == 0)
+	    shard = std::stoi(&argv[i][8]);
+	  else if (std::string(argv[i]) == "--merge")
+	    merge = true;
+	  else if (std::string(argv[i]).compare(0, 10, "--subtree=") == 0)
+	    subtree = &argv[i][10];
+	  else if (std::string(argv[i]).compare(0, 8, "--trace=") == 0)
+	    trace_file = &argv[i][8];
+	  else if (std::string(argv[i]) == "--serve")
+	    serve = true;
+	  else if (std::string(argv[i]).compare(0, 8, "--serve=") == 0) {
+	    serve = true;
+	    socket_path = &argv[i][8];
+	  }
+	  else
+	    std::cout << "Unrecognized option " << argv[i] << "\n";
+	  break;
 	default:
 	  std::cout << "Unrecognized option " << argv[i][1] << "\n";
       }
@@ -41,161 +128,518 @@ int main(int argc, char** argv)
     }
   }
 
+  if (serve) {
+    // Requests name their own font and size; fonts stay loaded between
+    // requests.  Replies use stdout, so messages go to stderr instead.
+    std::ios::sync_with_stdio(false);
+    std::signal(SIGPIPE, SIG_IGN);
+    font_cache fonts(fonts_dir);
+    std::ostream replies(std::cout.rdbuf());
+    std::cout.rdbuf(std::cerr.rdbuf());
+    if (socket_path.empty())
+      serve_requests(std::cin, replies, fonts);
+    else if (!serve_unix_socket(socket_path, fonts))
+      return 5;
+    return 0;
+  }
+
   if (!have_file_name) {
-    std::cout << "Usage: pst [-ffontname] [-ssize] treefile\n";
+    std::cout << "Usage: pst [-ffontname] [-ssize] [-ccount] [-dlevels]\n"
+              << "           [--stream | --pipeline | --forest [--threads=n]]\n"
+              << "           [--subtree=path]"
+              << " [--shard-depth=n (--shard=i | --merge)]\n"
+              << "           [--pages=n] [--fit=wxh]"
+              << " [--pdf | --svg | --tiles | --measure | --stats-only]\n"
+              << "           [--batch-paths] [--gzip] [--trace=file]"
+              << " treefile[.gz]\n";
+    std::cout << "       pst [-ffontname] [-ssize] --watch treefile\n";
+    std::cout << "       pst --serve[=socket]\n";
     return 1;
   }
 
+  if (!trace_file.empty()) {
+    start_trace(trace_file);
+    trace_thread_name("main");
+  }
+
+  // Only the layout or the statistics are reported, as JSON on stdout;
+  // messages go to stderr.
+  std::ostream report(std::cout.rdbuf());
+  if (measure || stats_only)
+    std::cout.rdbuf(std::cerr.rdbuf());
+
+  // a name ending in .gz is read through zlib; output names leave it out
+  std::string basename = filename;
+  bool gzipped = basename.size() > 3 &&
+    basename.compare(basename.size() - 3, 3, ".gz") == 0;
+  if (gzipped)
+    basename.resize(basename.size() - 3);
+  if ((gzipped || gzip) && !gzip_available()) {
+    std::cout << "This pst is built without zlib and cannot read or write"
+              << " gzip files\n";
+    return 1;
+  }
+  // the output files of a subtree are named after its path
+  if (!subtree.empty() && forest) {
+    std::cout << "--subtree cannot be combined with --forest\n";
+    return 1;
+  }
+  if (!subtree.empty())
+    basename += "." + subtree;
+
+  set_alloc_phase(alloc_parse);
+  std::unique_ptr<std::streambuf> input;
+  if (gzipped) {
+    auto gz = std::make_unique<gzip_streambuf>(filename);
+    if (gz->is_open())
+      input = std::move(gz);
+  }
+  else {
+    auto file = std::make_unique<std::filebuf>();
+    if (file->open(filename, std::ios::in))
+      input = std::move(file);
+  }
+  if (!input) {
+    std::cout << "Unable to read tree from file " << filename << "\n";
+    return 3;
+  }
+  input = rewindable(std::move(input));
+  std::istream ifp(input.get());
+
+  // check the whole file before any real work, and count what it holds;
+  // of a subtree, only the way to it is read besides the subtree itself
+  tree_stats stats;
+  {
+    trace_span span("scan");
+    if (!subtree.empty()) {
+      if (!ps_seek_subtree(ifp, subtree) || !ps_scan_tree(ifp, stats))
+	return 3;
+    }
+    else if (!(forest ? ps_scan_forest(ifp, stats)
+		      : ps_scan_tree(ifp, stats)))
+      return 3;
+  }
+  if (stats_only) {
+    write_stats_json(stats, report);
+    report << "\n";
+    return 0;
+  }
+  ifp.clear();
+  ifp.seekg(0);
+  if (!ifp) {
+    std::cout << "Unable to read tree from file " << filename << "\n";
+    return 3;
+  }
+  if (!subtree.empty())
+    ps_seek_subtree(ifp, subtree);
+
   font mainfont;
   if (!mainfont.load(fontname, fonts_dir)) {
     std::cout << "Unable to load font " << fontname << "\n";
     return 2;
   }
+  font rulefont;
+  if (pdf && !rulefont.load("Helvetica", fonts_dir)) {
+    std::cout << "Unable to load font Helvetica\n";
+    return 2;
+  }
+  if (pdf && stream) {
+    std::cout << "--pdf cannot be combined with --stream\n";
+    return 1;
+  }
+  if (svg && (pdf || stream || forest)) {
+    std::cout << "--svg cannot be combined with --pdf, --stream"
+              << " or --forest\n";
+    return 1;
+  }
+  if (tiles && (pdf || svg || stream || forest || measure || gzip)) {
+    std::cout << "--tiles cannot be combined with --pdf, --svg, --stream,"
+              << " --forest, --measure or --gzip\n";
+    return 1;
+  }
+  bool fit = budget.pages > 0 || budget.width > 0.0 || budget.height > 0.0;
+  if (fit && (stream || forest)) {
+    std::cout << "--pages and --fit cannot be combined with --stream"
+              << " or --forest\n";
+    return 1;
+  }
+  if (pipeline && (stream || forest || fit)) {
+    std::cout << "--pipeline cannot be combined with --stream, --forest,"
+              << " --pages or --fit\n";
+    return 1;
+  }
+  if (batch_paths && (stream || forest || pdf || svg || tiles)) {
+    std::cout << "--batch-paths cannot be combined with --stream, --forest,"
+              << " --pdf, --svg or --tiles\n";
+    return 1;
+  }
+  if (watch && (stream || pipeline || forest || pdf || svg || tiles ||
+                batch_paths || measure || fit || gzip || gzipped ||
+                shard_depth > 0 || !subtree.empty() ||
+                limits.max_levels > 0 || limits.min_nodes > 0)) {
+    std::cout << "--watch cannot be combined with other output, layout or"
+              << " input options, or with a gzipped file\n";
+    return 1;
+  }
+  if ((shard >= 0 || merge) != (shard_depth > 0) || (shard >= 0 && merge)) {
+    std::cout << "--shard-depth needs one of --shard and --merge\n";
+    return 1;
+  }
+  if (shard_depth > 0 && (stream || pipeline || forest || fit)) {
+    std::cout << "--shard and --merge cannot be combined with --stream,"
+              << " --pipeline, --forest, --pages or --fit\n";
+    return 1;
+  }
+  if (merge && (pdf || svg || tiles || batch_paths)) {
+    std::cout << "--merge cannot be combined with --pdf, --svg, --tiles"
+              << " or --batch-paths\n";
+    return 1;
+  }
 
-  std::ifstream ifp(filename);
-  if (!ifp) {
-    std::cout << "Unable to read tree from file " << filename << "\n";
-    return 3;
+  if (watch) {
+    // The font stays loaded, and the tree and its layout are kept between
+    // versions of the file.  Each version replaces the PostScript at once.
+    file_watch watcher(filename);
+    if (!watcher.is_open()) {
+      std::cout << "Unable to watch file " << filename << "\n";
+      return 5;
+    }
+    watched_tree watched(mainfont, fontsize, 1.5 * fontsize);
+    std::string outname = basename + ".ps";
+    std::string tmpname = outname + ".tmp";
+    do {
+      std::ifstream wfp(filename, std::ios::binary);
+      std::string next((std::istreambuf_iterator<char>(wfp)),
+                       std::istreambuf_iterator<char>());
+      if (!wfp.is_open()) {
+	std::cout << "Unable to read tree from file " << filename << "\n";
+	std::cout.flush();
+	continue;
+      }
+      if (watched.tree() && next == watched.source())
+	continue;
+      std::cout << "Setting coordinates ...";
+      std::cout.flush();
+      trace_span span("update", "kept");
+      if (!watched.update(std::move(next))) {
+	std::cout.flush();
+	continue;
+      }
+      span.set(watched.reused_nodes());
+      std::cout << " ok, " << watched.reused_nodes() << " nodes kept\n";
+
+      std::ofstream wout(tmpname);
+      ps_write_tree(watched.tree(), fontname, fontsize, wout);
+      wout.close();
+      if (!wout || std::rename(tmpname.c_str(), outname.c_str()) != 0) {
+	std::cout << "Unable to write file " << outname << "\n";
+	return 4;
+      }
+      std::cout << "Wrote " << outname << "; waiting for changes to "
+                << filename << "\n";
+      std::cout.flush();
+    } while (watcher.wait());
+    std::cout << "Unable to watch file " << filename << "\n";
+    return 5;
+  }
+
+  std::unique_ptr<pstree> tree;
+  std::vector<std::unique_ptr<pstree>> trees;
+  std::vector<shard_info> shards;
+  if (forest) {
+    trace_span span("restore");
+    trees = ps_restore_forest(ifp, limits);
+  }
+  else if (shard_depth > 0) {
+    // only the levels above the shards, and the shard to lay out, if any
+    trace_span span("restore");
+    tree = ps_restore_top_levels(ifp, limits, shard_depth, shard, shards);
+    if (!tree)
+      return 3;
+  }
+  else if (!stream && !pipeline) {
+    trace_span span("restore");
+    tree = ps_restore_tree(ifp, limits);
+    if (!tree)
+      return 3;
+    // the counts are those of the tree as built unless parts are collapsed
+    if (tree && limits.max_levels == 0 && limits.min_nodes == 0)
+      reserve_segments(tree.get(), stats);
   }
-  auto tree = ps_restore_tree(ifp);
-  ifp.close();
 
-  std::string outname = std::string(filename) + ".ps";
-  std::ofstream ofp(outname);
-  if (!ofp) {
+  if (shard >= 0) {
+    // lay out one subtree for a later --merge, in files of its own
+    if (shard >= static_cast<int>(shards.size())) {
+      std::cout << "There is no shard " << shard << "; the tree has "
+                << shards.size() << " at depth " << shard_depth << "\n";
+      return 0;
+    }
+    std::string shardname = basename + ".shard" + std::to_string(shard);
+    std::cout << " ok\nSetting coordinates of shard " << shard << " ...";
+    std::cout.flush();
+    set_alloc_phase(alloc_layout);
+    set_sizes(shards[shard].node, mainfont, fontsize, 1.5 * fontsize);
+    std::ofstream sfp(shardname), nfp(shardname + ".nodes");
+    write_shard(shards[shard], fontname, fontsize, sfp, nfp);
+    sfp.close();
+    nfp.close();
+    if (!sfp || !nfp) {
+      std::cout << "\nUnable to write files " << shardname << "\n";
+      return 4;
+    }
+    std::cout << " ok\n";
+    write_alloc_stats(std::cout);
+    return 0;
+  }
+
+  // compressed output is written by the background thread, which also
+  // does the compression
+  std::string outname = basename + (pdf ? ".pdf" : svg ? ".svg" : ".ps") +
+    (gzip ? ".gz" : "");
+  std::ofstream ofp;
+  std::unique_ptr<writer_streambuf> background;
+  std::unique_ptr<std::FILE, int (*)(std::FILE*)> psfile(nullptr, std::fclose);
+  bool single_file = !measure && !tiles;
+  if (single_file && (pipeline || gzip))
+    background = std::make_unique<writer_streambuf>(outname, 1 << 20, gzip);
+  else if (single_file && (pdf || svg || forest))
+    ofp.open(outname);
+  else if (single_file)
+    psfile.reset(std::fopen(outname.c_str(), "w"));
+  if (single_file && !(background ? background->is_open()
+		    : psfile ? true : ofp.is_open())) {
     std::cout << "Unable to write file " << outname << "\n";
     return 4;
   }
+  std::ostream out(background ? static_cast<std::streambuf*>(background.get())
+                              : ofp.rdbuf());
 
-  ofp << std::fixed;
-
-  ofp << "%!PS-Adobe-\n";
-  ofp << "\n";
-  ofp << "/bc {dup stringwidth -2 div exch -2 div exch rmt show} def\n";
-  ofp << "/bk {0 setgray} def\n\n";
-  ofp << "/cp {closepath} def\n";
-  ofp << "/ct {curveto} def\n";
-  ofp << "/er {gsave 1 setgray fill grestore} def\n";
-  ofp << "/gr {grestore} def\n";
-  ofp << "/gs {gsave} def\n";
-  ofp << "/gy {0.4 setgray} def\n";
-  ofp << "/lt {lineto} def\n";
-  ofp << std::setprecision(2);
-  ofp << "/mf {/" << fontname << " findfont " << fontsize
-      << " scalefont setfont} def\n";
-  ofp << "/mt {moveto} def\n";
-  ofp << "/np {newpath} def\n";
-  ofp << "/rf {/Helvetica findfont 8.0 scalefont setfont} def\n";
-  ofp << "/rlt {rlineto} def\n";
-  ofp << "/rmt {rmoveto} def\n";
-  ofp << "/sh {show} def\n";
-  ofp << "/sk {stroke} def\n";
-  ofp << "/slw {setlinewidth} def\n";
-  ofp << "/tr {translate} def\n";
-  ofp << "/wh {1 setgray} def\n";
+  if (forest) {
+    // one task per tree, then one document with each tree on new pages
+    std::cout << " ok\nSetting coordinates of " << trees.size()
+              << " trees ...";
+    std::cout.flush();
+    set_alloc_phase(alloc_layout);
+    set_forest_sizes(trees, mainfont, fontsize, 1.5 * fontsize,
+                     std::max(threads, 1));
+    if (measure) {
+      std::cout << " ok\n";
+      report << "[";
+      for (std::size_t i = 0; i < trees.size(); i++) {
+	pstree* t = trees[i].get();
+	report << (i ? ",\n " : "");
+	write_plan_json(plan_pages(t->x, t->y, t->width, t->height),
+                        fontsize, report);
+      }
+      report << "]\n";
+      write_alloc_stats(std::cout);
+      return 0;
+    }
+    std::cout << " ok\nDrawing trees\n";
+    set_alloc_phase(alloc_emit);
+    if (pdf) {
+      std::vector<pstree*> roots;
+      for (auto& t : trees)
+	roots.push_back(t.get());
+      trace_span span("pdf");
+      pdf_write_trees(roots, mainfont, rulefont, fontsize, out);
+    }
+    else {
+      trace_span span("forest");
+      ps_write_forest(trees, fontname, fontsize, out);
+    }
+    out.flush();
+    if (!out || (background && !background->close())) {
+      std::cout << "Unable to write file " << outname << "\n";
+      return 4;
+    }
+    write_alloc_stats(std::cout);
+    return 0;
+  }
 
   std::cout << " ok\nSetting coordinates ...";
   std::cout.flush();
-  set_sizes(tree.get(), mainfont, fontsize, 1.5 * fontsize);
+  // with --stream and --pipeline this includes reading the file
+  set_alloc_phase(alloc_layout);
+  std::unique_ptr<spilled_tree> spilled;
+  std::vector<std::string> shard_records;
+  page_plan plan;
+  if (stream) {
+    // read and lay out in one pass, keeping node geometry on disk
+    spilled = ps_stream_tree(ifp, mainfont, fontsize, 1.5 * fontsize);
+    if (!spilled)
+      return 3;
+    plan = plan_pages(spilled->x, spilled->y, spilled->width,
+                      spilled->height);
+  }
+  else if (pipeline) {
+    // lay out each subtree while the rest of the file is being read
+    tree = ps_pipeline_tree(ifp, mainfont, fontsize, 1.5 * fontsize, limits);
+    if (!tree)
+      return 3;
+    plan = plan_pages(tree->x, tree->y, tree->width, tree->height);
+  }
+  else if (fit) {
+    // the largest size that fits, starting the search from -s
+    fontsize = fit_font_size(tree.get(), mainfont, budget, fontsize);
+    if (fontsize <= 0.0) {
+      std::cout << "\nThe tree does not fit at any font size\n";
+      return 6;
+    }
+    std::cout << " font size " << std::setprecision(2) << std::fixed
+              << fontsize << " ...";
+    plan = plan_pages(tree->x, tree->y, tree->width, tree->height);
+  }
+  else if (merge) {
+    // the shards come laid out from the --shard runs; only the levels
+    // above them are left.  Their nodes are read again for each page.
+    for (std::size_t i = 0; i < shards.size(); i++) {
+      std::string shardname = basename + ".shard" + std::to_string(i);
+      std::ifstream sfp(shardname);
+      if (!sfp || !read_shard(sfp, shards[i], fontname, fontsize) ||
+          !std::ifstream(shardname + ".nodes")) {
+	std::cout << "\nUnable to read shard " << shardname << "\n";
+	return 3;
+      }
+      shard_records.push_back(shardname + ".nodes");
+    }
+    set_top_sizes(tree.get(), shard_depth, mainfont, fontsize,
+                  1.5 * fontsize);
+    plan = plan_pages(tree->x, tree->y, tree->width, tree->height);
+  }
+  else {
+    set_sizes(tree.get(), mainfont, fontsize, 1.5 * fontsize);
+    plan = plan_pages(tree->x, tree->y, tree->width, tree->height);
+  }
   std::cout << " ok\n";
 
-  // compute orientation on page(s)
-  int w1 = static_cast<int>((tree->width + 540 - 1) / 540);
-  int h1 = static_cast<int>((tree->height + 720 - 1) / 720);
-  int w2 = static_cast<int>((tree->width + 720 - 1) / 720);
-  int h2 = static_cast<int>((tree->height + 540 - 1) / 540);
-  int wpages, pwidth, pheight, hpages, orientation;
-  if (w2 * h2 > w1 * h1) {
-    wpages = w1;
-    pwidth = 540;
-    pheight = 720;
-    hpages = h1;
-    orientation = 1;
+  // the drawing, the same on every page, and the document around it, into
+  // any sink
+  int tpages = plan.pages();
+  std::vector<pstree*> curve;
+  if (batch_paths)
+    curve = nodes_along_curve(tree.get());
+  bool drawn = true;
+  auto draw = [&](auto& sink) {
+    if (stream)
+      ps_draw_spilled_tree(spilled.get(), fontsize, sink);
+    else if (merge)
+      drawn = ps_draw_merged_tree(tree.get(), shard_depth, shard_records,
+                                  mainfont, fontsize, sink) && drawn;
+    else if (batch_paths)
+      ps_draw_tree_batched(tree.get(), curve, fontsize, sink);
+    else
+      ps_draw_tree(tree.get(), fontsize, sink);
+  };
+  auto write_document = [&](auto& sink, auto&& draw_page, bool progress) {
+    dsc_index index;
+    ps_write_prolog(fontname, fontsize, tpages, index, sink);
+    int i = 0;
+    for (int rowcount = 0; rowcount < plan.hpages; rowcount++)
+      for (int colcount = 0; colcount < plan.wpages; colcount++)
+      {
+	if (progress) {
+	  std::cout << " " << ++i;
+	  std::cout.flush();
+	}
+	trace_span span("page", "page", rowcount * plan.wpages + colcount + 1);
+	ps_begin_page(plan, rowcount, colcount, fontsize, index, sink);
+	draw_page(sink);
+	ps_end_page(sink);
+      }
+    ps_write_trailer(index, sink);
+  };
+
+  if (measure) {
+    // the exact size of the PostScript, without writing it; the drawing
+    // only needs to be counted once
+    counting_sink drawing, size;
+    if (!pdf) {
+      draw(drawing);
+      write_document(size, [&](counting_sink& s) { s.bytes += drawing.bytes; },
+                     false);
+    }
+    if (!drawn) {
+      std::cout << "Unable to read the nodes of the shards\n";
+      return 3;
+    }
+    write_plan_json(plan, fontsize, report, pdf || svg ? -1 : size.bytes);
+    report << "\n";
+    write_alloc_stats(std::cout);
+    return 0;
   }
-  else {
-    wpages = w2;
-    pwidth = 720;
-    pheight = 540;
-    hpages = h2;
-    orientation = 2;
-  }
-  int tpages = hpages * wpages;
-
-  ofp << std::setprecision(2);
-  ofp << "% width: " << tree->width << " height: " << tree->height << "\n";
-  ofp << "% wpages: " << wpages << ", hpages: " << hpages
-      << ", total: " << tpages << "\n";
-  ofp << "/sclip {np 0 0 mt 0 " << pheight << " rlt " << pwidth
-      << " 0 rlt 0 " << pheight << " neg rlt cp clip} def\n";
+
+  set_alloc_phase(alloc_emit);
+  if (tiles) {
+    // a pyramid of tiles instead of pages, for zoomable viewers
+    std::cout << "Drawing tree as tiles into " << basename << "_files\n";
+    trace_span span("tiles");
+    if (!write_tile_pyramid(tree.get(), fontname, fontsize, basename,
+                            std::max(threads, 1)))
+      return 4;
+    write_alloc_stats(std::cout);
+    return 0;
+  }
+  if (svg) {
+    // one canvas instead of pages
+    std::cout << "Drawing tree as SVG\n";
+    {
+      trace_span span("svg");
+      svg_write_tree(tree.get(), fontname, fontsize, out);
+      out.flush();
+    }
+    if (!out || (background && !background->close())) {
+      std::cout << "Unable to write file " << outname << "\n";
+      return 4;
+    }
+    write_alloc_stats(std::cout);
+    return 0;
+  }
+  if (pdf) {
+    // the tree is drawn once and shown on every page
+    std::cout << "Drawing tree onto " << tpages << " PDF pages\n";
+    {
+      trace_span span("pdf");
+      pdf_write_trees({tree.get()}, mainfont, rulefont, fontsize, out);
+      out.flush();
+    }
+    if (!out || (background && !background->close())) {
+      std::cout << "Unable to write file " << outname << "\n";
+      return 4;
+    }
+    write_alloc_stats(std::cout);
+    return 0;
+  }
+
   if (tpages > 1)
     std::cout << "Drawing tree onto " << tpages << " pages ("
-              << hpages << " tall by " << wpages << " wide)\n";
+              << plan.hpages << " tall by " << plan.wpages << " wide)\n";
   else
     std::cout << "Drawing tree onto 1 page\n";
 
   // use as many pages as needed, and provide cutting gluing directions
-  int i = 0;
-  for (int rowcount = 0; rowcount < hpages; rowcount++)
-    for (int colcount = 0; colcount < wpages; colcount++)
-    {
-      i++;
-      std::cout << " " << i;
-      std::cout.flush();
-
-      ofp << "\n";
-      if (orientation == 2)
-	ofp << "90 rotate 0 612 neg tr ";
-      ofp << std::setprecision(5);
-      ofp << "36 36 tr " << fontsize / 10.0 << " slw\n";
-      ofp << std::setprecision(3);
-
-      if (hpages - rowcount - 1) {
-	ofp << "gs rf 1 slw\n";
-	ofp << pwidth / 2.0 << " " << pheight + 10
-            << " mt (row " << hpages - rowcount
-            << " - cut to remove line"
-            << ", place to cover line of adjoining page) bc\n";
-	ofp << "np -36 " << 0.50 + pheight
-            << " mt " << pwidth + 72 << " 0 rlt sk gr\n";
-      }
-      if (rowcount) {
-	ofp << "gs rf 1 slw\n";
-	ofp << "gy " << pwidth / 2.0
-            << " -18 mt (place adjoining page of"
-            << " row " << hpages - rowcount + 1
-            << " to cover line) bc\n";
-	ofp << "np -36 -0.5 mt " << pwidth + 72 << " 0 rlt sk gr\n";
-      }
-      if (colcount) {
-	ofp << "gs rf 1 slw\n";
-	ofp << "-10 " << pheight / 2.0
-            << " mt gs 90 rotate (col " << colcount + 1
-            << " - cut to"
-            << " remove line, place to cover line of adjoining page) "
-            << "bc gr\n";
-	ofp << "np -0.5 -36 mt 0 " << pheight + 72 << " rlt sk gr\n";
-      }
-      if (colcount < wpages - 1) {
-	ofp << "gs rf 1 slw\n";
-	ofp << "gy " << pwidth + 18 << " " << pheight / 2.0
-            << " mt gs 90 rotate (place adjoining "
-            << "page of column " << colcount + 2
-            << " to cover line) bc gr\n";
-	ofp << "np " << 0.50 + pwidth << " -36 mt 0 "
-            << pheight + 72 << " rlt sk gr\n";
-      }
-      ofp << "gs sclip " << (pwidth * wpages - tree->width) / 2.0 -
-              pwidth * colcount - tree->x
-          << " " << (pheight * hpages - tree->height) / 2.0 -
-              pheight * rowcount - tree->y
-          << " tr mf\n";
-
-      ofp << std::setprecision(2);
-      ps_draw_tree(tree.get(), fontsize, ofp);
-      ofp << "gr showpage\n";
-    }
+  bool written = true;
+  if (psfile) {
+    file_sink sink(psfile.get());
+    write_document(sink, draw, true);
+    written = sink.flush() && std::fclose(psfile.release()) == 0;
+  }
+  else {
+    ostream_sink sink(out);
+    write_document(sink, draw, true);
+    out.flush();
+    written = !background || background->close();
+  }
   std::cout << "\n";
-  ofp.close();
+  if (!drawn) {
+    std::cout << "Unable to read the nodes of the shards\n";
+    return 3;
+  }
+  if (!written) {
+    std::cout << "Unable to write file " << outname << "\n";
+    return 4;
+  }
+  write_alloc_stats(std::cout);
 
   return 0;
 
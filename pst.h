@@ -3,59 +3,501 @@
 // ___________________________________________________________________________
 // Includes
 
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 // ___________________________________________________________________________
 // Class definitions
 
+// Layout coordinates as they are stored in the tree and its segment lists.
+// With PST_COMPACT_GEOMETRY they are floats, which halves the memory of a
+// laid out tree; all arithmetic is still done in double.
+#ifdef PST_COMPACT_GEOMETRY
+typedef float coord;
+#else
+typedef double coord;
+#endif
+
 struct NodeString {
   std::string text;
   double width = 0.0;
+  double unit_width = 0.0;  // width at size 1, kept by fit_font_size
 };
 
 struct segment {
-  double x1 = 0.0, y1 = 0.0, x2 = 0.0, y2 = 0.0;
+  coord x1 = 0.0, y1 = 0.0, x2 = 0.0, y2 = 0.0;
 
   bool contains(double x, double y) const;
 };
 
+// Horizontal and vertical segments, with their ends in increasing order
+struct hsegment {
+  coord y = 0.0, x1 = 0.0, x2 = 0.0;
+};
+
+struct vsegment {
+  coord x = 0.0, y1 = 0.0, y2 = 0.0;
+};
+
+// The segments around a laid out subtree, kept apart by direction so that
+// most pairs take only a few comparisons to test.  seglists_intersect
+// gives exactly the results segments_intersect gives pair by pair.
+struct segment_list {
+  std::vector<hsegment> horizontal;
+  std::vector<vsegment> vertical;
+  std::vector<segment> diagonal;  // never vertical
+
+  void push_back(const segment& s);
+  void push_back(double x1, double y1, double x2, double y2);
+  void append(const segment_list& other);
+  void clear();
+  void reserve(std::size_t horizontal, std::size_t vertical,
+               std::size_t diagonal);
+  std::size_t size() const;
+  void prune_to_outline();
+};
+
+// What ps_scan_tree found in a tree file.  Counts add up over all the
+// trees scanned into the same tree_stats.
+struct tree_stats {
+  long trees = 0;
+  long branches = 0, leaves = 0;
+  long continuations = 0;  // '+' lines, the second and later label lines
+  long long label_bytes = 0;
+  int depth = 0;           // levels of the deepest tree
+  long lines = 0;          // lines read so far, for error messages
+
+  long nodes() const { return branches + leaves; }
+};
+
+// Limits used to collapse parts of a large tree into summary leaves while it
+// is being read.  A zero value disables the corresponding limit.
+struct collapse_limits {
+  int max_levels = 0;  // branches on this level become summaries
+  long min_nodes = 0;  // branches with fewer nodes become summaries
+};
+
 struct pstree {
   std::unique_ptr<pstree> left;
   std::unique_ptr<pstree> right;
   std::vector<NodeString> nodestrings;
-  double stringswidth = 0.0, width = 0.0, height = 0.0;
-  double x = 0.0, y = 0.0, xbox = 0.0, ybox = 0.0;
-  double boxwidth = 0.0, boxheight = 0.0;
-  std::vector<segment> seglist;
+  coord stringswidth = 0.0, width = 0.0, height = 0.0;
+  coord x = 0.0, y = 0.0, xbox = 0.0, ybox = 0.0;
+  coord boxwidth = 0.0, boxheight = 0.0;
+  segment_list seglist;
+  std::size_t shape = 0;  // shape_hash of the subtree; 0 if not known
+};
+
+// The layout of a subtree before its parent has moved it, which does not
+// depend on where the subtree ends up: the geometry of its nodes and the
+// widths of their labels, both in pre-order, and its outline.
+struct subtree_layout {
+  struct node {
+    coord stringswidth, width, height, x, y, xbox, ybox, boxwidth, boxheight;
+  };
+  std::vector<node> nodes;
+  std::vector<double> widths;
+  segment_list seglist;
+};
+
+// One of the subtrees that --shard and --merge split a tree into, with its
+// size in the tree file.  Unless it is the shard being laid out, its node
+// is a childless stand-in that only gets the shard root's geometry.
+struct shard_info {
+  pstree* node = nullptr;
+  long nodes = 0;
+  int levels = 0;
+};
+
+// A tree laid out by ps_stream_tree.  Only the root's extent is kept in
+// memory; arcs and boxes with their labels live in temporary files.
+struct spilled_tree {
+  double x = 0.0, y = 0.0, width = 0.0, height = 0.0;
+  long nodes = 0;
+  std::unique_ptr<std::FILE, int (*)(std::FILE*)> arcs{nullptr, std::fclose};
+  std::unique_ptr<std::FILE, int (*)(std::FILE*)> boxes{nullptr, std::fclose};
+};
+
+// How a laid out tree is spread over letter size pages, and where.
+struct page_plan {
+  double x = 0.0, y = 0.0, width = 0.0, height = 0.0;
+  int wpages = 1, hpages = 1;
+  int pwidth = 540, pheight = 720;
+  int orientation = 1;
+
+  int pages() const { return wpages * hpages; }
+};
+
+// What a layout has to fit into.  A zero value disables the limit.
+struct page_budget {
+  int pages = 0;        // most pages plan_pages may use
+  double width = 0.0;   // largest extent of the tree, in points
+  double height = 0.0;
+};
+
+// Phases of a run, for counting heap use when built with PST_ALLOC_STATS
+enum alloc_phase { alloc_startup, alloc_parse, alloc_layout, alloc_emit,
+                   alloc_phases };
+
+// What the allocations of one phase added up to.  peak is the most memory
+// in use at any time during the phase, including what earlier phases left.
+struct alloc_stats {
+  long long allocations = 0, bytes = 0, peak = 0;
+};
+
+// A span of work in the trace that start_trace turns on, from its
+// construction to the end of its scope, on the thread that runs it.
+// Until then a span costs one test of enabled.
+class trace_span {
+ private:
+  const char* name;
+  const char* arg_name;
+  long long arg;
+  long long start = -1;
+
+  static long long now();
+  void record();
+
+ public:
+  static bool enabled;  // set before any work, by start_trace
+
+  explicit trace_span(const char* name, const char* arg_name = nullptr,
+                      long long arg = 0)
+    : name(name), arg_name(arg_name), arg(arg) {
+    if (enabled)
+      start = now();
+  }
+  ~trace_span() {
+    if (start >= 0)
+      record();
+  }
+  void set(long long value) { arg = value; }
+  void drop() { start = -1; }  // leave the span out of the trace
+};
+
+// A box or an arc of a laid out tree, with its bounding box.
+struct index_entry {
+  double x1 = 0.0, y1 = 0.0, x2 = 0.0, y2 = 0.0;
+  pstree* node = nullptr;
+  pstree* child = nullptr;  // the arc from node to child; null for the box
+  bool summary = false;     // the whole subtree of node, as its extent
+};
+
+// The boxes and arcs of a laid out tree in a packed R-tree, for finding
+// what is drawn at a point or inside a region.  Subtrees narrower and
+// lower than min_extent are summarized by a single entry.  The tree must
+// not be laid out again or changed while the index is in use.
+class node_index {
+ private:
+  std::vector<std::vector<index_entry>> levels;  // entries first, root last
+
+ public:
+  node_index(pstree* t, double fontsize, double min_extent = 0.0);
+  std::size_t size() const { return levels.empty() ? 0 : levels[0].size(); }
+  void query(double x1, double y1, double x2, double y2,
+             std::vector<const index_entry*>& hits) const;
+  std::vector<pstree*> nodes_in(double x1, double y1, double x2,
+                                double y2) const;
+  pstree* node_at(double x, double y) const;
+};
+
+// Where the parts of a document start, for the index in its trailer.
+// Offsets are -1 when the stream cannot tell its position.
+struct dsc_index {
+  long prolog = 0;
+  std::vector<long> pages;
+};
+
+// Builds a tree in place, in the same pre-order as the tree file format:
+// every branch takes the next two completed nodes as its children.
+class tree_builder {
+ private:
+  std::unique_ptr<pstree> root;
+  std::vector<pstree*> open;
+
+ public:
+  pstree* branch(const std::vector<std::string>& lines);
+  pstree* leaf(const std::vector<std::string>& lines);
+  bool complete() const { return root && open.empty(); }
+  std::unique_ptr<pstree> finish();
+
+ private:
+  pstree* add(const std::vector<std::string>& lines, bool is_branch);
 };
 
 class font {
  private:
+  std::string fname;
   double widths[256] = {};
 
  public:
   bool load(const std::string& fontname, const std::string& fonts_dir);
+  const std::string& name() const { return fname; }
   double width(int s) const { return widths[s]; }
 };
 
+// Fonts loaded once and kept for the lifetime of a render server.
+class font_cache {
+ private:
+  std::string fonts_dir;
+  std::map<std::string, std::unique_ptr<font>> fonts;
+
+ public:
+  explicit font_cache(const std::string& fonts_dir) : fonts_dir(fonts_dir) {}
+  const font* get(const std::string& fontname);
+};
+
+// A tree file that is read again each time it changes.  Subtrees whose
+// bytes are the same as before, in the unchanged start or end of the
+// file, keep their nodes, label widths and layout; only the rest is
+// parsed, and only the paths from it to the root are laid out again.
+class watched_tree {
+ private:
+  struct node_span {
+    std::size_t begin, end;          // the subtree's bytes in the file
+    std::unique_ptr<pstree>* owner;  // where the node is held
+  };
+
+  const font& mainfont;
+  double fontsize, interspace;
+  std::unique_ptr<pstree> root;
+  std::string text;
+  std::vector<node_span> spans;  // of every node, in pre-order
+  long reused = 0;
+
+  static bool starts_before(const node_span& s, std::size_t pos);
+  std::unique_ptr<pstree> read_node(const std::string& next,
+                                    std::size_t& pos, std::size_t same_start,
+                                    std::size_t same_end,
+                                    std::unique_ptr<pstree>* owner,
+                                    std::vector<node_span>& next_spans,
+                                    bool& laid_out);
+
+ public:
+  watched_tree(const font& mainfont, double fontsize, double interspace)
+    : mainfont(mainfont), fontsize(fontsize), interspace(interspace) {}
+  bool update(std::string next);
+  pstree* tree() const { return root.get(); }
+  const std::string& source() const { return text; }
+  long reused_nodes() const { return reused; }  // by the last update
+};
+
+// Waits for a file to be written or replaced.  Its directory is watched,
+// since many programs write a new file and rename it over the old one;
+// changes made before wait is called are not lost.
+class file_watch {
+ private:
+  int fd = -1;
+  std::string name;
+
+ public:
+  explicit file_watch(const std::string& path);
+  ~file_watch();
+  bool is_open() const { return fd >= 0; }
+  bool wait();
+};
+
+// A buffered std::streambuf on a file descriptor, such as a socket.
+class fd_streambuf : public std::streambuf {
+ private:
+  int fd;
+  std::vector<char> ibuf, obuf;
+
+ public:
+  explicit fd_streambuf(int fd);
+  ~fd_streambuf() override;
+
+ protected:
+  int underflow() override;
+  int overflow(int c) override;
+  int sync() override;
+};
+
+// A gzip file, read or written through zlib when the build has it.
+struct gzip_file;
+
+// Reads a gzip file, decompressing as the parser asks for more.  It can
+// only seek back to the start, for a second pass over the input.
+class gzip_streambuf : public std::streambuf {
+ private:
+  gzip_file* file;
+  std::vector<char> buffer;
+
+ public:
+  explicit gzip_streambuf(const std::string& path);
+  ~gzip_streambuf() override;
+  bool is_open() const { return file != nullptr; }
+
+ protected:
+  int underflow() override;
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override;
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+};
+
+// A std::streambuf that hands full buffers to a thread of its own, which
+// writes them to a file, so that formatting and writing overlap.  With
+// compress, that thread also does the gzip compression; offsets are then
+// those of the uncompressed document.
+class writer_streambuf : public std::streambuf {
+ private:
+  std::FILE* file = nullptr;
+  gzip_file* gz = nullptr;
+  std::size_t buffer_size;
+  std::vector<char> current;
+  std::deque<std::vector<char>> full;  // waiting to be written
+  std::vector<std::vector<char>> spare;
+  std::mutex lock;
+  std::condition_variable changed;
+  bool closing = false, failed = false;
+  long long written = 0;
+  std::thread writer;
+
+  void write_loop();
+  bool hand_over();
+
+ public:
+  explicit writer_streambuf(const std::string& path,
+                            std::size_t buffer_size = 1 << 20,
+                            bool compress = false);
+  ~writer_streambuf() override;
+  bool is_open() const { return file != nullptr || gz != nullptr; }
+  bool close();  // waits for all writes; false if any failed
+
+ protected:
+  int overflow(int c) override;
+  int sync() override;
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override;
+};
+
+// Sinks take the output of the PostScript writers without going through
+// a std::ostream.  A sink has
+//   void write(const char* s, std::size_t n);
+//   long long offset() const;  // bytes so far, or -1 if it cannot tell
+// The writers are instantiated for the four sinks below in pst_sinks.cc.
+
+// Buffered writes to a stdio file, which is not closed by the sink.
+class file_sink {
+ private:
+  std::FILE* file;
+  std::vector<char> buffer;
+  std::size_t used = 0;
+  long long written = 0;
+  bool failed = false;
+
+ public:
+  explicit file_sink(std::FILE* file, std::size_t buffer_size = 1 << 16)
+    : file(file), buffer(buffer_size) {}
+  ~file_sink() {
+    if (used > 0)
+      flush();
+  }
+  void write(const char* s, std::size_t n);
+  long long offset() const { return written + static_cast<long long>(used); }
+  bool flush();  // false if any write has failed
+};
+
+// Keeps the output in memory.
+class memory_sink {
+ public:
+  std::string data;
+
+  void write(const char* s, std::size_t n) { data.append(s, n); }
+  long long offset() const { return static_cast<long long>(data.size()); }
+};
+
+// Only counts the bytes, for the exact size of the output.
+class counting_sink {
+ public:
+  long long bytes = 0;
+
+  void write(const char*, std::size_t n) { bytes += static_cast<long long>(n); }
+  long long offset() const { return bytes; }
+};
+
+// Writes to a std::ostream, for anything that is not a sink of its own.
+class ostream_sink {
+ private:
+  std::ostream& os;
+
+ public:
+  explicit ostream_sink(std::ostream& os) : os(os) {}
+  void write(const char* s, std::size_t n) {
+    os.write(s, static_cast<std::streamsize>(n));
+  }
+  long long offset() const { return static_cast<long long>(os.tellp()); }
+};
+
+// Enables the writers for sinks only, so that streams keep taking the
+// std::ostream overloads.
+template <class Sink>
+using if_sink = decltype(std::declval<const Sink&>().offset(), void());
+
 // ___________________________________________________________________________
 // Function declarations
 
 double string_width(const std::string& s, const font& f, double sz);
 
+bool alloc_stats_enabled();
+void set_alloc_phase(alloc_phase phase);
+alloc_stats get_alloc_stats(alloc_phase phase);
+void write_alloc_stats(std::ostream& os);
+
+void start_trace(const std::string& path);
+void trace_thread_name(const char* name);
+bool write_trace(const std::string& path);
+
+bool gzip_available();
+gzip_file* gzip_open(const std::string& path, const char* mode);
+long gzip_read(gzip_file* f, char* data, std::size_t n);
+bool gzip_write(gzip_file* f, const char* data, std::size_t n);
+bool gzip_rewind(gzip_file* f);
+bool gzip_close(gzip_file* f);
+
 bool seglists_intersect(const std::vector<segment>& s1,
                         const std::vector<segment>& s2);
+bool seglists_intersect(const segment_list& s1, const segment_list& s2);
 bool segments_intersect(const segment& s1, const segment& s2);
 
 std::unique_ptr<pstree> ps_restore_tree(std::istream& is);
+std::unique_ptr<pstree> ps_restore_tree(std::istream& is,
+                                        const collapse_limits& limits);
+std::unique_ptr<pstree> ps_restore_tree(std::istream& is,
+                                        const collapse_limits& limits,
+                                        int level, long& nodes, int& levels);
+std::vector<std::unique_ptr<pstree>> ps_restore_forest(
+    std::istream& is, const collapse_limits& limits);
+bool ps_skip_tree(std::istream& is, long& nodes, int& levels);
+bool ps_seek_subtree(std::istream& is, const std::string& path);
+bool ps_scan_tree(std::istream& is, tree_stats& stats);
+bool ps_scan_forest(std::istream& is, tree_stats& stats);
+std::unique_ptr<std::streambuf> rewindable(
+    std::unique_ptr<std::streambuf> input);
+void write_stats_json(const tree_stats& stats, std::ostream& os);
+void reserve_segments(pstree* t, const tree_stats& stats);
+std::string subtree_summary(long nodes, int levels);
+std::size_t shape_hash(const pstree* t);
+void hash_shapes(pstree* t);
+subtree_layout save_layout(const pstree* t);
+void copy_layout(const subtree_layout& saved, pstree* t);
 
 void adjust_tree_horizontally(pstree* t, double interspace);
 void adjust_tree_vertically(pstree* t);
 void move_seglist_horizontally(std::vector<segment>& segs, double delta);
 void move_seglist_vertically(std::vector<segment>& segs, double delta);
+void move_seglist_horizontally(segment_list& segs, double delta);
+void move_seglist_vertically(segment_list& segs, double delta);
 void move_tree_horizontally(pstree* t, double delta);
 void move_tree_vertically(pstree* t, double delta);
 void ps_draw_arc(double x0, double y0, double x3, double y3, std::ostream& os);
@@ -64,10 +506,120 @@ void ps_draw_string(const std::string& s, double x, double y,
                     std::ostream& os);
 void ps_draw_node(pstree* t, double fontsize, std::ostream& os);
 void ps_draw_tree(pstree* t, double fontsize, std::ostream& os);
+void ps_draw_tree_batched(pstree* t, const std::vector<pstree*>& nodes,
+                          double fontsize, std::ostream& os);
+std::vector<pstree*> nodes_along_curve(pstree* t);
+template <class Sink, class = if_sink<Sink>>
+void ps_draw_arc(double x0, double y0, double x3, double y3, Sink& sink);
+template <class Sink, class = if_sink<Sink>>
+void ps_draw_box(double x1, double y1, double x2, double y2, Sink& sink);
+template <class Sink, class = if_sink<Sink>>
+void ps_draw_string(const std::string& s, double x, double y, Sink& sink);
+template <class Sink, class = if_sink<Sink>>
+void ps_draw_node(pstree* t, double fontsize, Sink& sink);
+template <class Sink, class = if_sink<Sink>>
+void ps_draw_tree(pstree* t, double fontsize, Sink& sink);
+template <class Sink, class = if_sink<Sink>>
+void ps_draw_tree_batched(pstree* t, const std::vector<pstree*>& nodes,
+                          double fontsize, Sink& sink);
+page_plan plan_pages(double x, double y, double width, double height);
+void write_plan_json(const page_plan& plan, double fontsize, std::ostream& os,
+                     long long bytes = -1);
+void ps_write_prolog(const std::string& fontname, double fontsize,
+                     int pages, dsc_index& index, std::ostream& os);
+void ps_write_procs(const std::string& fontname, double fontsize,
+                    std::ostream& os);
+void ps_write_setup(const page_plan& plan, std::ostream& os);
+void ps_begin_page(const page_plan& plan, int row, int col, double fontsize,
+                   dsc_index& index, std::ostream& os);
+void ps_end_page(std::ostream& os);
+void ps_write_trailer(const dsc_index& index, std::ostream& os);
+template <class Sink, class = if_sink<Sink>>
+void ps_write_prolog(const std::string& fontname, double fontsize,
+                     int pages, dsc_index& index, Sink& sink);
+template <class Sink, class = if_sink<Sink>>
+void ps_write_procs(const std::string& fontname, double fontsize,
+                    Sink& sink);
+template <class Sink, class = if_sink<Sink>>
+void ps_write_setup(const page_plan& plan, Sink& sink);
+template <class Sink, class = if_sink<Sink>>
+void ps_begin_page(const page_plan& plan, int row, int col, double fontsize,
+                   dsc_index& index, Sink& sink);
+template <class Sink, class = if_sink<Sink>>
+void ps_end_page(Sink& sink);
+template <class Sink, class = if_sink<Sink>>
+void ps_write_trailer(const dsc_index& index, Sink& sink);
+void ps_render(pstree* t, const font& mainfont, double fontsize,
+               std::ostream& os);
+void ps_write_tree(pstree* t, const std::string& fontname, double fontsize,
+                   std::ostream& os);
+void ps_write_forest(std::vector<std::unique_ptr<pstree>>& forest,
+                     const std::string& fontname, double fontsize,
+                     std::ostream& os);
+std::unique_ptr<spilled_tree> ps_stream_tree(std::istream& is,
+                                             const font& mainfont,
+                                             double fontsize,
+                                             double interspace);
+void ps_draw_spilled_tree(spilled_tree* t, double fontsize, std::ostream& os);
+template <class Sink, class = if_sink<Sink>>
+void ps_draw_spilled_tree(spilled_tree* t, double fontsize, Sink& sink);
+template <class Sink, class = if_sink<Sink>>
+bool ps_draw_merged_tree(pstree* t, int depth,
+                         const std::vector<std::string>& record_files,
+                         const font& mainfont, double fontsize, Sink& sink);
+std::unique_ptr<pstree> ps_pipeline_tree(std::istream& is,
+                                         const font& mainfont,
+                                         double fontsize, double interspace,
+                                         const collapse_limits& limits);
+void pdf_draw_arc(double x0, double y0, double x3, double y3,
+                  std::ostream& os);
+void pdf_draw_box(double x1, double y1, double x2, double y2,
+                  std::ostream& os);
+void pdf_draw_string(const std::string& s, double x, double y,
+                     std::ostream& os);
+void pdf_draw_node(pstree* t, double fontsize, std::ostream& os);
+void pdf_draw_tree(pstree* t, double fontsize, std::ostream& os);
+void pdf_write_trees(const std::vector<pstree*>& trees, const font& mainfont,
+                     const font& rulefont, double fontsize, std::ostream& os);
+void svg_write_tree(pstree* t, const std::string& fontname, double fontsize,
+                    std::ostream& os);
+void svg_write_tile(const std::vector<const index_entry*>& hits, double x,
+                    double y, double width, double height, int pixel_width,
+                    int pixel_height, const std::string& fontname,
+                    double fontsize, std::ostream& os);
+bool serve_requests(std::istream& in, std::ostream& out, font_cache& fonts);
+bool serve_unix_socket(const std::string& path, font_cache& fonts);
+int connect_unix_socket(const std::string& path);
+bool request_render(std::iostream& server, const std::string& fontname,
+                    double fontsize, const std::string& treedata,
+                    std::ostream& ps, std::string& error);
 void set_node_size(pstree* t, const font& mainfont, double fontsize,
                    double interspace);
+void set_node_geometry(pstree* t, double fontsize, double interspace);
+void rebuild_seglist(pstree* t, double fontsize);
 void set_sizes(pstree* t, const font& mainfont, double fontsize,
                double interspace);
+void set_forest_sizes(std::vector<std::unique_ptr<pstree>>& forest,
+                      const font& mainfont, double fontsize,
+                      double interspace, int threads);
+std::unique_ptr<pstree> ps_restore_top_levels(std::istream& is,
+                                              const collapse_limits& limits,
+                                              int depth, int wanted,
+                                              std::vector<shard_info>& shards);
+void write_shard(const shard_info& shard, const std::string& fontname,
+                 double fontsize, std::ostream& summary,
+                 std::ostream& records);
+bool read_shard(std::istream& is, const shard_info& shard,
+                const std::string& fontname, double fontsize);
+void set_top_sizes(pstree* t, int depth, const font& mainfont,
+                   double fontsize, double interspace);
+bool write_tile_pyramid(pstree* t, const std::string& fontname,
+                        double fontsize, const std::string& basename,
+                        int threads);
+bool fits_budget(const page_budget& budget, double x, double y,
+                 double width, double height);
+double fit_font_size(pstree* t, const font& mainfont,
+                     const page_budget& budget, double fontsize);
 
 // ___________________________________________________________________________
 // pst.h
@@ -0,0 +1,184 @@
+// ___________________________________________________________________________
+// Includes and defines
+
+#include <atomic>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+
+#include "pst.h"
+
+// ___________________________________________________________________________
+// Counters, kept in plain atomics so that counting never allocates
+
+namespace {
+
+struct phase_counters {
+  std::atomic<long long> allocations{0};
+  std::atomic<long long> bytes{0};
+  std::atomic<long long> peak{0};
+};
+
+phase_counters counters[alloc_phases];
+std::atomic<int> current_phase{alloc_startup};
+std::atomic<long long> live{0};
+
+const char* const phase_names[alloc_phases] = {"startup", "parse", "layout",
+                                               "emit"};
+
+} // namespace
+
+// ___________________________________________________________________________
+
+#ifdef PST_ALLOC_STATS
+
+// Every block carries its size in front, so that delete knows how much
+// becomes free; 16 bytes keep the block aligned as malloc aligns it.
+static const std::size_t header = 16;
+
+static void* counted_alloc(std::size_t size)
+{
+  char* block = static_cast<char*>(std::malloc(size + header));
+  if (!block)
+    return nullptr;
+  *reinterpret_cast<std::size_t*>(block) = size;
+
+  phase_counters& c = counters[current_phase.load(std::memory_order_relaxed)];
+  c.allocations.fetch_add(1, std::memory_order_relaxed);
+  c.bytes.fetch_add(static_cast<long long>(size), std::memory_order_relaxed);
+  long long now = live.fetch_add(static_cast<long long>(size),
+                                 std::memory_order_relaxed) +
+    static_cast<long long>(size);
+  long long peak = c.peak.load(std::memory_order_relaxed);
+  while (now > peak &&
+         !c.peak.compare_exchange_weak(peak, now, std::memory_order_relaxed))
+    ;
+  return block + header;
+
+} // counted_alloc
+
+// ___________________________________________________________________________
+
+static void counted_free(void* p)
+{
+  if (!p)
+    return;
+  char* block = static_cast<char*>(p) - header;
+  live.fetch_sub(static_cast<long long>(*reinterpret_cast<std::size_t*>(block)),
+                 std::memory_order_relaxed);
+  std::free(block);
+
+} // counted_free
+
+// ___________________________________________________________________________
+// The replaceable global allocation functions.  The over-aligned forms are
+// left alone; nothing in pst uses them.
+
+void* operator new(std::size_t size)
+{
+  if (void* p = counted_alloc(size))
+    return p;
+  throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+  return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+  return counted_alloc(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+  return counted_alloc(size);
+}
+
+void operator delete(void* p) noexcept
+{
+  counted_free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+  counted_free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+  counted_free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+  counted_free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+  counted_free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+  counted_free(p);
+}
+
+#endif
+
+// ___________________________________________________________________________
+
+bool alloc_stats_enabled()
+{
+#ifdef PST_ALLOC_STATS
+  return true;
+#else
+  return false;
+#endif
+
+} // alloc_stats_enabled
+
+// ___________________________________________________________________________
+
+void set_alloc_phase(alloc_phase phase)
+{
+  // the peak of a phase starts from what the phases before left behind
+  counters[phase].peak.store(live.load(std::memory_order_relaxed),
+                             std::memory_order_relaxed);
+  current_phase.store(phase, std::memory_order_relaxed);
+
+} // set_alloc_phase
+
+// ___________________________________________________________________________
+
+alloc_stats get_alloc_stats(alloc_phase phase)
+{
+  alloc_stats s;
+  s.allocations = counters[phase].allocations.load(std::memory_order_relaxed);
+  s.bytes = counters[phase].bytes.load(std::memory_order_relaxed);
+  s.peak = counters[phase].peak.load(std::memory_order_relaxed);
+  return s;
+
+} // get_alloc_stats
+
+// ___________________________________________________________________________
+
+void write_alloc_stats(std::ostream& os)
+{
+  if (!alloc_stats_enabled())
+    return;
+  os << "Heap use      allocations            bytes        peak live\n";
+  for (int i = 0; i < alloc_phases; i++) {
+    alloc_stats s = get_alloc_stats(static_cast<alloc_phase>(i));
+    os << std::left << std::setw(8) << phase_names[i] << std::right
+       << std::setw(17) << s.allocations << std::setw(17) << s.bytes
+       << std::setw(17) << s.peak << "\n";
+  }
+
+} // write_alloc_stats
+
+// ___________________________________________________________________________
+// pst_alloc.cc
@@ -0,0 +1,90 @@
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "pst.h"
+
+// Sends tree files to a running "pst --serve=socket" and writes the
+// PostScript that comes back next to each file, just as pst would.
+int main(int argc, char** argv)
+{
+  std::string fontname = "Helvetica-Narrow";
+  double fontsize = 6.0;
+  bool shutdown = false;
+  std::vector<std::string> args;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (argv[i][0] == '-')
+      switch (argv[i][1])
+      {
+	case 'f':
+	  fontname = &argv[i][2];
+	  break;
+	case 's':
+	  fontsize = std::stod(&argv[i][2]);
+	  break;
+	case '-':
+	  if (std::string(argv[i]) == "--shutdown")
+	    shutdown = true;
+	  else
+	    std::cout << "Unrecognized option " << argv[i] << "\n";
+	  break;
+	default:
+	  std::cout << "Unrecognized option " << argv[i][1] << "\n";
+      }
+    else
+      args.push_back(argv[i]);
+  }
+
+  if (args.empty()) {
+    std::cout << "Usage: pst_client [-ffontname] [-ssize] [--shutdown]"
+              << " socket [treefile ...]\n";
+    return 1;
+  }
+
+  int fd = connect_unix_socket(args[0]);
+  if (fd < 0) {
+    std::cout << "Unable to connect to " << args[0] << "\n";
+    return 2;
+  }
+
+  int status = 0;
+  {
+    fd_streambuf buf(fd);
+    std::iostream server(&buf);
+    for (std::size_t i = 1; i < args.size(); i++) {
+      std::ifstream ifp(args[i]);
+      if (!ifp) {
+	std::cout << "Unable to read tree from file " << args[i] << "\n";
+	status = 3;
+	continue;
+      }
+      std::string treedata((std::istreambuf_iterator<char>(ifp)),
+                           std::istreambuf_iterator<char>());
+
+      std::string outname = args[i] + ".ps";
+      std::ofstream ofp(outname);
+      if (!ofp) {
+	std::cout << "Unable to write file " << outname << "\n";
+	status = 4;
+	continue;
+      }
+      std::string error;
+      if (!request_render(server, fontname, fontsize, treedata, ofp, error)) {
+	std::cout << args[i] << ": " << error << "\n";
+	status = 5;
+      }
+    }
+    server << (shutdown ? "shutdown\n" : "quit\n");
+    server.flush();
+  }
+  ::close(fd);
+
+  return status;
+
+} // main
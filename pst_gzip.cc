@@ -0,0 +1,167 @@
+// ___________________________________________________________________________
+// Includes and defines
+
+#include <string>
+#include <vector>
+
+#ifdef PST_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "pst.h"
+
+// ___________________________________________________________________________
+// A zlib gzFile behind an opaque type, so that pst.h does not need zlib
+
+struct gzip_file {
+#ifdef PST_HAVE_ZLIB
+  gzFile gz;
+#endif
+};
+
+// ___________________________________________________________________________
+
+bool gzip_available()
+{
+#ifdef PST_HAVE_ZLIB
+  return true;
+#else
+  return false;
+#endif
+
+} // gzip_available
+
+// ___________________________________________________________________________
+
+gzip_file* gzip_open(const std::string& path, const char* mode)
+{
+#ifdef PST_HAVE_ZLIB
+  gzFile gz = gzopen(path.c_str(), mode);
+  if (!gz)
+    return nullptr;
+  // larger than the default, as the reads and writes are large
+  gzbuffer(gz, 1 << 17);
+  return new gzip_file{gz};
+#else
+  (void)path;
+  (void)mode;
+  return nullptr;
+#endif
+
+} // gzip_open
+
+// ___________________________________________________________________________
+
+long gzip_read(gzip_file* f, char* data, std::size_t n)
+{
+#ifdef PST_HAVE_ZLIB
+  return gzread(f->gz, data, static_cast<unsigned>(n));
+#else
+  (void)f;
+  (void)data;
+  (void)n;
+  return -1;
+#endif
+
+} // gzip_read
+
+// ___________________________________________________________________________
+
+bool gzip_write(gzip_file* f, const char* data, std::size_t n)
+{
+#ifdef PST_HAVE_ZLIB
+  return n == 0 || gzwrite(f->gz, data, static_cast<unsigned>(n)) ==
+    static_cast<int>(n);
+#else
+  (void)f;
+  (void)data;
+  (void)n;
+  return false;
+#endif
+
+} // gzip_write
+
+// ___________________________________________________________________________
+
+bool gzip_rewind(gzip_file* f)
+{
+#ifdef PST_HAVE_ZLIB
+  return gzrewind(f->gz) == 0;
+#else
+  (void)f;
+  return false;
+#endif
+
+} // gzip_rewind
+
+// ___________________________________________________________________________
+
+bool gzip_close(gzip_file* f)
+{
+  bool good = true;
+#ifdef PST_HAVE_ZLIB
+  good = gzclose(f->gz) == Z_OK;
+#endif
+  delete f;
+  return good;
+
+} // gzip_close
+
+// ___________________________________________________________________________
+
+gzip_streambuf::gzip_streambuf(const std::string& path)
+  : file(gzip_open(path, "rb")), buffer(1 << 16)
+{
+  setg(buffer.data(), buffer.data(), buffer.data());
+
+} // gzip_streambuf::gzip_streambuf
+
+// ___________________________________________________________________________
+
+gzip_streambuf::~gzip_streambuf()
+{
+  if (file)
+    gzip_close(file);
+
+} // gzip_streambuf::~gzip_streambuf
+
+// ___________________________________________________________________________
+
+int gzip_streambuf::underflow()
+{
+  if (!file)
+    return traits_type::eof();
+  long n = gzip_read(file, buffer.data(), buffer.size());
+  if (n <= 0)
+    return traits_type::eof();
+  setg(buffer.data(), buffer.data(), buffer.data() + n);
+  return traits_type::to_int_type(*gptr());
+
+} // gzip_streambuf::underflow
+
+// ___________________________________________________________________________
+
+std::streambuf::pos_type gzip_streambuf::seekoff(
+    off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+{
+  // only back to the start, which is all that a second pass needs
+  if (off != 0 || dir != std::ios_base::beg)
+    return pos_type(off_type(-1));
+  return seekpos(pos_type(0), which);
+
+} // gzip_streambuf::seekoff
+
+// ___________________________________________________________________________
+
+std::streambuf::pos_type gzip_streambuf::seekpos(pos_type pos,
+                                                 std::ios_base::openmode)
+{
+  if (!file || pos != pos_type(0) || !gzip_rewind(file))
+    return pos_type(off_type(-1));
+  setg(buffer.data(), buffer.data(), buffer.data());
+  return pos;
+
+} // gzip_streambuf::seekpos
+
+// ___________________________________________________________________________
+// pst_gzip.cc
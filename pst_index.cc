@@ -0,0 +1,250 @@
+// ___________________________________________________________________________
+// Includes and defines
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "pst.h"
+
+// Entries per node of the packed R-tree
+static const std::size_t fanout = 16;
+
+// ___________________________________________________________________________
+
+static index_entry box_entry(pstree* n, double fontsize)
+{
+  // the box as ps_draw_node draws it
+  double y2 = n->ybox + 0.8 * fontsize;
+  return {n->xbox - n->stringswidth / 2.0 - 0.2 * fontsize, y2 - n->boxheight,
+          n->xbox + n->stringswidth / 2.0 + 0.2 * fontsize, y2, n, nullptr};
+
+} // box_entry
+
+// ___________________________________________________________________________
+
+static index_entry arc_entry(pstree* n, pstree* c)
+{
+  // an arc stays within the box around its control points
+  return {std::min(n->xbox, c->xbox), std::min(n->ybox, c->ybox),
+          std::max(n->xbox, c->xbox), std::max(n->ybox, c->ybox), n, c};
+
+} // arc_entry
+
+// ___________________________________________________________________________
+
+static void collect_entries(pstree* t, double fontsize, double min_extent,
+                            std::vector<index_entry>& entries)
+{
+  // iterative, since trees can be far deeper than the call stack allows
+  std::vector<pstree*> pending = {t};
+  while (!pending.empty()) {
+    pstree* n = pending.back();
+    pending.pop_back();
+    if (!n || n->nodestrings.empty())
+      continue;
+
+    // a subtree too small to tell apart is only its extent
+    if (n->width < min_extent && n->height < min_extent) {
+      index_entry e = {n->x, n->y, n->x + n->width, n->y + n->height, n,
+                       nullptr};
+      e.summary = true;
+      entries.push_back(e);
+      continue;
+    }
+
+    entries.push_back(box_entry(n, fontsize));
+    if (n->left && n->right)
+      for (pstree* c : {n->left.get(), n->right.get()}) {
+	entries.push_back(arc_entry(n, c));
+	pending.push_back(c);
+      }
+  }
+
+} // collect_entries
+
+// ___________________________________________________________________________
+
+static void sort_tiles(std::vector<index_entry>& entries)
+{
+  // Sort-Tile-Recursive packing: vertical slices by x, each sorted by y,
+  // so that every run of fanout entries covers a compact tile.
+  auto cx = [](const index_entry& e) { return e.x1 + e.x2; };
+  auto cy = [](const index_entry& e) { return e.y1 + e.y2; };
+  std::sort(entries.begin(), entries.end(),
+            [&](const index_entry& a, const index_entry& b) {
+              return cx(a) < cx(b);
+            });
+
+  std::size_t pages = (entries.size() + fanout - 1) / fanout;
+  std::size_t slices = static_cast<std::size_t>(
+      std::ceil(std::sqrt(static_cast<double>(pages))));
+  std::size_t slice = std::max<std::size_t>(slices, 1) * fanout;
+  for (std::size_t i = 0; i < entries.size(); i += slice) {
+    auto end = entries.begin() + std::min(i + slice, entries.size());
+    std::sort(entries.begin() + i, end,
+              [&](const index_entry& a, const index_entry& b) {
+                return cy(a) < cy(b);
+              });
+  }
+
+} // sort_tiles
+
+// ___________________________________________________________________________
+
+node_index::node_index(pstree* t, double fontsize, double min_extent)
+{
+  std::vector<index_entry> entries;
+  collect_entries(t, fontsize, min_extent, entries);
+  sort_tiles(entries);
+  levels.push_back(std::move(entries));
+
+  // each level above holds the bounds of fanout entries of the one below
+  while (levels.back().size() > 1) {
+    const std::vector<index_entry>& below = levels.back();
+    std::vector<index_entry> above;
+    above.reserve((below.size() + fanout - 1) / fanout);
+    for (std::size_t i = 0; i < below.size(); i += fanout) {
+      index_entry b = below[i];
+      b.node = b.child = nullptr;
+      for (std::size_t j = i + 1; j < std::min(i + fanout, below.size());
+           j++) {
+	b.x1 = std::min(b.x1, below[j].x1);
+	b.y1 = std::min(b.y1, below[j].y1);
+	b.x2 = std::max(b.x2, below[j].x2);
+	b.y2 = std::max(b.y2, below[j].y2);
+      }
+      above.push_back(b);
+    }
+    levels.push_back(std::move(above));
+  }
+
+} // node_index::node_index
+
+// ___________________________________________________________________________
+
+void node_index::query(double x1, double y1, double x2, double y2,
+                       std::vector<const index_entry*>& hits) const
+{
+  if (levels.empty() || levels[0].empty())
+    return;
+  if (x1 > x2)
+    std::swap(x1, x2);
+  if (y1 > y2)
+    std::swap(y1, y2);
+
+  // (level, position) pairs still to visit, starting at the root
+  std::vector<std::pair<std::size_t, std::size_t>> pending = {
+    {levels.size() - 1, 0}};
+  while (!pending.empty()) {
+    auto [level, i] = pending.back();
+    pending.pop_back();
+    const index_entry& e = levels[level][i];
+    if (e.x2 < x1 || e.x1 > x2 || e.y2 < y1 || e.y1 > y2)
+      continue;
+    if (level == 0) {
+      hits.push_back(&e);
+      continue;
+    }
+    const std::vector<index_entry>& below = levels[level - 1];
+    std::size_t end = std::min((i + 1) * fanout, below.size());
+    for (std::size_t j = i * fanout; j < end; j++)
+      pending.push_back({level - 1, j});
+  }
+
+} // node_index::query
+
+// ___________________________________________________________________________
+
+std::vector<pstree*> node_index::nodes_in(double x1, double y1, double x2,
+                                          double y2) const
+{
+  std::vector<const index_entry*> hits;
+  query(x1, y1, x2, y2, hits);
+  std::vector<pstree*> nodes;
+  for (const index_entry* e : hits)
+    if (!e->child)
+      nodes.push_back(e->node);
+  return nodes;
+
+} // node_index::nodes_in
+
+// ___________________________________________________________________________
+
+pstree* node_index::node_at(double x, double y) const
+{
+  // boxes do not overlap, so at most one can hold the point
+  std::vector<const index_entry*> hits;
+  query(x, y, x, y, hits);
+  for (const index_entry* e : hits)
+    if (!e->child)
+      return e->node;
+  return nullptr;
+
+} // node_index::node_at
+
+// ___________________________________________________________________________
+
+static std::uint64_t hilbert_index(std::uint32_t x, std::uint32_t y)
+{
+  // the distance along a Hilbert curve through a 2^16 by 2^16 grid
+  const std::uint32_t n = 1u << 16;
+  std::uint64_t d = 0;
+  for (std::uint32_t s = n / 2; s > 0; s /= 2) {
+    std::uint32_t rx = (x & s) ? 1 : 0;
+    std::uint32_t ry = (y & s) ? 1 : 0;
+    d += static_cast<std::uint64_t>(s) * s * ((3 * rx) ^ ry);
+    if (ry == 0) {
+      if (rx == 1) {
+	x = n - 1 - x;
+	y = n - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return d;
+
+} // hilbert_index
+
+// ___________________________________________________________________________
+
+std::vector<pstree*> nodes_along_curve(pstree* t)
+{
+  // the drawn nodes, by where their boxes are on a space-filling curve
+  // over the square around the tree, so that nodes close in the list are
+  // close on the page
+  std::vector<std::pair<std::uint64_t, pstree*>> keyed;
+  double extent = std::max(t->width, t->height);
+  double scale = extent > 0.0 ? 65535.0 / extent : 0.0;
+  std::vector<pstree*> pending = {t};
+  while (!pending.empty()) {
+    pstree* n = pending.back();
+    pending.pop_back();
+    if (!n || n->nodestrings.empty())
+      continue;
+    double x = std::clamp((n->xbox - t->x) * scale, 0.0, 65535.0);
+    double y = std::clamp((n->ybox - t->y) * scale, 0.0, 65535.0);
+    keyed.push_back({hilbert_index(static_cast<std::uint32_t>(x),
+                                   static_cast<std::uint32_t>(y)), n});
+    if (n->left && n->right) {
+      pending.push_back(n->right.get());
+      pending.push_back(n->left.get());
+    }
+  }
+  std::stable_sort(keyed.begin(), keyed.end(),
+                   [](const auto& a, const auto& b) {
+		     return a.first < b.first;
+		   });
+
+  std::vector<pstree*> nodes;
+  nodes.reserve(keyed.size());
+  for (const auto& k : keyed)
+    nodes.push_back(k.second);
+  return nodes;
+
+} // nodes_along_curve
+
+// ___________________________________________________________________________
+// pst_index.cc
@@ -2,12 +2,20 @@
 // ___________________________________________________________________________
 // Includes and defines
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <cmath>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 
 #include "pst.h"
 
@@ -74,6 +82,8 @@ void adjust_tree_horizontally(pstree* t, double interspace)
   pstree* r = t->right.get();
   if (l && r)
   {
+    trace_span span("adjust", "steps");
+    int steps = 0;
     double xmin = l->xbox - r->xbox;
     double xmax = l->x + l->width - r->x + interspace;
     double xlast = 0;
@@ -87,7 +97,9 @@ void adjust_tree_horizontally(pstree* t, double interspace)
 	xmin = xmid;
       else
 	xmax = xmid;
+      steps++;
     }
+    span.set(steps);
     move_tree_horizontally(r, interspace);
     move_seglist_horizontally(r->seglist, interspace);
   }
@@ -122,12 +134,8 @@ void adjust_tree_vertically(pstree* t)
 
 void ps_draw_arc(double x0, double y0, double x3, double y3, std::ostream& os)
 {
-  double y1 = (y0 + y3) / 2.0;
-  os << std::setprecision(2);
-  os << "np " << x0 << " " << y0 << " mt "
-     << x0 << " " << y1 << " "
-     << x3 << " " << y1 << " "
-     << x3 << " " << y3 << " ct sk\n";
+  ostream_sink sink(os);
+  ps_draw_arc(x0, y0, x3, y3, sink);
 
 } // ps_draw_arc
 
@@ -135,11 +143,8 @@ void ps_draw_arc(double x0, double y0, double x3, double y3, std::ostream& os)
 
 void ps_draw_box(double x1, double y1, double x2, double y2, std::ostream& os)
 {
-  os << std::setprecision(2);
-  os << "np " << x1 << " " << y1 << " mt "
-     << x2 << " " << y1 << " lt "
-     << x2 << " " << y2 << " lt "
-     << x1 << " " << y2 << " lt cp er sk\n";
+  ostream_sink sink(os);
+  ps_draw_box(x1, y1, x2, y2, sink);
 
 } // ps_draw_box
 
@@ -147,14 +152,8 @@ void ps_draw_box(double x1, double y1, double x2, double y2, std::ostream& os)
 
 void ps_draw_string(const std::string& s, double x, double y, std::ostream& os)
 {
-  os << std::setprecision(2);
-  os << x << " " << y << " mt (";
-  for (char c : s) {
-    if (c == '(' || c == ')' || c == '\\')
-      os << '\\';
-    os << c;
-  }
-  os << ") sh\n";
+  ostream_sink sink(os);
+  ps_draw_string(s, x, y, sink);
 
 } // ps_draw_string
 
@@ -162,18 +161,8 @@ void ps_draw_string(const std::string& s, double x, double y, std::ostream& os)
 
 void ps_draw_node(pstree* t, double fontsize, std::ostream& os)
 {
-  double x1 = t->xbox - t->stringswidth / 2.0 - 0.2 * fontsize;
-  double x2 = t->xbox + t->stringswidth / 2.0 + 0.2 * fontsize;
-  double y2 = t->ybox + 0.8 * fontsize;
-  double y1 = y2 - t->boxheight;
-  ps_draw_box(x1, y1, x2, y2, os);
-
-  x1 = t->xbox;
-  y1 = t->ybox - 0.4 * fontsize;
-  for (const auto& ns : t->nodestrings) {
-    ps_draw_string(ns.text, x1 - ns.width / 2.0, y1, os);
-    y1 -= 1.2 * fontsize;
-  }
+  ostream_sink sink(os);
+  ps_draw_node(t, fontsize, sink);
 
 } // ps_draw_node
 
@@ -181,22 +170,286 @@ void ps_draw_node(pstree* t, double fontsize, std::ostream& os)
 
 void ps_draw_tree(pstree* t, double fontsize, std::ostream& os)
 {
-  if (t && !t->nodestrings.empty())
-  {
-    if (t->left && t->right) {
-      ps_draw_arc(t->xbox, t->ybox, t->left->xbox, t->left->ybox, os);
-      ps_draw_tree(t->left.get(), fontsize, os);
-      ps_draw_arc(t->xbox, t->ybox, t->right->xbox, t->right->ybox, os);
-      ps_draw_tree(t->right.get(), fontsize, os);
+  ostream_sink sink(os);
+  ps_draw_tree(t, fontsize, sink);
+
+} // ps_draw_tree
+
+// ___________________________________________________________________________
+
+void ps_draw_tree_batched(pstree* t, const std::vector<pstree*>& nodes,
+                          double fontsize, std::ostream& os)
+{
+  ostream_sink sink(os);
+  ps_draw_tree_batched(t, nodes, fontsize, sink);
+
+} // ps_draw_tree_batched
+
+// ___________________________________________________________________________
+
+page_plan plan_pages(double x, double y, double width, double height)
+{
+  page_plan plan;
+  plan.x = x;
+  plan.y = y;
+  plan.width = width;
+  plan.height = height;
+
+  // compute orientation on page(s)
+  int w1 = static_cast<int>((width + 540 - 1) / 540);
+  int h1 = static_cast<int>((height + 720 - 1) / 720);
+  int w2 = static_cast<int>((width + 720 - 1) / 720);
+  int h2 = static_cast<int>((height + 540 - 1) / 540);
+  if (w2 * h2 > w1 * h1) {
+    plan.wpages = w1;
+    plan.pwidth = 540;
+    plan.pheight = 720;
+    plan.hpages = h1;
+    plan.orientation = 1;
+  }
+  else {
+    plan.wpages = w2;
+    plan.pwidth = 720;
+    plan.pheight = 540;
+    plan.hpages = h2;
+    plan.orientation = 2;
+  }
+  return plan;
+
+} // plan_pages
+
+// ___________________________________________________________________________
+
+void write_plan_json(const page_plan& plan, double fontsize, std::ostream& os,
+                     long long bytes)
+{
+  os << std::fixed << std::setprecision(2);
+  os << "{\"fontsize\": " << fontsize
+     << ", \"x\": " << plan.x << ", \"y\": " << plan.y
+     << ", \"width\": " << plan.width << ", \"height\": " << plan.height
+     << ", \"pages\": " << plan.pages()
+     << ", \"wpages\": " << plan.wpages << ", \"hpages\": " << plan.hpages
+     << ", \"orientation\": \""
+     << (plan.orientation == 2 ? "landscape" : "portrait") << "\""
+     << ", \"page_width\": " << plan.pwidth
+     << ", \"page_height\": " << plan.pheight;
+  if (bytes >= 0)
+    os << ", \"bytes\": " << bytes;
+  os << "}";
+
+} // write_plan_json
+
+// ___________________________________________________________________________
+
+void ps_write_prolog(const std::string& fontname, double fontsize,
+                     int pages, dsc_index& index, std::ostream& os)
+{
+  ostream_sink sink(os);
+  ps_write_prolog(fontname, fontsize, pages, index, sink);
+
+} // ps_write_prolog
+
+// ___________________________________________________________________________
+
+void ps_write_procs(const std::string& fontname, double fontsize,
+                    std::ostream& os)
+{
+  ostream_sink sink(os);
+  ps_write_procs(fontname, fontsize, sink);
+
+} // ps_write_procs
+
+// ___________________________________________________________________________
+
+void ps_write_setup(const page_plan& plan, std::ostream& os)
+{
+  ostream_sink sink(os);
+  ps_write_setup(plan, sink);
+
+} // ps_write_setup
+
+// ___________________________________________________________________________
+
+void ps_begin_page(const page_plan& plan, int row, int col, double fontsize,
+                   dsc_index& index, std::ostream& os)
+{
+  ostream_sink sink(os);
+  ps_begin_page(plan, row, col, fontsize, index, sink);
+
+} // ps_begin_page
+
+// ___________________________________________________________________________
+
+void ps_end_page(std::ostream& os)
+{
+  ostream_sink sink(os);
+  ps_end_page(sink);
+
+} // ps_end_page
+
+// ___________________________________________________________________________
+
+void ps_write_trailer(const dsc_index& index, std::ostream& os)
+{
+  ostream_sink sink(os);
+  ps_write_trailer(index, sink);
+
+} // ps_write_trailer
+
+// ___________________________________________________________________________
+
+void ps_render(pstree* t, const font& mainfont, double fontsize,
+               std::ostream& os)
+{
+  set_sizes(t, mainfont, fontsize, 1.5 * fontsize);
+  ps_write_tree(t, mainfont.name(), fontsize, os);
+
+} // ps_render
+
+// ___________________________________________________________________________
+
+void ps_write_tree(pstree* t, const std::string& fontname, double fontsize,
+                   std::ostream& os)
+{
+  page_plan plan = plan_pages(t->x, t->y, t->width, t->height);
+
+  // use as many pages as needed
+  dsc_index index;
+  ps_write_prolog(fontname, fontsize, plan.pages(), index, os);
+  for (int row = 0; row < plan.hpages; row++)
+    for (int col = 0; col < plan.wpages; col++) {
+      ps_begin_page(plan, row, col, fontsize, index, os);
+      ps_draw_tree(t, fontsize, os);
+      ps_end_page(os);
     }
-    ps_draw_node(t, fontsize, os);
+  ps_write_trailer(index, os);
+
+} // ps_write_tree
+
+// ___________________________________________________________________________
+
+void ps_write_forest(std::vector<std::unique_ptr<pstree>>& forest,
+                     const std::string& fontname, double fontsize,
+                     std::ostream& os)
+{
+  std::vector<page_plan> plans;
+  int pages = 0;
+  for (const auto& t : forest) {
+    plans.push_back(plan_pages(t->x, t->y, t->width, t->height));
+    pages += plans.back().pages();
   }
 
-} // ps_draw_tree
+  // every tree starts on a new page
+  dsc_index index;
+  ps_write_prolog(fontname, fontsize, pages, index, os);
+  for (std::size_t i = 0; i < forest.size(); i++)
+    for (int row = 0; row < plans[i].hpages; row++)
+      for (int col = 0; col < plans[i].wpages; col++) {
+	ps_begin_page(plans[i], row, col, fontsize, index, os);
+	ps_draw_tree(forest[i].get(), fontsize, os);
+	ps_end_page(os);
+      }
+  ps_write_trailer(index, os);
+
+} // ps_write_forest
 
 // ___________________________________________________________________________
 
-std::unique_ptr<pstree> ps_restore_tree(std::istream& is)
+std::size_t shape_hash(const pstree* t)
+{
+  // labels and the children's hashes, so equal subtrees hash alike
+  std::size_t h = t->left && t->right ? 0x2545f4914f6cdd1dULL : 0;
+  auto mix = [&h](std::size_t v) {
+    h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+  };
+  for (const auto& ns : t->nodestrings)
+    mix(std::hash<std::string>()(ns.text));
+  if (t->left && t->right) {
+    mix(t->left->shape);
+    mix(t->right->shape);
+  }
+  return h ? h : 1;
+
+} // shape_hash
+
+// ___________________________________________________________________________
+
+void hash_shapes(pstree* t)
+{
+  if (t->left && t->right) {
+    hash_shapes(t->left.get());
+    hash_shapes(t->right.get());
+  }
+  t->shape = shape_hash(t);
+
+} // hash_shapes
+
+// ___________________________________________________________________________
+
+pstree* tree_builder::add(const std::vector<std::string>& lines,
+                          bool is_branch)
+{
+  if (complete())
+    return nullptr;
+
+  // like the file format, every node has at least one (maybe empty) line
+  auto node = std::make_unique<pstree>();
+  for (const auto& line : lines)
+    node->nodestrings.push_back({line});
+  if (node->nodestrings.empty())
+    node->nodestrings.push_back({""});
+  pstree* t = node.get();
+
+  if (!root)
+    root = std::move(node);
+  else {
+    pstree* parent = open.back();
+    if (!parent->left)
+      parent->left = std::move(node);
+    else {
+      parent->right = std::move(node);
+      open.pop_back();
+    }
+  }
+  if (is_branch)
+    open.push_back(t);
+  return t;
+
+} // tree_builder::add
+
+// ___________________________________________________________________________
+
+pstree* tree_builder::branch(const std::vector<std::string>& lines)
+{
+  return add(lines, true);
+
+} // tree_builder::branch
+
+// ___________________________________________________________________________
+
+pstree* tree_builder::leaf(const std::vector<std::string>& lines)
+{
+  return add(lines, false);
+
+} // tree_builder::leaf
+
+// ___________________________________________________________________________
+
+std::unique_ptr<pstree> tree_builder::finish()
+{
+  if (!complete())
+    return nullptr;
+  hash_shapes(root.get());
+  return std::move(root);
+
+} // tree_builder::finish
+
+// ___________________________________________________________________________
+
+static std::unique_ptr<pstree> restore_node(std::istream& is,
+                                            const collapse_limits& limits,
+                                            int level, long& nodes,
+                                            int& levels)
 {
   int nodetype;
   char c;
@@ -215,10 +468,31 @@ std::unique_ptr<pstree> ps_restore_tree(std::istream& is)
       thisnode->nodestrings.push_back({line});
     }
     is.putback(c);
+    nodes = 1;
+    levels = 1;
     if (nodetype == 'B') {
-      thisnode->left = ps_restore_tree(is);
-      thisnode->right = ps_restore_tree(is);
+      long lnodes = 0, rnodes = 0;
+      int llevels = 0, rlevels = 0;
+      bool collapse = limits.max_levels > 0 && level >= limits.max_levels;
+      if (collapse) {
+	// nothing below this level is drawn, so don't build it either
+	if (!ps_skip_tree(is, lnodes, llevels) ||
+            !ps_skip_tree(is, rnodes, rlevels))
+	  return nullptr;
+      }
+      else {
+	thisnode->left = restore_node(is, limits, level + 1, lnodes, llevels);
+	thisnode->right = restore_node(is, limits, level + 1, rnodes, rlevels);
+      }
+      nodes += lnodes + rnodes;
+      levels += std::max(llevels, rlevels);
+      if (collapse || nodes < limits.min_nodes) {
+	thisnode->left.reset();
+	thisnode->right.reset();
+	thisnode->nodestrings.push_back({subtree_summary(nodes, levels)});
+      }
     }
+    thisnode->shape = shape_hash(thisnode.get());
     break;
 
    default:
@@ -228,10 +502,241 @@ std::unique_ptr<pstree> ps_restore_tree(std::istream& is)
 
   return thisnode;
 
+} // restore_node
+
+// ___________________________________________________________________________
+
+std::unique_ptr<pstree> ps_restore_tree(std::istream& is)
+{
+  return ps_restore_tree(is, collapse_limits());
+
 } // ps_restore_tree
 
 // ___________________________________________________________________________
 
+std::unique_ptr<pstree> ps_restore_tree(std::istream& is,
+                                        const collapse_limits& limits)
+{
+  long nodes = 0;
+  int levels = 0;
+  return restore_node(is, limits, 1, nodes, levels);
+
+} // ps_restore_tree
+
+// ___________________________________________________________________________
+
+std::unique_ptr<pstree> ps_restore_tree(std::istream& is,
+                                        const collapse_limits& limits,
+                                        int level, long& nodes, int& levels)
+{
+  // A subtree whose root is on the given level of the whole tree, collapsed
+  // as it would be there.  nodes and levels count it as it is in the file.
+  return restore_node(is, limits, level, nodes, levels);
+
+} // ps_restore_tree
+
+// ___________________________________________________________________________
+
+std::vector<std::unique_ptr<pstree>> ps_restore_forest(
+    std::istream& is, const collapse_limits& limits)
+{
+  // Trees simply follow each other, optionally with blank lines between
+  std::vector<std::unique_ptr<pstree>> forest;
+  while ((is >> std::ws).peek() != std::char_traits<char>::eof()) {
+    auto t = ps_restore_tree(is, limits);
+    if (!t)
+      break;
+    forest.push_back(std::move(t));
+  }
+  return forest;
+
+} // ps_restore_forest
+
+// ___________________________________________________________________________
+
+bool ps_skip_tree(std::istream& is, long& nodes, int& levels)
+{
+  // Walk one subtree in pre-order without building it.  Only the number of
+  // children still expected on each open level is kept.
+  std::vector<int> pending;
+  nodes = 0;
+  levels = 0;
+  do {
+    int nodetype = is.get();
+    if (nodetype != 'B' && nodetype != 'L') {
+      std::cout << "This is not a proper tree data file\n";
+      return false;
+    }
+    is.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    while (is.peek() == '+')
+      is.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+
+    nodes++;
+    if (static_cast<int>(pending.size()) >= levels)
+      levels = static_cast<int>(pending.size()) + 1;
+    if (nodetype == 'B')
+      pending.push_back(2);
+    else
+      while (!pending.empty() && --pending.back() == 0)
+	pending.pop_back();
+  } while (!pending.empty());
+
+  return true;
+
+} // ps_skip_tree
+
+// ___________________________________________________________________________
+
+bool ps_seek_subtree(std::istream& is, const std::string& path)
+{
+  // Go down the path, a string of l and r, reading only the node types;
+  // a left subtree that is not taken is skipped in one go.
+  if (path.find_first_not_of("lr") != std::string::npos) {
+    std::cout << "A subtree path is made of l and r only, not " << path
+              << "\n";
+    return false;
+  }
+  for (std::size_t step = 0; step < path.size(); step++) {
+    int nodetype = is.get();
+    if (nodetype != 'B') {
+      if (nodetype == 'L')
+	std::cout << "The path " << path << " reaches a leaf after " << step
+                  << " steps\n";
+      else
+	std::cout << "This is not a proper tree data file\n";
+      return false;
+    }
+    is.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    while (is.peek() == '+')
+      is.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+
+    long nodes = 0;
+    int levels = 0;
+    if (path[step] == 'r' && !ps_skip_tree(is, nodes, levels))
+      return false;
+  }
+  return true;
+
+} // ps_seek_subtree
+
+// ___________________________________________________________________________
+
+static long long skip_line(std::istream& is)
+{
+  // the number of bytes before the end of the line
+  is.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+  return is.gcount() - (is.eof() ? 0 : 1);
+
+} // skip_line
+
+// ___________________________________________________________________________
+
+bool ps_scan_tree(std::istream& is, tree_stats& stats)
+{
+  // One pass in pre-order that builds nothing.  For each open branch only
+  // one bit is kept: whether its right subtree has been started.
+  std::vector<bool> in_right;
+  do {
+    int nodetype = is.get();
+    if (nodetype != 'B' && nodetype != 'L') {
+      std::cout << "This is not a proper tree data file: ";
+      if (nodetype == std::char_traits<char>::eof())
+	std::cout << "it ends inside the tree, after line " << stats.lines
+                  << "\n";
+      else
+	std::cout << "line " << stats.lines + 1
+                  << " does not start with B or L\n";
+      return false;
+    }
+    stats.lines++;
+    stats.label_bytes += skip_line(is);
+    while (is.peek() == '+') {
+      is.get();
+      stats.lines++;
+      stats.continuations++;
+      stats.label_bytes += skip_line(is);
+    }
+
+    stats.depth = std::max(stats.depth, static_cast<int>(in_right.size()) + 1);
+    if (nodetype == 'B') {
+      stats.branches++;
+      in_right.push_back(false);
+    }
+    else {
+      stats.leaves++;
+      while (!in_right.empty() && in_right.back())
+	in_right.pop_back();
+      if (!in_right.empty())
+	in_right.back() = true;
+    }
+  } while (!in_right.empty());
+  stats.trees++;
+
+  return true;
+
+} // ps_scan_tree
+
+// ___________________________________________________________________________
+
+bool ps_scan_forest(std::istream& is, tree_stats& stats)
+{
+  // the same blank lines between trees that ps_restore_forest allows
+  for (;;) {
+    int c = is.peek();
+    if (c == std::char_traits<char>::eof())
+      return true;
+    if (std::isspace(c)) {
+      stats.lines += is.get() == '\n';
+      continue;
+    }
+    if (!ps_scan_tree(is, stats))
+      return false;
+  }
+
+} // ps_scan_forest
+
+// ___________________________________________________________________________
+
+std::unique_ptr<std::streambuf> rewindable(
+    std::unique_ptr<std::streambuf> input)
+{
+  // A file is read twice, once to check it and once to build the tree.  A
+  // pipe cannot go back to its start, so it is read into memory first.
+  if (input->pubseekpos(0, std::ios_base::in) !=
+      std::streambuf::pos_type(std::streambuf::off_type(-1)))
+    return input;
+  std::string data((std::istreambuf_iterator<char>(input.get())),
+                   std::istreambuf_iterator<char>());
+  return std::make_unique<std::stringbuf>(data, std::ios_base::in);
+
+} // rewindable
+
+void write_stats_json(const tree_stats& stats, std::ostream& os)
+{
+  os << "{\"trees\": " << stats.trees
+     << ", \"nodes\": " << stats.nodes()
+     << ", \"branches\": " << stats.branches
+     << ", \"leaves\": " << stats.leaves
+     << ", \"label_lines\": " << stats.nodes() + stats.continuations
+     << ", \"label_bytes\": " << stats.label_bytes
+     << ", \"depth\": " << stats.depth << "}";
+
+} // write_stats_json
+
+// ___________________________________________________________________________
+
+std::string subtree_summary(long nodes, int levels)
+{
+  std::string count = std::to_string(nodes);
+  for (int i = static_cast<int>(count.size()) - 3; i > 0; i -= 3)
+    count.insert(i, ",");
+  return "[subtree: " + count + " nodes, depth " + std::to_string(levels) +
+    "]";
+
+} // subtree_summary
+
+// ___________________________________________________________________________
+
 bool seglists_intersect(const std::vector<segment>& s1,
                         const std::vector<segment>& s2)
 {
@@ -333,9 +838,48 @@ bool segments_intersect(const segment& s1, const segment& s2)
 void set_node_size(pstree* t, const font& mainfont,
                    double fontsize, double interspace)
 {
-  double width = 0.0, height = 0.0;
-  for (auto& ns : t->nodestrings) {
+  for (auto& ns : t->nodestrings)
     ns.width = string_width(ns.text, mainfont, fontsize);
+  set_node_geometry(t, fontsize, interspace);
+
+} // set_node_size
+
+// ___________________________________________________________________________
+
+static void push_node_segments(pstree* t, double fontsize)
+{
+  double half_width = t->boxwidth / 2.0;
+  double half_height = t->boxheight / 2.0;
+  if (t->left && t->right) {
+    // create segments somewhat above the arcs that connects the nodes
+    t->seglist.push_back(t->left->xbox - t->left->boxwidth / 2.0,
+                         t->left->ybox + 0.8 * fontsize,
+                         t->xbox - half_width,
+                         t->ybox + half_height);
+    t->seglist.push_back(t->right->xbox + t->right->boxwidth / 2.0,
+                         t->right->ybox + 0.8 * fontsize,
+                         t->xbox + half_width,
+                         t->ybox + half_height);
+  }
+
+  // every side of test box is also a segment
+  t->seglist.push_back(t->xbox - half_width, t->ybox - half_height,
+                        t->xbox - half_width, t->ybox + half_height);
+  t->seglist.push_back(t->xbox + half_width, t->ybox - half_height,
+                        t->xbox + half_width, t->ybox + half_height);
+  t->seglist.push_back(t->xbox - half_width, t->ybox - half_height,
+                        t->xbox + half_width, t->ybox - half_height);
+  t->seglist.push_back(t->xbox - half_width, t->ybox + half_height,
+                        t->xbox + half_width, t->ybox + half_height);
+
+} // push_node_segments
+
+// ___________________________________________________________________________
+
+void set_node_geometry(pstree* t, double fontsize, double interspace)
+{
+  double width = 0.0, height = 0.0;
+  for (const auto& ns : t->nodestrings) {
     if (ns.width > width)
       width = ns.width;
     height += fontsize;
@@ -389,53 +933,364 @@ void set_node_size(pstree* t, const font& mainfont,
 
     // Transfer child seglists into this node's seglist
     t->seglist = std::move(t->left->seglist);
-    t->seglist.insert(t->seglist.end(),
-                      std::make_move_iterator(t->right->seglist.begin()),
-                      std::make_move_iterator(t->right->seglist.end()));
+    t->seglist.append(t->right->seglist);
     t->right->seglist.clear();
-
-    // create segments somewhat above the arcs that connects the nodes
-    t->seglist.push_back({t->left->xbox - t->left->boxwidth / 2.0,
-                          t->left->ybox + 0.8 * fontsize,
-                          t->xbox - half_width,
-                          t->ybox + half_height});
-    t->seglist.push_back({t->right->xbox + t->right->boxwidth / 2.0,
-                          t->right->ybox + 0.8 * fontsize,
-                          t->xbox + half_width,
-                          t->ybox + half_height});
   }
   else {
+    // a leaf keeps its segments from an earlier layout
+    t->seglist.clear();
     t->x = t->y = 0.0;
     t->width = t->boxwidth;
     t->height = t->boxheight;
     t->xbox = t->width / 2.0;
     t->ybox = t->height + 0.4 * fontsize;
   }
+  push_node_segments(t, fontsize);
 
-  // every side of test box is also a segment
-  t->seglist.push_back({t->xbox - half_width, t->ybox - half_height,
-                         t->xbox - half_width, t->ybox + half_height});
-  t->seglist.push_back({t->xbox + half_width, t->ybox - half_height,
-                         t->xbox + half_width, t->ybox + half_height});
-  t->seglist.push_back({t->xbox - half_width, t->ybox - half_height,
-                         t->xbox + half_width, t->ybox - half_height});
-  t->seglist.push_back({t->xbox - half_width, t->ybox + half_height,
-                         t->xbox + half_width, t->ybox + half_height});
+} // set_node_geometry
 
-} // set_node_size
+// ___________________________________________________________________________
+
+void rebuild_seglist(pstree* t, double fontsize)
+{
+  // the segments of a subtree laid out earlier, whose seglist has since
+  // gone to its parent, as set_node_geometry left them
+  if (t->left && t->right) {
+    rebuild_seglist(t->left.get(), fontsize);
+    rebuild_seglist(t->right.get(), fontsize);
+    t->seglist = std::move(t->left->seglist);
+    t->seglist.append(t->right->seglist);
+    t->right->seglist.clear();
+  }
+  else
+    t->seglist.clear();
+  push_node_segments(t, fontsize);
+
+} // rebuild_seglist
+
+// ___________________________________________________________________________
+
+// Laying out shared subtrees
+
+namespace {
+
+// The finished layout of the first instance of a repeated subtree
+struct shared_layout {
+  const pstree* first;
+  subtree_layout layout;
+};
+
+// smaller subtrees are left out of traces; adjust spans show their work
+const long traced_subtree_nodes = 1000;
+
+struct layout_context {
+  const font* mainfont;  // null to scale the labels' unit widths instead
+  double fontsize, interspace;
+  std::unordered_map<std::size_t, int> counts;
+  std::unordered_map<std::size_t, shared_layout> shared;
+};
+
+} // namespace
+
+// ___________________________________________________________________________
+
+static void count_shapes(pstree* t,
+                         std::unordered_map<std::size_t, int>& counts)
+{
+  // only branches are worth sharing; a leaf is quicker to lay out again
+  std::vector<pstree*> pending = {t};
+  while (!pending.empty()) {
+    pstree* n = pending.back();
+    pending.pop_back();
+    if (n->left && n->right) {
+      if (n->shape)
+	counts[n->shape]++;
+      pending.push_back(n->left.get());
+      pending.push_back(n->right.get());
+    }
+  }
+
+} // count_shapes
+
+// ___________________________________________________________________________
+
+static bool same_shape(const pstree* a, const pstree* b)
+{
+  // equal hashes are only a hint; compare labels and structure
+  std::vector<std::pair<const pstree*, const pstree*>> pending = {{a, b}};
+  while (!pending.empty()) {
+    auto [x, y] = pending.back();
+    pending.pop_back();
+    if (x->nodestrings.size() != y->nodestrings.size() ||
+        !x->left != !y->left || !x->right != !y->right)
+      return false;
+    for (std::size_t i = 0; i < x->nodestrings.size(); i++)
+      if (x->nodestrings[i].text != y->nodestrings[i].text)
+	return false;
+    if (x->left && x->right) {
+      pending.push_back({x->left.get(), y->left.get()});
+      pending.push_back({x->right.get(), y->right.get()});
+    }
+  }
+  return true;
+
+} // same_shape
+
+// ___________________________________________________________________________
+
+subtree_layout save_layout(const pstree* t)
+{
+  subtree_layout saved;
+  saved.seglist = t->seglist;
+  std::vector<const pstree*> pending = {t};
+  while (!pending.empty()) {
+    const pstree* n = pending.back();
+    pending.pop_back();
+    saved.nodes.push_back({n->stringswidth, n->width, n->height, n->x, n->y,
+                           n->xbox, n->ybox, n->boxwidth, n->boxheight});
+    for (const auto& ns : n->nodestrings)
+      saved.widths.push_back(ns.width);
+    if (n->left && n->right) {
+      pending.push_back(n->right.get());
+      pending.push_back(n->left.get());
+    }
+  }
+  return saved;
+
+} // save_layout
+
+// ___________________________________________________________________________
+
+void copy_layout(const subtree_layout& saved, pstree* t)
+{
+  std::size_t node = 0, width = 0;
+  std::vector<pstree*> pending = {t};
+  while (!pending.empty()) {
+    pstree* n = pending.back();
+    pending.pop_back();
+    const subtree_layout::node& g = saved.nodes[node++];
+    n->stringswidth = g.stringswidth;
+    n->width = g.width;
+    n->height = g.height;
+    n->x = g.x;
+    n->y = g.y;
+    n->xbox = g.xbox;
+    n->ybox = g.ybox;
+    n->boxwidth = g.boxwidth;
+    n->boxheight = g.boxheight;
+    for (auto& ns : n->nodestrings)
+      ns.width = saved.widths[width++];
+    n->seglist.clear();
+    if (n->left && n->right) {
+      pending.push_back(n->right.get());
+      pending.push_back(n->left.get());
+    }
+  }
+  t->seglist = saved.seglist;
+
+} // copy_layout
+
+// ___________________________________________________________________________
+
+static long lay_out(pstree* t, layout_context& ctx)
+{
+  trace_span span("layout", "nodes");
+  long nodes = 1;
+
+  // Layout does not depend on where a subtree ends up, so every instance
+  // of a repeated subtree takes the layout of the first one.
+  auto count = t->left && t->shape ? ctx.counts.find(t->shape)
+                                   : ctx.counts.end();
+  bool repeated = count != ctx.counts.end() && count->second > 1;
+  if (repeated) {
+    auto saved = ctx.shared.find(t->shape);
+    if (saved != ctx.shared.end() && same_shape(saved->second.first, t)) {
+      copy_layout(saved->second.layout, t);
+      span.drop();
+      return static_cast<long>(saved->second.layout.nodes.size());
+    }
+  }
+
+  if (t->left && t->right) {
+    nodes += lay_out(t->left.get(), ctx);
+    nodes += lay_out(t->right.get(), ctx);
+  }
+  for (auto& ns : t->nodestrings)
+    ns.width = ctx.mainfont
+      ? string_width(ns.text, *ctx.mainfont, ctx.fontsize)
+      : ns.unit_width * ctx.fontsize;
+  set_node_geometry(t, ctx.fontsize, ctx.interspace);
+
+  if (repeated && !ctx.shared.count(t->shape))
+    ctx.shared.emplace(t->shape, shared_layout{t, save_layout(t)});
+
+  if (nodes < traced_subtree_nodes)
+    span.drop();
+  span.set(nodes);
+  return nodes;
+
+} // lay_out
 
 // ___________________________________________________________________________
 
 void set_sizes(pstree* t, const font& mainfont, double fontsize,
                double interspace)
 {
+  layout_context ctx = {&mainfont, fontsize, interspace, {}, {}};
+  count_shapes(t, ctx.counts);
+  lay_out(t, ctx);
+
+} // set_sizes
+
+// ___________________________________________________________________________
+
+void reserve_segments(pstree* t, const tree_stats& stats)
+{
+  // The leftmost leaf starts the segment list that every node on the way
+  // up takes over from its left child, so that it ends up at the root
+  // holding the whole outline: two horizontal and two vertical box sides
+  // per node, and two segments above the arcs of each branch.
+  while (t->left && t->right)
+    t = t->left.get();
+  std::size_t nodes = static_cast<std::size_t>(stats.nodes());
+  std::size_t branches = static_cast<std::size_t>(stats.branches);
+  t->seglist.reserve(2 * nodes, 2 * nodes, 2 * branches);
+
+} // reserve_segments
+
+// ___________________________________________________________________________
+
+void set_forest_sizes(std::vector<std::unique_ptr<pstree>>& forest,
+                      const font& mainfont, double fontsize,
+                      double interspace, int threads)
+{
+  // The trees share nothing but the font, so each is one task.  Workers
+  // take the next tree that nobody has started yet.
+  std::atomic<std::size_t> next(0);
+  auto worker = [&] {
+    for (std::size_t i; (i = next++) < forest.size();) {
+      trace_span span("tree", "index", static_cast<long long>(i));
+      set_sizes(forest[i].get(), mainfont, fontsize, interspace);
+    }
+  };
+
+  threads = std::min(threads, static_cast<int>(forest.size()));
+  std::vector<std::thread> pool;
+  for (int i = 1; i < threads; i++)
+    pool.emplace_back([&] {
+      trace_thread_name("layout");
+      worker();
+    });
+  worker();
+  for (auto& th : pool)
+    th.join();
+
+} // set_forest_sizes
+
+// ___________________________________________________________________________
+
+static void measure_labels(pstree* t, const font& mainfont)
+{
+  for (auto& ns : t->nodestrings)
+    ns.unit_width = string_width(ns.text, mainfont, 1.0);
   if (t->left && t->right) {
-    set_sizes(t->left.get(), mainfont, fontsize, interspace);
-    set_sizes(t->right.get(), mainfont, fontsize, interspace);
+    measure_labels(t->left.get(), mainfont);
+    measure_labels(t->right.get(), mainfont);
   }
-  set_node_size(t, mainfont, fontsize, interspace);
 
-} // set_sizes
+} // measure_labels
+
+// ___________________________________________________________________________
+
+static void relayout(pstree* t, double fontsize, double interspace)
+{
+  layout_context ctx = {nullptr, fontsize, interspace, {}, {}};
+  count_shapes(t, ctx.counts);
+  lay_out(t, ctx);
+
+} // relayout
+
+// ___________________________________________________________________________
+
+bool fits_budget(const page_budget& budget, double x, double y,
+                 double width, double height)
+{
+  if (budget.pages > 0 &&
+      plan_pages(x, y, width, height).pages() > budget.pages)
+    return false;
+  if (budget.width > 0.0 && width > budget.width)
+    return false;
+  if (budget.height > 0.0 && height > budget.height)
+    return false;
+  return true;
+
+} // fits_budget
+
+// ___________________________________________________________________________
+
+static double fit_scale(const page_budget& budget, const pstree* t)
+{
+  // the largest factor by which the laid out tree could grow and still fit
+  double k_lo = 0.0, k_hi = 1.0;
+  while (k_hi < 1e6 &&
+         fits_budget(budget, k_hi * t->x, k_hi * t->y, k_hi * t->width,
+                     k_hi * t->height))
+    k_hi *= 2.0;
+  for (int i = 0; i < 40; i++) {
+    double k = (k_lo + k_hi) / 2.0;
+    if (fits_budget(budget, k * t->x, k * t->y, k * t->width, k * t->height))
+      k_lo = k;
+    else
+      k_hi = k;
+  }
+  return k_lo;
+
+} // fit_scale
+
+// ___________________________________________________________________________
+
+double fit_font_size(pstree* t, const font& mainfont,
+                     const page_budget& budget, double fontsize)
+{
+  // Sizes are tried in hundredths of a point, as they are printed in the
+  // output.  The label widths are summed once; each try only redoes the
+  // geometry, which gives the same layout as set_sizes at that size.
+  const long max_size = 100000;
+  measure_labels(t, mainfont);
+  long lo = 0, hi = max_size + 1;  // lo fits (0: none yet), hi does not
+  long probe = std::min(std::max(std::lround(fontsize * 100.0), 1L),
+                        max_size);
+  long last = 0, step = 1;
+  for (int tries = 0; hi - lo > 1; tries++) {
+    double s = probe / 100.0;
+    relayout(t, s, 1.5 * s);
+    last = probe;
+    bool fits = fits_budget(budget, t->x, t->y, t->width, t->height);
+    if (fits)
+      lo = probe;
+    else
+      hi = probe;
+
+    // The layout grows about in proportion to the font size, so the first
+    // few layouts predict the answer; after that, step out from the last
+    // size tried and halve the bracket.
+    long next = tries < 4 ? std::lround(probe * fit_scale(budget, t)) : 0;
+    if (next <= lo || next >= hi) {
+      next = fits ? lo + step : hi - step;
+      step *= 2;
+      if (next <= lo || next >= hi)
+	next = lo + (hi - lo) / 2;
+    }
+    probe = next;
+  }
+
+  if (lo == 0)
+    return 0.0;
+  if (last != lo)
+    relayout(t, lo / 100.0, 1.5 * lo / 100.0);
+  return lo / 100.0;
+
+} // fit_font_size
 
 // ___________________________________________________________________________
 
@@ -452,6 +1307,7 @@ bool font::load(const std::string& fontname, const std::string& fonts_dir)
     ifs >> w;
     widths[i] = w / 1000.0;
   }
+  fname = fontname;
   return true;
 
 } // font::load
@@ -0,0 +1,379 @@
+// ___________________________________________________________________________
+// Includes and defines
+
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef PST_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "pst.h"
+
+// ___________________________________________________________________________
+// PDF file writer
+
+namespace {
+
+// Numbers objects and keeps the byte offset of each one for the cross
+// reference table, so the output stream never needs to be seekable.
+class pdf_writer {
+ private:
+  std::ostream& os;
+  std::vector<long> offsets;
+  long written = 0;
+
+ public:
+  explicit pdf_writer(std::ostream& os) : os(os) {}
+
+  int reserve() {
+    offsets.push_back(-1);
+    return static_cast<int>(offsets.size());
+  }
+
+  void put(const std::string& s) {
+    os.write(s.data(), static_cast<std::streamsize>(s.size()));
+    written += static_cast<long>(s.size());
+  }
+
+  void object(int n, const std::string& body);
+  void stream(int n, const std::string& dict, const std::string& data);
+  void finish(int root);
+};
+
+} // namespace
+
+// ___________________________________________________________________________
+
+void pdf_writer::object(int n, const std::string& body)
+{
+  offsets[n - 1] = written;
+  put(std::to_string(n) + " 0 obj\n" + body + "\nendobj\n");
+
+} // pdf_writer::object
+
+// ___________________________________________________________________________
+
+void pdf_writer::stream(int n, const std::string& dict,
+                        const std::string& data)
+{
+  offsets[n - 1] = written;
+  put(std::to_string(n) + " 0 obj\n<<" + (dict.empty() ? "" : " ") + dict);
+#ifdef PST_HAVE_ZLIB
+  uLongf size = compressBound(static_cast<uLong>(data.size()));
+  std::string packed(size, '\0');
+  if (compress2(reinterpret_cast<Bytef*>(&packed[0]), &size,
+                reinterpret_cast<const Bytef*>(data.data()),
+                static_cast<uLong>(data.size()),
+                Z_DEFAULT_COMPRESSION) == Z_OK) {
+    packed.resize(size);
+    put(" /Filter /FlateDecode /Length " + std::to_string(size) +
+        " >>\nstream\n");
+    put(packed);
+    put("\nendstream\nendobj\n");
+    return;
+  }
+#endif
+  put(" /Length " + std::to_string(data.size()) + " >>\nstream\n");
+  put(data);
+  put("\nendstream\nendobj\n");
+
+} // pdf_writer::stream
+
+// ___________________________________________________________________________
+
+void pdf_writer::finish(int root)
+{
+  long xref = written;
+  std::ostringstream table;
+  table << "xref\n0 " << offsets.size() + 1 << "\n";
+  table << "0000000000 65535 f \n";
+  for (long offset : offsets)
+    table << std::setw(10) << std::setfill('0') << offset << " 00000 n \n";
+  table << "trailer\n<< /Size " << offsets.size() + 1 << " /Root " << root
+        << " 0 R >>\n";
+  table << "startxref\n" << xref << "\n%%EOF\n";
+  put(table.str());
+  os.flush();
+
+} // pdf_writer::finish
+
+// ___________________________________________________________________________
+
+static bool standard_font(const std::string& fontname)
+{
+  // the fonts every PDF reader has, which need no font descriptor
+  static const char* names[] = {
+    "Courier", "Courier-Bold", "Courier-BoldOblique", "Courier-Oblique",
+    "Helvetica", "Helvetica-Bold", "Helvetica-BoldOblique",
+    "Helvetica-Oblique", "Symbol", "Times-Bold", "Times-BoldItalic",
+    "Times-Italic", "Times-Roman", "ZapfDingbats"};
+  for (const char* name : names)
+    if (fontname == name)
+      return true;
+  return false;
+
+} // standard_font
+
+// ___________________________________________________________________________
+
+static void pdf_write_font(pdf_writer& pdf, int n, const font& f)
+{
+  // The widths tell a reader that substitutes the font where the strings
+  // were measured to end; the font's own encoding is the standard one.
+  std::ostringstream dict;
+  dict << "<< /Type /Font /Subtype /Type1 /BaseFont /" << f.name()
+       << "\n   /FirstChar 32 /LastChar 255 /Widths [";
+  for (int c = 32; c < 256; c++)
+    dict << (c % 16 ? " " : "\n   ") << std::lround(f.width(c) * 1000.0);
+  dict << "]";
+
+  if (standard_font(f.name())) {
+    dict << " >>";
+    pdf.object(n, dict.str());
+    return;
+  }
+
+  int descriptor = pdf.reserve();
+  dict << "\n   /FontDescriptor " << descriptor << " 0 R >>";
+  pdf.object(n, dict.str());
+
+  bool italic = f.name().find("Italic") != std::string::npos ||
+    f.name().find("Oblique") != std::string::npos;
+  std::ostringstream desc;
+  desc << "<< /Type /FontDescriptor /FontName /" << f.name()
+       << " /Flags " << (italic ? 96 : 32)
+       << " /FontBBox [-166 -225 1000 931]"
+       << " /ItalicAngle " << (italic ? -12 : 0)
+       << " /Ascent 718 /Descent -207 /CapHeight 718 /StemV 88 >>";
+  pdf.object(descriptor, desc.str());
+
+} // pdf_write_font
+
+// ___________________________________________________________________________
+
+static void pdf_rule_text(const std::string& s, double x, double y,
+                          bool vertical, const font& rulefont,
+                          std::ostream& os)
+{
+  // centered on (x, y), as the bc procedure does in PostScript
+  double half = string_width(s, rulefont, 8.0) / 2.0;
+  if (vertical)
+    os << "BT /F2 8 Tf 0 1 -1 0 " << x << " " << y - half << " Tm (";
+  else
+    os << "BT /F2 8 Tf 1 0 0 1 " << x - half << " " << y << " Tm (";
+  os << s << ") Tj ET\n";
+
+} // pdf_rule_text
+
+// ___________________________________________________________________________
+
+static std::string pdf_page_content(const page_plan& plan, int row, int col,
+                                    double fontsize, const font& rulefont,
+                                    int form)
+{
+  int pwidth = plan.pwidth, pheight = plan.pheight;
+  int hpages = plan.hpages, wpages = plan.wpages;
+
+  std::ostringstream os;
+  os << std::fixed << std::setprecision(3);
+  if (plan.orientation == 2)
+    os << "0 1 -1 0 612 0 cm\n";
+  os << "1 0 0 1 36 36 cm " << std::setprecision(5) << fontsize / 10.0
+     << " w\n";
+  os << std::setprecision(3);
+
+  // the same cutting and gluing directions as ps_begin_page
+  if (hpages - row - 1) {
+    os << "q 1 w\n";
+    pdf_rule_text("row " + std::to_string(hpages - row) +
+                  " - cut to remove line, place to cover line of"
+                  " adjoining page", pwidth / 2.0, pheight + 10.0, false,
+                  rulefont, os);
+    os << "-36 " << 0.50 + pheight << " m " << pwidth + 36 << " "
+       << 0.50 + pheight << " l S Q\n";
+  }
+  if (row) {
+    os << "q 1 w 0.4 g 0.4 G\n";
+    pdf_rule_text("place adjoining page of row " +
+                  std::to_string(hpages - row + 1) + " to cover line",
+                  pwidth / 2.0, -18.0, false, rulefont, os);
+    os << "-36 -0.5 m " << pwidth + 36 << " -0.5 l S Q\n";
+  }
+  if (col) {
+    os << "q 1 w\n";
+    pdf_rule_text("col " + std::to_string(col + 1) +
+                  " - cut to remove line, place to cover line of"
+                  " adjoining page", -10.0, pheight / 2.0, true,
+                  rulefont, os);
+    os << "-0.5 -36 m -0.5 " << pheight + 36 << " l S Q\n";
+  }
+  if (col < wpages - 1) {
+    os << "q 1 w 0.4 g 0.4 G\n";
+    pdf_rule_text("place adjoining page of column " +
+                  std::to_string(col + 2) + " to cover line",
+                  pwidth + 18.0, pheight / 2.0, true, rulefont, os);
+    os << 0.50 + pwidth << " -36 m " << 0.50 + pwidth << " "
+       << pheight + 36 << " l S Q\n";
+  }
+
+  os << "q 0 0 " << pwidth << " " << pheight << " re W n 1 0 0 1 "
+     << (pwidth * wpages - plan.width) / 2.0 - pwidth * col - plan.x << " "
+     << (pheight * hpages - plan.height) / 2.0 - pheight * row - plan.y
+     << " cm /T" << form << " Do Q\n";
+  return os.str();
+
+} // pdf_page_content
+
+// ___________________________________________________________________________
+
+void pdf_draw_arc(double x0, double y0, double x3, double y3,
+                  std::ostream& os)
+{
+  double y1 = (y0 + y3) / 2.0;
+  os << std::setprecision(2);
+  os << x0 << " " << y0 << " m "
+     << x0 << " " << y1 << " "
+     << x3 << " " << y1 << " "
+     << x3 << " " << y3 << " c S\n";
+
+} // pdf_draw_arc
+
+// ___________________________________________________________________________
+
+void pdf_draw_box(double x1, double y1, double x2, double y2,
+                  std::ostream& os)
+{
+  // filled white and outlined, then back to black for the labels
+  os << std::setprecision(2);
+  os << "1 g " << x1 << " " << y1 << " " << x2 - x1 << " " << y2 - y1
+     << " re B 0 g\n";
+
+} // pdf_draw_box
+
+// ___________________________________________________________________________
+
+void pdf_draw_string(const std::string& s, double x, double y,
+                     std::ostream& os)
+{
+  os << std::setprecision(2);
+  os << "BT " << x << " " << y << " Td (";
+  for (char c : s) {
+    if (c == '(' || c == ')' || c == '\\')
+      os << '\\';
+    os << c;
+  }
+  os << ") Tj ET\n";
+
+} // pdf_draw_string
+
+// ___________________________________________________________________________
+
+void pdf_draw_node(pstree* t, double fontsize, std::ostream& os)
+{
+  double x1 = t->xbox - t->stringswidth / 2.0 - 0.2 * fontsize;
+  double x2 = t->xbox + t->stringswidth / 2.0 + 0.2 * fontsize;
+  double y2 = t->ybox + 0.8 * fontsize;
+  double y1 = y2 - t->boxheight;
+  pdf_draw_box(x1, y1, x2, y2, os);
+
+  x1 = t->xbox;
+  y1 = t->ybox - 0.4 * fontsize;
+  for (const auto& ns : t->nodestrings) {
+    pdf_draw_string(ns.text, x1 - ns.width / 2.0, y1, os);
+    y1 -= 1.2 * fontsize;
+  }
+
+} // pdf_draw_node
+
+// ___________________________________________________________________________
+
+void pdf_draw_tree(pstree* t, double fontsize, std::ostream& os)
+{
+  if (t && !t->nodestrings.empty())
+  {
+    if (t->left && t->right) {
+      pdf_draw_arc(t->xbox, t->ybox, t->left->xbox, t->left->ybox, os);
+      pdf_draw_tree(t->left.get(), fontsize, os);
+      pdf_draw_arc(t->xbox, t->ybox, t->right->xbox, t->right->ybox, os);
+      pdf_draw_tree(t->right.get(), fontsize, os);
+    }
+    pdf_draw_node(t, fontsize, os);
+  }
+
+} // pdf_draw_tree
+
+// ___________________________________________________________________________
+
+void pdf_write_trees(const std::vector<pstree*>& trees, const font& mainfont,
+                     const font& rulefont, double fontsize, std::ostream& os)
+{
+  pdf_writer pdf(os);
+  pdf.put("%PDF-1.4\n%\xe2\xe3\xcf\xd3\n");
+
+  int catalog = pdf.reserve();
+  int pages = pdf.reserve();
+  int f1 = pdf.reserve();
+  int f2 = pdf.reserve();
+  pdf.object(catalog, "<< /Type /Catalog /Pages " + std::to_string(pages) +
+             " 0 R >>");
+  pdf_write_font(pdf, f1, mainfont);
+  pdf_write_font(pdf, f2, rulefont);
+
+  // Each tree is drawn once, as a form that every one of its pages shows
+  // through its own clip and translation.
+  std::vector<int> kids;
+  for (std::size_t i = 0; i < trees.size(); i++) {
+    pstree* t = trees[i];
+    page_plan plan = plan_pages(t->x, t->y, t->width, t->height);
+
+    std::ostringstream content;
+    content << std::fixed << std::setprecision(2);
+    content << "/F1 " << fontsize << " Tf\n";
+    pdf_draw_tree(t, fontsize, content);
+
+    // boxes reach a little past the layout's extent
+    std::ostringstream dict;
+    dict << std::fixed << std::setprecision(2);
+    dict << "/Type /XObject /Subtype /Form /BBox [" << t->x - 2 * fontsize
+         << " " << t->y - 2 * fontsize << " "
+         << t->x + t->width + 2 * fontsize << " "
+         << t->y + t->height + 2 * fontsize << "]"
+         << " /Resources << /Font << /F1 " << f1 << " 0 R >> >>";
+    int form = pdf.reserve();
+    pdf.stream(form, dict.str(), content.str());
+
+    std::string resources = "/Resources << /Font << /F2 " +
+      std::to_string(f2) + " 0 R >> /XObject << /T" + std::to_string(i) +
+      " " + std::to_string(form) + " 0 R >> >>";
+    for (int row = 0; row < plan.hpages; row++)
+      for (int col = 0; col < plan.wpages; col++) {
+	int page = pdf.reserve();
+	int contents = pdf.reserve();
+	pdf.object(page, "<< /Type /Page /Parent " + std::to_string(pages) +
+                   " 0 R " + resources + " /Contents " +
+                   std::to_string(contents) + " 0 R >>");
+	pdf.stream(contents, "", pdf_page_content(plan, row, col, fontsize,
+                                                  rulefont,
+                                                  static_cast<int>(i)));
+	kids.push_back(page);
+      }
+  }
+
+  std::ostringstream dict;
+  dict << "<< /Type /Pages /Count " << kids.size()
+       << " /MediaBox [0 0 612 792] /Kids [";
+  for (std::size_t i = 0; i < kids.size(); i++)
+    dict << (i ? " " : "") << kids[i] << " 0 R";
+  dict << "] >>";
+  pdf.object(pages, dict.str());
+  pdf.finish(catalog);
+
+} // pdf_write_trees
+
+// ___________________________________________________________________________
+// pst_pdf.cc
@@ -0,0 +1,325 @@
+// ___________________________________________________________________________
+// Includes and defines
+
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pst.h"
+
+// ___________________________________________________________________________
+// Hand-off from the parser to the layout thread
+
+namespace {
+
+// A node whose subtree has been read completely.  Children are always
+// handed over before their parent.
+struct finished_node {
+  pstree* node;
+  bool drop_children;  // collapsed after its children were read
+};
+
+class node_queue {
+ private:
+  std::mutex lock;
+  std::condition_variable ready;
+  std::deque<std::vector<finished_node>> batches;
+  std::vector<finished_node> batch;
+  bool done = false;
+
+ public:
+  // Called by the parser only; nodes are passed on in batches so that the
+  // two threads rarely meet at the lock.
+  void push(const finished_node& f) {
+    batch.push_back(f);
+    if (batch.size() >= 1024)
+      flush();
+  }
+
+  void flush() {
+    std::lock_guard<std::mutex> guard(lock);
+    batches.push_back(std::move(batch));
+    batch.clear();
+    ready.notify_one();
+  }
+
+  void close() {
+    flush();
+    std::lock_guard<std::mutex> guard(lock);
+    done = true;
+    ready.notify_one();
+  }
+
+  // Called by the layout thread; false once everything has been taken
+  bool pop(std::vector<finished_node>& out) {
+    std::unique_lock<std::mutex> guard(lock);
+    ready.wait(guard, [this] { return done || !batches.empty(); });
+    if (batches.empty())
+      return false;
+    out = std::move(batches.front());
+    batches.pop_front();
+    return true;
+  }
+};
+
+} // namespace
+
+// ___________________________________________________________________________
+
+static std::unique_ptr<pstree> pipeline_node(std::istream& is,
+                                             const collapse_limits& limits,
+                                             int level, long& nodes,
+                                             int& levels, node_queue& queue,
+                                             bool& ok)
+{
+  // On bad input the partial tree is still returned, so that nodes the
+  // layout thread may be working on are only freed after it has stopped.
+  int nodetype;
+  char c;
+  std::string line;
+  std::unique_ptr<pstree> thisnode;
+  switch (nodetype = is.get())
+  {
+   case 'B':
+   case 'L':
+    thisnode = std::make_unique<pstree>();
+    std::getline(is, line);
+    thisnode->nodestrings.push_back({line});
+    while ((c = static_cast<char>(is.get())) == '+')
+    {
+      std::getline(is, line);
+      thisnode->nodestrings.push_back({line});
+    }
+    is.putback(c);
+    break;
+
+   default:
+    std::cout << "This is not a proper tree data file\n";
+    ok = false;
+    return nullptr;
+  }
+
+  nodes = 1;
+  levels = 1;
+  bool drop_children = false;
+  if (nodetype == 'B') {
+    long lnodes = 0, rnodes = 0;
+    int llevels = 0, rlevels = 0;
+    bool collapse = limits.max_levels > 0 && level >= limits.max_levels;
+    if (collapse) {
+      if (!ps_skip_tree(is, lnodes, llevels) ||
+          !ps_skip_tree(is, rnodes, rlevels)) {
+	ok = false;
+	return thisnode;
+      }
+    }
+    else {
+      thisnode->left = pipeline_node(is, limits, level + 1, lnodes, llevels,
+                                     queue, ok);
+      if (!ok)
+	return thisnode;
+      thisnode->right = pipeline_node(is, limits, level + 1, rnodes, rlevels,
+                                      queue, ok);
+      if (!ok)
+	return thisnode;
+    }
+    nodes += lnodes + rnodes;
+    levels += std::max(llevels, rlevels);
+    if (collapse || nodes < limits.min_nodes) {
+      // the children may be in the layout thread already; it drops them
+      drop_children = !collapse;
+      thisnode->nodestrings.push_back({subtree_summary(nodes, levels)});
+    }
+  }
+
+  queue.push({thisnode.get(), drop_children});
+  return thisnode;
+
+} // pipeline_node
+
+// ___________________________________________________________________________
+
+std::unique_ptr<pstree> ps_pipeline_tree(std::istream& is,
+                                         const font& mainfont,
+                                         double fontsize, double interspace,
+                                         const collapse_limits& limits)
+{
+  // The layout thread lays out every node as soon as the parser has read
+  // its whole subtree, so reading and layout overlap.
+  node_queue queue;
+  std::thread layout([&] {
+    trace_thread_name("layout");
+    std::vector<finished_node> batch;
+    while (queue.pop(batch)) {
+      trace_span span("batch", "nodes", static_cast<long long>(batch.size()));
+      for (const finished_node& f : batch) {
+	if (f.drop_children) {
+	  f.node->left.reset();
+	  f.node->right.reset();
+	}
+	set_node_size(f.node, mainfont, fontsize, interspace);
+      }
+    }
+  });
+
+  long nodes = 0;
+  int levels = 0;
+  bool ok = true;
+  std::unique_ptr<pstree> tree;
+  {
+    trace_span span("parse");
+    tree = pipeline_node(is, limits, 1, nodes, levels, queue, ok);
+    queue.close();
+  }
+  layout.join();
+  if (!ok)
+    return nullptr;
+  hash_shapes(tree.get());
+  return tree;
+
+} // ps_pipeline_tree
+
+// ___________________________________________________________________________
+
+writer_streambuf::writer_streambuf(const std::string& path,
+                                   std::size_t buffer_size, bool compress)
+  : buffer_size(buffer_size), current(buffer_size)
+{
+  if (compress)
+    gz = gzip_open(path, "wb6");
+  else
+    file = std::fopen(path.c_str(), "wb");
+  setp(current.data(), current.data() + current.size());
+  if (is_open())
+    writer = std::thread(&writer_streambuf::write_loop, this);
+
+} // writer_streambuf::writer_streambuf
+
+// ___________________________________________________________________________
+
+writer_streambuf::~writer_streambuf()
+{
+  close();
+
+} // writer_streambuf::~writer_streambuf
+
+// ___________________________________________________________________________
+
+void writer_streambuf::write_loop()
+{
+  trace_thread_name("writer");
+  std::unique_lock<std::mutex> guard(lock);
+  for (;;) {
+    changed.wait(guard, [this] { return closing || !full.empty(); });
+    if (full.empty())
+      break;
+    std::vector<char> buffer = std::move(full.front());
+    full.pop_front();
+    changed.notify_all();
+
+    // the formatting thread goes on filling the next buffer meanwhile
+    guard.unlock();
+    bool good;
+    {
+      trace_span span("write", "bytes", static_cast<long long>(buffer.size()));
+      good = gz ? gzip_write(gz, buffer.data(), buffer.size())
+        : std::fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+    }
+    guard.lock();
+    failed = failed || !good;
+    buffer.clear();
+    spare.push_back(std::move(buffer));
+  }
+
+} // writer_streambuf::write_loop
+
+// ___________________________________________________________________________
+
+bool writer_streambuf::hand_over()
+{
+  std::size_t n = static_cast<std::size_t>(pptr() - pbase());
+  if (n > 0) {
+    current.resize(n);
+    std::unique_lock<std::mutex> guard(lock);
+    // a few buffers in flight are enough to keep the writer busy
+    changed.wait(guard, [this] { return full.size() < 4; });
+    full.push_back(std::move(current));
+    changed.notify_all();
+    if (!spare.empty()) {
+      current = std::move(spare.back());
+      spare.pop_back();
+    }
+    else
+      current = std::vector<char>();
+    guard.unlock();
+    written += static_cast<long long>(n);
+    current.resize(buffer_size);
+  }
+  setp(current.data(), current.data() + current.size());
+  std::lock_guard<std::mutex> guard(lock);
+  return !failed;
+
+} // writer_streambuf::hand_over
+
+// ___________________________________________________________________________
+
+int writer_streambuf::overflow(int c)
+{
+  if (!is_open() || !hand_over())
+    return traits_type::eof();
+  if (c != traits_type::eof()) {
+    *pptr() = static_cast<char>(c);
+    pbump(1);
+  }
+  return 0;
+
+} // writer_streambuf::overflow
+
+// ___________________________________________________________________________
+
+int writer_streambuf::sync()
+{
+  return is_open() && hand_over() ? 0 : -1;
+
+} // writer_streambuf::sync
+
+// ___________________________________________________________________________
+
+std::streambuf::pos_type writer_streambuf::seekoff(
+    off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+{
+  // only the current position can be asked for, as the page index needs
+  if (off != 0 || dir != std::ios_base::cur || !(which & std::ios_base::out))
+    return pos_type(off_type(-1));
+  return pos_type(written + (pptr() - pbase()));
+
+} // writer_streambuf::seekoff
+
+// ___________________________________________________________________________
+
+bool writer_streambuf::close()
+{
+  if (!is_open())
+    return false;
+  hand_over();
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    closing = true;
+    changed.notify_all();
+  }
+  writer.join();
+  bool closed = gz ? gzip_close(gz) : std::fclose(file) == 0;
+  bool good = !failed && closed;
+  file = nullptr;
+  gz = nullptr;
+  return good;
+
+} // writer_streambuf::close
+
+// ___________________________________________________________________________
+// pst_pipeline.cc
@@ -0,0 +1,380 @@
+// ___________________________________________________________________________
+// Includes and defines
+
+#include <algorithm>
+#include <vector>
+
+#include "pst.h"
+
+// ___________________________________________________________________________
+// Tests for each pair of segment kinds.  The first segment always comes
+// from the left list, as in segments_intersect(s1, s2), and every test
+// does the same arithmetic that segments_intersect does for such a pair,
+// so the results are identical to the last bit.  A horizontal segment has
+// a slope of zero there, which makes most of that arithmetic fall away.
+
+static inline bool cross(const hsegment& h, const vsegment& v)
+{
+  return (h.x1 <= v.x) & (v.x <= h.x2) & (v.y1 <= h.y) & (h.y <= v.y2);
+
+} // cross
+
+// ___________________________________________________________________________
+
+static inline bool overlap(const hsegment& a, const hsegment& b)
+{
+  // collinear, with an end of b within a
+  return (a.y == b.y) & (((a.x1 <= b.x1) & (b.x1 <= a.x2)) |
+                         ((a.x1 <= b.x2) & (b.x2 <= a.x2)));
+
+} // overlap
+
+// ___________________________________________________________________________
+
+static inline bool overlap(const vsegment& a, const vsegment& b)
+{
+  return (a.x == b.x) & (((a.y1 <= b.y1) & (b.y1 <= a.y2)) |
+                         ((a.y1 <= b.y2) & (b.y2 <= a.y2)));
+
+} // overlap
+
+// ___________________________________________________________________________
+
+static inline segment as_segment(const hsegment& h)
+{
+  return {h.x1, h.y, h.x2, h.y};
+
+} // as_segment
+
+// ___________________________________________________________________________
+
+static inline bool cross(const vsegment& v, const segment& d)
+{
+  double m = (d.y1 - d.y2) / (d.x1 - d.x2);
+  double y = m * v.x + d.y1 - m * d.x1;
+  return (v.y1 <= y) & (y <= v.y2) & d.contains(v.x, y);
+
+} // cross
+
+// ___________________________________________________________________________
+
+static inline bool cross(const segment& d, const vsegment& v)
+{
+  double m = (d.y2 - d.y1) / (d.x2 - d.x1);
+  double y = m * v.x + d.y1 - m * d.x1;
+  return d.contains(v.x, y) & (v.y1 <= y) & (y <= v.y2);
+
+} // cross
+
+// ___________________________________________________________________________
+
+static inline bool cross(const hsegment& h, const segment& d)
+{
+  double m = (d.y2 - d.y1) / (d.x2 - d.x1);
+  if (m == 0.0)
+    return segments_intersect(as_segment(h), d);
+  double b = d.y1 - m * d.x1;
+  double x = (b - h.y) / (0.0 - m);
+  return (h.x1 <= x) & (x <= h.x2) & d.contains(x, h.y);
+
+} // cross
+
+// ___________________________________________________________________________
+
+static inline bool cross(const segment& d, const hsegment& h)
+{
+  // y is computed, not taken from h, so it may miss h by a rounding error
+  double m = (d.y2 - d.y1) / (d.x2 - d.x1);
+  if (m == 0.0)
+    return segments_intersect(d, as_segment(h));
+  double b = d.y1 - m * d.x1;
+  double x = (h.y - b) / m;
+  double y = m * x + b;
+  return d.contains(x, y) & (h.x1 <= x) & (x <= h.x2) & (y == h.y);
+
+} // cross
+
+// ___________________________________________________________________________
+
+void segment_list::push_back(const segment& s)
+{
+  if (s.x1 == s.x2)
+    vertical.push_back({s.x1, std::min(s.y1, s.y2), std::max(s.y1, s.y2)});
+  else if (s.y1 == s.y2)
+    horizontal.push_back({s.y1, std::min(s.x1, s.x2),
+                          std::max(s.x1, s.x2)});
+  else
+    diagonal.push_back(s);
+
+} // segment_list::push_back
+
+// ___________________________________________________________________________
+
+void segment_list::push_back(double x1, double y1, double x2, double y2)
+{
+  // rounded to coord before it is classified
+  push_back(segment{static_cast<coord>(x1), static_cast<coord>(y1),
+                    static_cast<coord>(x2), static_cast<coord>(y2)});
+
+} // segment_list::push_back
+
+// ___________________________________________________________________________
+
+void segment_list::append(const segment_list& other)
+{
+  horizontal.insert(horizontal.end(), other.horizontal.begin(),
+                    other.horizontal.end());
+  vertical.insert(vertical.end(), other.vertical.begin(),
+                  other.vertical.end());
+  diagonal.insert(diagonal.end(), other.diagonal.begin(),
+                  other.diagonal.end());
+
+} // segment_list::append
+
+// ___________________________________________________________________________
+
+void segment_list::clear()
+{
+  horizontal.clear();
+  vertical.clear();
+  diagonal.clear();
+
+} // segment_list::clear
+
+// ___________________________________________________________________________
+
+void segment_list::reserve(std::size_t h, std::size_t v, std::size_t d)
+{
+  horizontal.reserve(h);
+  vertical.reserve(v);
+  diagonal.reserve(d);
+
+} // segment_list::reserve
+
+// ___________________________________________________________________________
+
+std::size_t segment_list::size() const
+{
+  return horizontal.size() + vertical.size() + diagonal.size();
+
+} // segment_list::size
+
+// ___________________________________________________________________________
+
+namespace {
+
+// A segment of any kind, by its extent in y
+struct segment_span {
+  double y1, y2;
+  int kind;  // 0 horizontal, 1 vertical, 2 diagonal
+  std::size_t index;
+};
+
+} // namespace
+
+// ___________________________________________________________________________
+
+void segment_list::prune_to_outline()
+{
+  // Keep the segments that are the leftmost or the rightmost at some
+  // height: at every end of a segment, and halfway between two ends, where
+  // no segment ends.  What lies behind them on both sides is dropped.
+  std::vector<segment_span> spans;
+  std::vector<double> ys;
+  spans.reserve(size());
+  ys.reserve(2 * size());
+  for (std::size_t i = 0; i < horizontal.size(); i++)
+    spans.push_back({horizontal[i].y, horizontal[i].y, 0, i});
+  for (std::size_t i = 0; i < vertical.size(); i++)
+    spans.push_back({vertical[i].y1, vertical[i].y2, 1, i});
+  for (std::size_t i = 0; i < diagonal.size(); i++)
+    spans.push_back({std::min(diagonal[i].y1, diagonal[i].y2),
+                     std::max(diagonal[i].y1, diagonal[i].y2), 2, i});
+  for (const auto& s : spans) {
+    ys.push_back(s.y1);
+    ys.push_back(s.y2);
+  }
+  std::sort(spans.begin(), spans.end(),
+            [](const segment_span& a, const segment_span& b) {
+              return a.y1 < b.y1;
+            });
+  std::sort(ys.begin(), ys.end());
+  ys.erase(std::unique(ys.begin(), ys.end()), ys.end());
+
+  // the left and the right end of a segment at height y
+  auto ends = [&](const segment_span& s, double y, double& left,
+                  double& right) {
+    if (s.kind == 0) {
+      left = horizontal[s.index].x1;
+      right = horizontal[s.index].x2;
+      return;
+    }
+    if (s.kind == 1) {
+      left = right = vertical[s.index].x;
+      return;
+    }
+    const segment& d = diagonal[s.index];
+    left = right = y == d.y1 ? d.x1 : y == d.y2 ? d.x2
+      : d.x1 + (y - d.y1) * (d.x2 - d.x1) / (d.y2 - d.y1);
+  };
+
+  std::vector<char> keep[3] = {std::vector<char>(horizontal.size()),
+                               std::vector<char>(vertical.size()),
+                               std::vector<char>(diagonal.size())};
+  std::vector<const segment_span*> active;
+  std::size_t next = 0;
+  for (std::size_t i = 0; i + 1 < 2 * ys.size(); i++) {
+    double y = i % 2 ? (ys[i / 2] + ys[i / 2 + 1]) / 2.0 : ys[i / 2];
+    while (next < spans.size() && spans[next].y1 <= y)
+      active.push_back(&spans[next++]);
+    active.erase(std::remove_if(active.begin(), active.end(),
+                                [&](const segment_span* s) {
+                                  return s->y2 < y;
+                                }),
+                 active.end());
+
+    double leftmost = 0.0, rightmost = 0.0, left, right;
+    for (std::size_t j = 0; j < active.size(); j++) {
+      ends(*active[j], y, left, right);
+      if (j == 0 || left < leftmost)
+	leftmost = left;
+      if (j == 0 || right > rightmost)
+	rightmost = right;
+    }
+    for (const segment_span* s : active) {
+      ends(*s, y, left, right);
+      if (left == leftmost || right == rightmost)
+	keep[s->kind][s->index] = 1;
+    }
+  }
+
+  std::size_t n = 0;
+  for (std::size_t i = 0; i < horizontal.size(); i++)
+    if (keep[0][i])
+      horizontal[n++] = horizontal[i];
+  horizontal.resize(n);
+  n = 0;
+  for (std::size_t i = 0; i < vertical.size(); i++)
+    if (keep[1][i])
+      vertical[n++] = vertical[i];
+  vertical.resize(n);
+  n = 0;
+  for (std::size_t i = 0; i < diagonal.size(); i++)
+    if (keep[2][i])
+      diagonal[n++] = diagonal[i];
+  diagonal.resize(n);
+
+} // segment_list::prune_to_outline
+
+// ___________________________________________________________________________
+
+void move_seglist_horizontally(segment_list& segs, double delta)
+{
+  bool collapsed = false;
+  for (auto& h : segs.horizontal) {
+    h.x1 += delta;
+    h.x2 += delta;
+    collapsed |= h.x1 == h.x2;
+  }
+  for (auto& v : segs.vertical)
+    v.x += delta;
+  for (auto& d : segs.diagonal) {
+    d.x1 += delta;
+    d.x2 += delta;
+    collapsed |= d.x1 == d.x2;
+  }
+  if (!collapsed)
+    return;
+
+  // Rounding has made the ends of a very short segment meet, so that
+  // segments_intersect now takes it for a vertical one.
+  auto h_end = std::remove_if(segs.horizontal.begin(), segs.horizontal.end(),
+                              [&](const hsegment& h) {
+				if (h.x1 != h.x2)
+				  return false;
+				segs.vertical.push_back({h.x1, h.y, h.y});
+				return true;
+			      });
+  segs.horizontal.erase(h_end, segs.horizontal.end());
+  auto d_end = std::remove_if(segs.diagonal.begin(), segs.diagonal.end(),
+                              [&](const segment& d) {
+				if (d.x1 != d.x2)
+				  return false;
+				segs.vertical.push_back(
+                                    {d.x1, std::min(d.y1, d.y2),
+                                     std::max(d.y1, d.y2)});
+				return true;
+			      });
+  segs.diagonal.erase(d_end, segs.diagonal.end());
+
+} // move_seglist_horizontally
+
+// ___________________________________________________________________________
+
+void move_seglist_vertically(segment_list& segs, double delta)
+{
+  for (auto& h : segs.horizontal)
+    h.y += delta;
+  for (auto& v : segs.vertical) {
+    v.y1 += delta;
+    v.y2 += delta;
+  }
+  for (auto& d : segs.diagonal) {
+    d.y1 += delta;
+    d.y2 += delta;
+  }
+
+} // move_seglist_vertically
+
+// ___________________________________________________________________________
+
+bool seglists_intersect(const segment_list& s1, const segment_list& s2)
+{
+  // box sides first: these pairs are the most common and the cheapest,
+  // and each inner loop runs without branches
+  for (const auto& h : s1.horizontal) {
+    bool hit = false;
+    for (const auto& v : s2.vertical)
+      hit |= cross(h, v);
+    for (const auto& g : s2.horizontal)
+      hit |= overlap(h, g);
+    if (hit)
+      return true;
+  }
+  for (const auto& v : s1.vertical) {
+    bool hit = false;
+    for (const auto& h : s2.horizontal)
+      hit |= cross(h, v);
+    for (const auto& w : s2.vertical)
+      hit |= overlap(v, w);
+    if (hit)
+      return true;
+  }
+
+  // then everything that involves a diagonal
+  for (const auto& d : s2.diagonal) {
+    bool hit = false;
+    for (const auto& h : s1.horizontal)
+      hit |= cross(h, d);
+    for (const auto& v : s1.vertical)
+      hit |= cross(v, d);
+    if (hit)
+      return true;
+  }
+  for (const auto& d : s1.diagonal) {
+    bool hit = false;
+    for (const auto& h : s2.horizontal)
+      hit |= cross(d, h);
+    for (const auto& v : s2.vertical)
+      hit |= cross(d, v);
+    for (const auto& e : s2.diagonal)
+      hit |= segments_intersect(d, e);
+    if (hit)
+      return true;
+  }
+  return false;
+
+} // seglists_intersect
+
+// ___________________________________________________________________________
+// pst_segments.cc
@@ -0,0 +1,358 @@
+// ___________________________________________________________________________
+// Includes and defines
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "pst.h"
+
+// The largest tree data a request may hold, in bytes
+static const long long max_request_bytes = 1LL << 32;
+
+// ___________________________________________________________________________
+// Stream buffers used by the server and its clients
+
+namespace {
+
+// Reads from a block of memory without copying it.
+class memory_streambuf : public std::streambuf {
+ public:
+  memory_streambuf(const char* data, std::size_t size) {
+    char* p = const_cast<char*>(data);
+    setg(p, p, p + size);
+  }
+};
+
+// Writes everything it is given as "<size>\n<bytes>" chunks, so output can
+// be sent before its total length is known.  A zero size ends a document.
+class chunk_streambuf : public std::streambuf {
+ private:
+  std::ostream& out;
+  std::vector<char> buffer;
+  std::streamoff written = 0;
+
+ public:
+  explicit chunk_streambuf(std::ostream& out) : out(out), buffer(1 << 16) {
+    setp(buffer.data(), buffer.data() + buffer.size());
+  }
+
+  void finish() {
+    sync();
+    out << "0\n";
+    out.flush();
+    written = 0;
+  }
+
+ protected:
+  // Only reports the position within the current document, which is all
+  // the page index in the trailer needs.
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override {
+    if (off != 0 || dir != std::ios_base::cur || !(which & std::ios_base::out))
+      return pos_type(off_type(-1));
+    return pos_type(written + (pptr() - pbase()));
+  }
+
+  int overflow(int c) override {
+    sync();
+    if (c != traits_type::eof()) {
+      *pptr() = static_cast<char>(c);
+      pbump(1);
+    }
+    return out ? 0 : traits_type::eof();
+  }
+
+  int sync() override {
+    std::ptrdiff_t n = pptr() - pbase();
+    if (n > 0) {
+      out << n << "\n";
+      out.write(pbase(), n);
+      written += n;
+    }
+    setp(buffer.data(), buffer.data() + buffer.size());
+    return out ? 0 : -1;
+  }
+};
+
+} // namespace
+
+// ___________________________________________________________________________
+
+fd_streambuf::fd_streambuf(int fd) : fd(fd), ibuf(1 << 16), obuf(1 << 16)
+{
+  setg(ibuf.data(), ibuf.data(), ibuf.data());
+  setp(obuf.data(), obuf.data() + obuf.size());
+
+} // fd_streambuf::fd_streambuf
+
+// ___________________________________________________________________________
+
+fd_streambuf::~fd_streambuf()
+{
+  sync();
+
+} // fd_streambuf::~fd_streambuf
+
+// ___________________________________________________________________________
+
+int fd_streambuf::underflow()
+{
+  if (gptr() < egptr())
+    return traits_type::to_int_type(*gptr());
+
+  ssize_t n;
+  do
+    n = ::read(fd, ibuf.data(), ibuf.size());
+  while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return traits_type::eof();
+  setg(ibuf.data(), ibuf.data(), ibuf.data() + n);
+  return traits_type::to_int_type(*gptr());
+
+} // fd_streambuf::underflow
+
+// ___________________________________________________________________________
+
+int fd_streambuf::overflow(int c)
+{
+  if (sync() != 0)
+    return traits_type::eof();
+  if (c != traits_type::eof()) {
+    *pptr() = static_cast<char>(c);
+    pbump(1);
+  }
+  return 0;
+
+} // fd_streambuf::overflow
+
+// ___________________________________________________________________________
+
+int fd_streambuf::sync()
+{
+  const char* p = pbase();
+  while (p < pptr()) {
+    ssize_t n = ::write(fd, p, pptr() - p);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      setp(obuf.data(), obuf.data() + obuf.size());
+      return -1;
+    }
+    p += n;
+  }
+  setp(obuf.data(), obuf.data() + obuf.size());
+  return 0;
+
+} // fd_streambuf::sync
+
+// ___________________________________________________________________________
+
+const font* font_cache::get(const std::string& fontname)
+{
+  auto& f = fonts[fontname];
+  if (!f) {
+    f = std::make_unique<font>();
+    if (!f->load(fontname, fonts_dir)) {
+      fonts.erase(fontname);
+      return nullptr;
+    }
+  }
+  return f.get();
+
+} // font_cache::get
+
+// ___________________________________________________________________________
+
+bool serve_requests(std::istream& in, std::ostream& out, font_cache& fonts)
+{
+  // These live as long as the connection, so their buffers are reused
+  std::string header, data;
+  chunk_streambuf chunks(out);
+  std::ostream ps(&chunks);
+
+  while (std::getline(in, header))
+  {
+    std::istringstream hs(header);
+    std::string command, fontname;
+    double fontsize = 0.0;
+    long long bytes = 0;
+    if (!(hs >> command))
+      continue;
+    if (command == "quit")
+      return false;
+    if (command == "shutdown")
+      return true;
+    if (command != "tree" || !(hs >> fontname >> fontsize >> bytes) ||
+        bytes < 0 || bytes > max_request_bytes) {
+      // the rest of the input cannot be framed any more
+      out << "error bad request\n";
+      out.flush();
+      return false;
+    }
+
+    data.resize(static_cast<std::size_t>(bytes));
+    if (bytes && !in.read(&data[0], static_cast<std::streamsize>(bytes)))
+      return false;
+
+    // fonts are only looked up in the fonts directory
+    const font* f = fontname.find('/') == std::string::npos
+      ? fonts.get(fontname) : nullptr;
+    if (!f) {
+      out << "error unable to load font " << fontname << "\n";
+      out.flush();
+      continue;
+    }
+    if (!(fontsize > 0.0)) {
+      out << "error bad font size\n";
+      out.flush();
+      continue;
+    }
+
+    // check that the data holds a whole tree before building it; as with
+    // tree files, anything after the tree is ignored
+    memory_streambuf checkbuf(data.data(), data.size());
+    std::istream check(&checkbuf);
+    long nodes;
+    int levels;
+    if (!ps_skip_tree(check, nodes, levels)) {
+      out << "error not a proper tree data file\n";
+      out.flush();
+      continue;
+    }
+
+    memory_streambuf treebuf(data.data(), data.size());
+    std::istream tree_stream(&treebuf);
+    auto tree = ps_restore_tree(tree_stream);
+
+    out << "ok\n";
+    ps_render(tree.get(), *f, fontsize, ps);
+    chunks.finish();
+  }
+  return false;
+
+} // serve_requests
+
+// ___________________________________________________________________________
+
+bool serve_unix_socket(const std::string& path, font_cache& fonts)
+{
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "Socket path too long: " << path << "\n";
+    return false;
+  }
+  std::strcpy(addr.sun_path, path.c_str());
+
+  int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    std::cerr << "Unable to create socket\n";
+    return false;
+  }
+  ::unlink(path.c_str());
+  auto* sa = reinterpret_cast<sockaddr*>(&addr);
+  if (::bind(listener, sa, sizeof(addr)) < 0 || ::listen(listener, 16) < 0) {
+    std::cerr << "Unable to listen on " << path << "\n";
+    ::close(listener);
+    return false;
+  }
+
+  // one connection at a time; each may send any number of requests
+  bool shutdown = false;
+  while (!shutdown) {
+    int fd = ::accept(listener, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR)
+	continue;
+      break;
+    }
+    {
+      fd_streambuf buf(fd);
+      std::iostream io(&buf);
+      shutdown = serve_requests(io, io, fonts);
+    }
+    ::close(fd);
+  }
+
+  ::close(listener);
+  ::unlink(path.c_str());
+  return shutdown;
+
+} // serve_unix_socket
+
+// ___________________________________________________________________________
+
+int connect_unix_socket(const std::string& path)
+{
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+    return -1;
+  std::strcpy(addr.sun_path, path.c_str());
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+
+} // connect_unix_socket
+
+// ___________________________________________________________________________
+
+bool request_render(std::iostream& server, const std::string& fontname,
+                    double fontsize, const std::string& treedata,
+                    std::ostream& ps, std::string& error)
+{
+  server << "tree " << fontname << " " << fontsize << " " << treedata.size()
+         << "\n";
+  server.write(treedata.data(), static_cast<std::streamsize>(treedata.size()));
+  server.flush();
+
+  std::string status;
+  if (!std::getline(server, status)) {
+    error = "no reply from server";
+    return false;
+  }
+  if (status != "ok") {
+    error = status.compare(0, 6, "error ") == 0 ? status.substr(6) : status;
+    return false;
+  }
+
+  std::string line;
+  std::vector<char> chunk;
+  while (std::getline(server, line)) {
+    // chunks are no larger than a request may be
+    if (line.empty() || line.size() > 12 ||
+        line.find_first_not_of("0123456789") != std::string::npos ||
+        std::stoll(line) > max_request_bytes) {
+      error = "bad reply from server";
+      return false;
+    }
+    std::size_t n = static_cast<std::size_t>(std::stoll(line));
+    if (n == 0)
+      return true;
+    chunk.resize(n);
+    if (!server.read(chunk.data(), static_cast<std::streamsize>(n)))
+      break;
+    ps.write(chunk.data(), static_cast<std::streamsize>(n));
+  }
+  error = "truncated reply from server";
+  return false;
+
+} // request_render
+
+// ___________________________________________________________________________
+// pst_serve.cc
@@ -0,0 +1,457 @@
+// ___________________________________________________________________________
+// Includes and defines
+
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <initializer_list>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "pst.h"
+
+// ___________________________________________________________________________
+// Shard files
+//
+// A --shard run leaves two files for --merge.  '{treefile}.shard{i}' holds
+// what the layout of the levels above needs, the extent and box of the
+// shard's root and its outline, pruned:
+//   pst-shard 2 {nodes} {levels} {font name} {font size}
+//   {x} {y} {width} {height} {xbox} {ybox} {boxwidth} {boxheight}
+//       {stringswidth}
+//   {horizontal} {vertical} {diagonal segments}
+//   h {y} {x1} {x2}                 one line per segment
+//   v {x} {y1} {y2}
+//   d {x1} {y1} {x2} {y2}
+// nodes and levels are those of the subtree in the tree file.  What is
+// drawn goes to '{treefile}.shard{i}.nodes', one line per node in
+// pre-order, each followed by its labels, one per line:
+//   {B or L} {xbox} {ybox} {labels}
+// The label widths are measured again when the shard is drawn.  All
+// positions are those of the shard laid out on its own; the merge moves
+// them by the offset of the shard's root.  Numbers are written in the
+// fewest digits that read back exactly.
+
+namespace {
+
+class shard_line {
+ private:
+  std::string text;
+  const char* p = nullptr;
+
+ public:
+  bool read(std::istream& is) {
+    if (!std::getline(is, text))
+      return false;
+    p = text.c_str();
+    return true;
+  }
+
+  // in the type it was written from, so that it reads back exactly
+  template <class T>
+  bool number(T& v) {
+    while (*p == ' ')
+      p++;
+    auto result = std::from_chars(p, text.c_str() + text.size(), v);
+    if (result.ec != std::errc())
+      return false;
+    p = result.ptr;
+    return true;
+  }
+
+  bool tag(char c) {
+    while (*p == ' ')
+      p++;
+    if (*p != c)
+      return false;
+    p++;
+    return true;
+  }
+};
+
+// What ps_draw_merged_tree needs on its way down the levels above the
+// shards
+template <class Sink>
+struct merge_drawing {
+  int depth;
+  const std::vector<std::string>* record_files;
+  std::size_t next;
+  const font* mainfont;
+  double fontsize;
+  Sink* sink;
+};
+
+} // namespace
+
+// ___________________________________________________________________________
+
+template <class T>
+static void write_numbers(std::ostream& os, std::initializer_list<T> v)
+{
+  char buf[40];
+  for (T x : v) {
+    buf[0] = ' ';
+    char* end = std::to_chars(buf + 1, buf + sizeof(buf), x).ptr;
+    os.write(buf, end - buf);
+  }
+
+} // write_numbers
+
+// ___________________________________________________________________________
+
+static std::unique_ptr<pstree> top_node(std::istream& is,
+                                        const collapse_limits& limits,
+                                        int depth, int wanted, int level,
+                                        long& nodes, int& levels,
+                                        std::vector<shard_info>& shards)
+{
+  // A shard is skipped without building it, unless it is the wanted one
+  if (level == depth + 1) {
+    std::unique_ptr<pstree> shard;
+    if (static_cast<int>(shards.size()) == wanted)
+      shard = ps_restore_tree(is, limits, level, nodes, levels);
+    else if (ps_skip_tree(is, nodes, levels))
+      shard = std::make_unique<pstree>();
+    if (shard)
+      shards.push_back({shard.get(), nodes, levels});
+    return shard;
+  }
+
+  int nodetype;
+  char c;
+  std::string line;
+  std::unique_ptr<pstree> thisnode;
+  switch (nodetype = is.get())
+  {
+   case 'B':
+   case 'L':
+    thisnode = std::make_unique<pstree>();
+    std::getline(is, line);
+    thisnode->nodestrings.push_back({line});
+    while ((c = static_cast<char>(is.get())) == '+')
+    {
+      std::getline(is, line);
+      thisnode->nodestrings.push_back({line});
+    }
+    is.putback(c);
+    break;
+
+   default:
+    std::cout << "This is not a proper tree data file\n";
+    return nullptr;
+  }
+
+  nodes = 1;
+  levels = 1;
+  if (nodetype == 'B') {
+    long lnodes = 0, rnodes = 0;
+    int llevels = 0, rlevels = 0;
+    std::size_t first = shards.size();
+    bool collapse = limits.max_levels > 0 && level >= limits.max_levels;
+    if (collapse) {
+      if (!ps_skip_tree(is, lnodes, llevels) ||
+          !ps_skip_tree(is, rnodes, rlevels))
+	return nullptr;
+    }
+    else {
+      thisnode->left = top_node(is, limits, depth, wanted, level + 1, lnodes,
+                                llevels, shards);
+      if (!thisnode->left)
+	return nullptr;
+      thisnode->right = top_node(is, limits, depth, wanted, level + 1,
+                                 rnodes, rlevels, shards);
+      if (!thisnode->right)
+	return nullptr;
+    }
+    nodes += lnodes + rnodes;
+    levels += std::max(llevels, rlevels);
+    if (collapse || nodes < limits.min_nodes) {
+      // the shards below are part of the summary now
+      shards.resize(first);
+      thisnode->left.reset();
+      thisnode->right.reset();
+      thisnode->nodestrings.push_back({subtree_summary(nodes, levels)});
+    }
+  }
+  return thisnode;
+
+} // top_node
+
+// ___________________________________________________________________________
+
+std::unique_ptr<pstree> ps_restore_top_levels(std::istream& is,
+                                              const collapse_limits& limits,
+                                              int depth, int wanted,
+                                              std::vector<shard_info>& shards)
+{
+  // The shards are the subtrees depth levels below the root, from left to
+  // right; only shard number wanted is built, if any.  The levels above
+  // are collapsed as ps_restore_tree would.
+  long nodes = 0;
+  int levels = 0;
+  shards.clear();
+  return top_node(is, limits, depth, wanted, 1, nodes, levels, shards);
+
+} // ps_restore_top_levels
+
+// ___________________________________________________________________________
+
+void write_shard(const shard_info& shard, const std::string& fontname,
+                 double fontsize, std::ostream& summary,
+                 std::ostream& records)
+{
+  const pstree* t = shard.node;
+  segment_list outline = t->seglist;
+  outline.prune_to_outline();
+  summary << "pst-shard 2 " << shard.nodes << " " << shard.levels << " "
+          << fontname;
+  write_numbers(summary, {fontsize});
+  summary << "\n";
+  write_numbers(summary, {t->x, t->y, t->width, t->height, t->xbox, t->ybox,
+                          t->boxwidth, t->boxheight, t->stringswidth});
+  summary << "\n" << outline.horizontal.size() << " "
+          << outline.vertical.size() << " " << outline.diagonal.size()
+          << "\n";
+  for (const auto& s : outline.horizontal) {
+    summary << "h";
+    write_numbers(summary, {s.y, s.x1, s.x2});
+    summary << "\n";
+  }
+  for (const auto& s : outline.vertical) {
+    summary << "v";
+    write_numbers(summary, {s.x, s.y1, s.y2});
+    summary << "\n";
+  }
+  for (const auto& s : outline.diagonal) {
+    summary << "d";
+    write_numbers(summary, {s.x1, s.y1, s.x2, s.y2});
+    summary << "\n";
+  }
+
+  std::vector<const pstree*> pending = {t};
+  while (!pending.empty()) {
+    const pstree* n = pending.back();
+    pending.pop_back();
+    bool branch = n->left && n->right;
+    records << (branch ? "B" : "L");
+    write_numbers(records, {n->xbox, n->ybox});
+    records << " " << n->nodestrings.size() << "\n";
+    for (const auto& ns : n->nodestrings)
+      records << ns.text << "\n";
+    if (branch) {
+      pending.push_back(n->right.get());
+      pending.push_back(n->left.get());
+    }
+  }
+
+} // write_shard
+
+// ___________________________________________________________________________
+
+bool read_shard(std::istream& is, const shard_info& shard,
+                const std::string& fontname, double fontsize)
+{
+  std::string magic, name;
+  int version = 0, levels = 0;
+  long nodes = 0;
+  std::size_t h = 0, v = 0, d = 0;
+  shard_line line;
+  double size = 0.0;
+  is >> magic >> version >> nodes >> levels >> name;
+  if (!is || magic != "pst-shard" || version != 2 || !line.read(is) ||
+      !line.number(size)) {
+    std::cout << "This is not a shard file\n";
+    return false;
+  }
+  if (nodes != shard.nodes || levels != shard.levels) {
+    std::cout << "The shard is of a different subtree\n";
+    return false;
+  }
+  if (name != fontname || size != fontsize) {
+    std::cout << "The shard is laid out in another font or size\n";
+    return false;
+  }
+
+  coord x[9];
+  bool good = line.read(is);
+  for (int k = 0; good && k < 9; k++)
+    good = line.number(x[k]);
+  good = good && (is >> h >> v >> d);
+  is.ignore(1);
+  segment_list outline;
+  for (std::size_t i = 0; good && i < h + v + d; i++) {
+    char kind = i < h ? 'h' : i < h + v ? 'v' : 'd';
+    coord s[4];
+    good = line.read(is) && line.tag(kind);
+    for (int k = 0; good && k < (kind == 'd' ? 4 : 3); k++)
+      good = line.number(s[k]);
+    if (!good)
+      break;
+    if (kind == 'h')
+      outline.horizontal.push_back({s[0], s[1], s[2]});
+    else if (kind == 'v')
+      outline.vertical.push_back({s[0], s[1], s[2]});
+    else
+      outline.diagonal.push_back({s[0], s[1], s[2], s[3]});
+  }
+  if (!good) {
+    std::cout << "The shard file is incomplete\n";
+    return false;
+  }
+
+  pstree* t = shard.node;
+  t->x = x[0];
+  t->y = x[1];
+  t->width = x[2];
+  t->height = x[3];
+  t->xbox = x[4];
+  t->ybox = x[5];
+  t->boxwidth = x[6];
+  t->boxheight = x[7];
+  t->stringswidth = x[8];
+  t->seglist = std::move(outline);
+  return true;
+
+} // read_shard
+
+// ___________________________________________________________________________
+
+void set_top_sizes(pstree* t, int depth, const font& mainfont,
+                   double fontsize, double interspace)
+{
+  // the shards below are laid out already, by read_shard
+  if (depth == 0)
+    return;
+  if (t->left && t->right) {
+    set_top_sizes(t->left.get(), depth - 1, mainfont, fontsize, interspace);
+    set_top_sizes(t->right.get(), depth - 1, mainfont, fontsize, interspace);
+  }
+  set_node_size(t, mainfont, fontsize, interspace);
+
+} // set_top_sizes
+
+// ___________________________________________________________________________
+
+template <class Sink>
+static bool read_record(std::istream& is, double dx, double dy,
+                        const merge_drawing<Sink>& d, pstree& n, bool& branch)
+{
+  // one node of a shard, moved into place, with its box as
+  // set_node_geometry made it
+  shard_line line;
+  coord xbox, ybox;
+  long labels = 0;
+  branch = false;
+  if (!line.read(is) || !(line.tag('L') || (branch = line.tag('B'))) ||
+      !line.number(xbox) || !line.number(ybox) || !line.number(labels) ||
+      labels < 1)
+    return false;
+  double width = 0.0, height = 0.0;
+  n.nodestrings.resize(static_cast<std::size_t>(labels));
+  for (auto& ns : n.nodestrings) {
+    if (!std::getline(is, ns.text))
+      return false;
+    ns.width = string_width(ns.text, *d.mainfont, d.fontsize);
+    if (ns.width > width)
+      width = ns.width;
+    height += d.fontsize;
+  }
+  n.xbox = static_cast<coord>(xbox + dx);
+  n.ybox = static_cast<coord>(ybox + dy);
+  n.stringswidth = width;
+  n.boxheight = 1.2 * height + 0.4 * d.fontsize;
+  return true;
+
+} // read_record
+
+// ___________________________________________________________________________
+
+template <class Sink>
+static bool draw_records(std::istream& is, double dx, double dy,
+                         const merge_drawing<Sink>& d, pstree& n,
+                         bool branch)
+{
+  // in the order of ps_draw_tree, one node on each level in memory
+  if (branch) {
+    for (int i = 0; i < 2; i++) {
+      pstree child;
+      bool child_branch;
+      if (!read_record(is, dx, dy, d, child, child_branch))
+	return false;
+      ps_draw_arc(n.xbox, n.ybox, child.xbox, child.ybox, *d.sink);
+      if (!draw_records(is, dx, dy, d, child, child_branch))
+	return false;
+    }
+  }
+  ps_draw_node(&n, d.fontsize, *d.sink);
+  return true;
+
+} // draw_records
+
+// ___________________________________________________________________________
+
+template <class Sink>
+static bool draw_top(pstree* t, int level, merge_drawing<Sink>& d)
+{
+  if (level == d.depth) {
+    // the shard's nodes, moved by as much as its root has been
+    if (d.next >= d.record_files->size())
+      return false;
+    std::ifstream is((*d.record_files)[d.next++]);
+    pstree root;
+    bool branch;
+    if (!read_record(is, 0.0, 0.0, d, root, branch))
+      return false;
+    double dx = t->xbox - root.xbox;
+    double dy = t->ybox - root.ybox;
+    root.xbox = t->xbox;
+    root.ybox = t->ybox;
+    return draw_records(is, dx, dy, d, root, branch);
+  }
+
+  if (t->left && t->right) {
+    ps_draw_arc(t->xbox, t->ybox, t->left->xbox, t->left->ybox, *d.sink);
+    if (!draw_top(t->left.get(), level + 1, d))
+      return false;
+    ps_draw_arc(t->xbox, t->ybox, t->right->xbox, t->right->ybox, *d.sink);
+    if (!draw_top(t->right.get(), level + 1, d))
+      return false;
+  }
+  ps_draw_node(t, d.fontsize, *d.sink);
+  return true;
+
+} // draw_top
+
+// ___________________________________________________________________________
+
+template <class Sink, class>
+bool ps_draw_merged_tree(pstree* t, int depth,
+                         const std::vector<std::string>& record_files,
+                         const font& mainfont, double fontsize, Sink& sink)
+{
+  // The levels above the shards come from the tree; the shards are read
+  // from their record files one node at a time, in the order of
+  // ps_draw_tree.  False if a record file cannot be read.
+  merge_drawing<Sink> d = {depth, &record_files, 0, &mainfont, fontsize,
+                           &sink};
+  return draw_top(t, 0, d) && d.next == record_files.size();
+
+} // ps_draw_merged_tree
+
+template bool ps_draw_merged_tree<file_sink>(
+    pstree*, int, const std::vector<std::string>&, const font&, double,
+    file_sink&);
+template bool ps_draw_merged_tree<memory_sink>(
+    pstree*, int, const std::vector<std::string>&, const font&, double,
+    memory_sink&);
+template bool ps_draw_merged_tree<counting_sink>(
+    pstree*, int, const std::vector<std::string>&, const font&, double,
+    counting_sink&);
+template bool ps_draw_merged_tree<ostream_sink>(
+    pstree*, int, const std::vector<std::string>&, const font&, double,
+    ostream_sink&);
+
+// ___________________________________________________________________________
+// pst_shard.cc
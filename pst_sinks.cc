@@ -0,0 +1,488 @@
+// ___________________________________________________________________________
+// Includes and defines
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "pst.h"
+
+// ___________________________________________________________________________
+// Formatting for the PostScript writers
+
+namespace {
+
+// Writes to a sink what a std::ostream set to std::fixed would write, with
+// the same number of decimals, but without locales or virtual calls.
+template <class Sink>
+class ps_out {
+ private:
+  Sink& sink;
+  int decimals = 2;
+
+  template <class Integer>
+  ps_out& integer(Integer n) {
+    char buf[24];
+    auto end = std::to_chars(buf, buf + sizeof(buf), n).ptr;
+    sink.write(buf, static_cast<std::size_t>(end - buf));
+    return *this;
+  }
+
+ public:
+  explicit ps_out(Sink& sink) : sink(sink) {}
+  void precision(int n) { decimals = n; }
+
+  ps_out& operator<<(const char* s) {
+    sink.write(s, std::strlen(s));
+    return *this;
+  }
+  ps_out& operator<<(const std::string& s) {
+    sink.write(s.data(), s.size());
+    return *this;
+  }
+  ps_out& operator<<(char c) {
+    sink.write(&c, 1);
+    return *this;
+  }
+  ps_out& operator<<(int n) { return integer(n); }
+  ps_out& operator<<(long n) { return integer(n); }
+  ps_out& operator<<(unsigned long n) { return integer(n); }
+  ps_out& operator<<(long long n) { return integer(n); }
+  ps_out& operator<<(unsigned long long n) { return integer(n); }
+  ps_out& operator<<(double x) {
+    // large enough for the longest double with a few decimals
+    char buf[400];
+    int n = std::snprintf(buf, sizeof(buf), "%.*f", decimals, x);
+    sink.write(buf, static_cast<std::size_t>(n));
+    return *this;
+  }
+};
+
+// subpaths per path when arcs or boxes are batched; interpreters slow down
+// on far longer paths, and older ones run out of path space
+const int subpaths_per_path = 1000;
+
+} // namespace
+
+// ___________________________________________________________________________
+
+template <class Sink>
+static void ps_arc_path(double x0, double y0, double x3, double y3,
+                        ps_out<Sink>& os)
+{
+  double y1 = (y0 + y3) / 2.0;
+  os << x0 << " " << y0 << " mt "
+     << x0 << " " << y1 << " "
+     << x3 << " " << y1 << " "
+     << x3 << " " << y3 << " ct";
+
+} // ps_arc_path
+
+// ___________________________________________________________________________
+
+template <class Sink>
+static void ps_box_path(double x1, double y1, double x2, double y2,
+                        ps_out<Sink>& os)
+{
+  os << x1 << " " << y1 << " mt "
+     << x2 << " " << y1 << " lt "
+     << x2 << " " << y2 << " lt "
+     << x1 << " " << y2 << " lt cp";
+
+} // ps_box_path
+
+// ___________________________________________________________________________
+
+template <class Sink>
+static void ps_node_box(pstree* t, double fontsize, ps_out<Sink>& os)
+{
+  double x1 = t->xbox - t->stringswidth / 2.0 - 0.2 * fontsize;
+  double x2 = t->xbox + t->stringswidth / 2.0 + 0.2 * fontsize;
+  double y2 = t->ybox + 0.8 * fontsize;
+  double y1 = y2 - t->boxheight;
+  ps_box_path(x1, y1, x2, y2, os);
+
+} // ps_node_box
+
+// ___________________________________________________________________________
+
+template <class Sink>
+static void ps_draw_labels(pstree* t, double fontsize, Sink& sink)
+{
+  double x = t->xbox;
+  double y = t->ybox - 0.4 * fontsize;
+  for (const auto& ns : t->nodestrings) {
+    ps_draw_string(ns.text, x - ns.width / 2.0, y, sink);
+    y -= 1.2 * fontsize;
+  }
+
+} // ps_draw_labels
+
+// ___________________________________________________________________________
+
+void file_sink::write(const char* s, std::size_t n)
+{
+  if (used + n > buffer.size()) {
+    flush();
+    if (n > buffer.size()) {
+      // too big to be worth copying
+      failed = failed || std::fwrite(s, 1, n, file) != n;
+      written += static_cast<long long>(n);
+      return;
+    }
+  }
+  std::memcpy(buffer.data() + used, s, n);
+  used += n;
+
+} // file_sink::write
+
+// ___________________________________________________________________________
+
+bool file_sink::flush()
+{
+  if (used > 0) {
+    failed = failed || std::fwrite(buffer.data(), 1, used, file) != used;
+    written += static_cast<long long>(used);
+    used = 0;
+  }
+  failed = failed || std::fflush(file) != 0;
+  return !failed;
+
+} // file_sink::flush
+
+// ___________________________________________________________________________
+
+template <class Sink, class>
+void ps_draw_arc(double x0, double y0, double x3, double y3, Sink& sink)
+{
+  ps_out<Sink> os(sink);
+  os.precision(2);
+  os << "np ";
+  ps_arc_path(x0, y0, x3, y3, os);
+  os << " sk\n";
+
+} // ps_draw_arc
+
+// ___________________________________________________________________________
+
+template <class Sink, class>
+void ps_draw_box(double x1, double y1, double x2, double y2, Sink& sink)
+{
+  ps_out<Sink> os(sink);
+  os.precision(2);
+  os << "np ";
+  ps_box_path(x1, y1, x2, y2, os);
+  os << " er sk\n";
+
+} // ps_draw_box
+
+// ___________________________________________________________________________
+
+template <class Sink, class>
+void ps_draw_string(const std::string& s, double x, double y, Sink& sink)
+{
+  ps_out<Sink> os(sink);
+  os.precision(2);
+  os << x << " " << y << " mt (";
+  for (char c : s) {
+    if (c == '(' || c == ')' || c == '\\')
+      os << '\\';
+    os << c;
+  }
+  os << ") sh\n";
+
+} // ps_draw_string
+
+// ___________________________________________________________________________
+
+template <class Sink, class>
+void ps_draw_node(pstree* t, double fontsize, Sink& sink)
+{
+  ps_out<Sink> os(sink);
+  os.precision(2);
+  os << "np ";
+  ps_node_box(t, fontsize, os);
+  os << " er sk\n";
+  ps_draw_labels(t, fontsize, sink);
+
+} // ps_draw_node
+
+// ___________________________________________________________________________
+
+template <class Sink, class>
+void ps_draw_tree(pstree* t, double fontsize, Sink& sink)
+{
+  if (t && !t->nodestrings.empty())
+  {
+    if (t->left && t->right) {
+      ps_draw_arc(t->xbox, t->ybox, t->left->xbox, t->left->ybox, sink);
+      ps_draw_tree(t->left.get(), fontsize, sink);
+      ps_draw_arc(t->xbox, t->ybox, t->right->xbox, t->right->ybox, sink);
+      ps_draw_tree(t->right.get(), fontsize, sink);
+    }
+    ps_draw_node(t, fontsize, sink);
+  }
+
+} // ps_draw_tree
+
+// ___________________________________________________________________________
+
+template <class Sink, class>
+void ps_draw_tree_batched(pstree* t, const std::vector<pstree*>& nodes,
+                          double fontsize, Sink& sink)
+{
+  // All arcs first, in a few long paths with one stroke each, so that the
+  // white box fill still covers their ends
+  ps_out<Sink> os(sink);
+  os.precision(2);
+  int count = 0;
+  std::vector<pstree*> pending = {t};
+  while (!pending.empty()) {
+    pstree* n = pending.back();
+    pending.pop_back();
+    if (!n || n->nodestrings.empty() || !n->left || !n->right)
+      continue;
+    for (pstree* c : {n->left.get(), n->right.get()}) {
+      os << (count % subpaths_per_path == 0 ? "np " : "");
+      ps_arc_path(n->xbox, n->ybox, c->xbox, c->ybox, os);
+      os << (++count % subpaths_per_path == 0 ? " sk\n" : "\n");
+      pending.push_back(c);
+    }
+  }
+  if (count % subpaths_per_path != 0)
+    os << "sk\n";
+
+  // Then the boxes, filled and stroked a batch at a time, each batch
+  // followed by its labels.  Boxes never overlap, so this looks the same
+  // as drawing every node in turn; the nodes come in an order that keeps
+  // each batch close together.
+  for (std::size_t first = 0; first < nodes.size();
+       first += subpaths_per_path) {
+    std::size_t last = std::min(nodes.size(), first + subpaths_per_path);
+    os << "np";
+    for (std::size_t i = first; i < last; i++) {
+      os << (i == first ? " " : "\n");
+      ps_node_box(nodes[i], fontsize, os);
+    }
+    os << " er sk\n";
+    for (std::size_t i = first; i < last; i++)
+      ps_draw_labels(nodes[i], fontsize, sink);
+  }
+
+} // ps_draw_tree_batched
+
+// ___________________________________________________________________________
+
+template <class Sink, class>
+void ps_write_prolog(const std::string& fontname, double fontsize,
+                     int pages, dsc_index& index, Sink& sink)
+{
+  ps_out<Sink> os(sink);
+
+  // document structuring comments, so that pages can be found without
+  // interpreting the whole file
+  os << "%!PS-Adobe-3.0\n";
+  os << "%%Creator: pst\n";
+  os << "%%Pages: " << pages << "\n";
+  os << "%%PageOrder: Ascend\n";
+  os << "%%BoundingBox: 0 0 612 792\n";
+  os << "%%DocumentNeededResources: font " << fontname << "\n";
+  if (fontname != "Helvetica")
+    os << "%%+ font Helvetica\n";
+  os << "%%EndComments\n";
+  os << "%%BeginProlog\n";
+  ps_write_procs(fontname, fontsize, sink);
+  os << "%%EndProlog\n";
+  os << "%%BeginSetup\n";
+  os << "%%EndSetup\n";
+
+  index.prolog = static_cast<long>(sink.offset());
+  index.pages.clear();
+
+} // ps_write_prolog
+
+// ___________________________________________________________________________
+
+template <class Sink, class>
+void ps_write_procs(const std::string& fontname, double fontsize,
+                    Sink& sink)
+{
+  ps_out<Sink> os(sink);
+  os << "/bc {dup stringwidth -2 div exch -2 div exch rmt show} def\n";
+  os << "/bk {0 setgray} def\n\n";
+  os << "/cp {closepath} def\n";
+  os << "/ct {curveto} def\n";
+  os << "/er {gsave 1 setgray fill grestore} def\n";
+  os << "/gr {grestore} def\n";
+  os << "/gs {gsave} def\n";
+  os << "/gy {0.4 setgray} def\n";
+  os << "/lt {lineto} def\n";
+  os.precision(2);
+  os << "/mf {/" << fontname << " findfont " << fontsize
+     << " scalefont setfont} def\n";
+  os << "/mt {moveto} def\n";
+  os << "/np {newpath} def\n";
+  os << "/rf {/Helvetica findfont 8.0 scalefont setfont} def\n";
+  os << "/rlt {rlineto} def\n";
+  os << "/rmt {rmoveto} def\n";
+  os << "/sh {show} def\n";
+  os << "/sk {stroke} def\n";
+  os << "/slw {setlinewidth} def\n";
+  os << "/tr {translate} def\n";
+  os << "/wh {1 setgray} def\n";
+
+} // ps_write_procs
+
+// ___________________________________________________________________________
+
+template <class Sink, class>
+void ps_write_setup(const page_plan& plan, Sink& sink)
+{
+  ps_out<Sink> os(sink);
+  os.precision(2);
+  os << "% width: " << plan.width << " height: " << plan.height << "\n";
+  os << "% wpages: " << plan.wpages << ", hpages: " << plan.hpages
+     << ", total: " << plan.pages() << "\n";
+  os << "/sclip {np 0 0 mt 0 " << plan.pheight << " rlt " << plan.pwidth
+     << " 0 rlt 0 " << plan.pheight << " neg rlt cp clip} def\n";
+
+} // ps_write_setup
+
+// ___________________________________________________________________________
+
+template <class Sink, class>
+void ps_begin_page(const page_plan& plan, int row, int col, double fontsize,
+                   dsc_index& index, Sink& sink)
+{
+  ps_out<Sink> os(sink);
+  int pwidth = plan.pwidth, pheight = plan.pheight;
+  int hpages = plan.hpages, wpages = plan.wpages;
+
+  // each page saves and restores the state and sets up its own clip, so it
+  // only depends on the prolog
+  index.pages.push_back(static_cast<long>(sink.offset()));
+  int page = static_cast<int>(index.pages.size());
+  os << "\n%%Page: " << page << " " << page << "\n";
+  os << "%%BeginPageSetup\n";
+  os << "/pgsave save def\n";
+  ps_write_setup(plan, sink);
+  os << "%%EndPageSetup\n";
+  if (plan.orientation == 2)
+    os << "90 rotate 0 612 neg tr ";
+  os.precision(5);
+  os << "36 36 tr " << fontsize / 10.0 << " slw\n";
+  os.precision(3);
+
+  // provide cutting and gluing directions
+  if (hpages - row - 1) {
+    os << "gs rf 1 slw\n";
+    os << pwidth / 2.0 << " " << pheight + 10
+       << " mt (row " << hpages - row
+       << " - cut to remove line"
+       << ", place to cover line of adjoining page) bc\n";
+    os << "np -36 " << 0.50 + pheight
+       << " mt " << pwidth + 72 << " 0 rlt sk gr\n";
+  }
+  if (row) {
+    os << "gs rf 1 slw\n";
+    os << "gy " << pwidth / 2.0
+       << " -18 mt (place adjoining page of"
+       << " row " << hpages - row + 1
+       << " to cover line) bc\n";
+    os << "np -36 -0.5 mt " << pwidth + 72 << " 0 rlt sk gr\n";
+  }
+  if (col) {
+    os << "gs rf 1 slw\n";
+    os << "-10 " << pheight / 2.0
+       << " mt gs 90 rotate (col " << col + 1
+       << " - cut to"
+       << " remove line, place to cover line of adjoining page) "
+       << "bc gr\n";
+    os << "np -0.5 -36 mt 0 " << pheight + 72 << " rlt sk gr\n";
+  }
+  if (col < wpages - 1) {
+    os << "gs rf 1 slw\n";
+    os << "gy " << pwidth + 18 << " " << pheight / 2.0
+       << " mt gs 90 rotate (place adjoining "
+       << "page of column " << col + 2
+       << " to cover line) bc gr\n";
+    os << "np " << 0.50 + pwidth << " -36 mt 0 "
+       << pheight + 72 << " rlt sk gr\n";
+  }
+  os << "gs sclip " << (pwidth * wpages - plan.width) / 2.0 -
+         pwidth * col - plan.x
+     << " " << (pheight * hpages - plan.height) / 2.0 -
+         pheight * row - plan.y
+     << " tr mf\n";
+
+} // ps_begin_page
+
+// ___________________________________________________________________________
+
+template <class Sink, class>
+void ps_end_page(Sink& sink)
+{
+  ps_out<Sink> os(sink);
+  os << "gr showpage\n";
+  os << "pgsave restore\n";
+  os << "%%PageTrailer\n";
+
+} // ps_end_page
+
+// ___________________________________________________________________________
+
+template <class Sink, class>
+void ps_write_trailer(const dsc_index& index, Sink& sink)
+{
+  // Byte offsets of the prolog and of every page, and at the very end the
+  // offset of this index, so a single page can be cut out by seeking.
+  ps_out<Sink> os(sink);
+  long trailer = static_cast<long>(sink.offset());
+  os << "\n%%Trailer\n";
+  bool known = index.prolog >= 0 && trailer >= 0;
+  for (long offset : index.pages)
+    known = known && offset >= 0;
+  if (known) {
+    os << "%PST-Prolog: 0 " << index.prolog << "\n";
+    for (std::size_t i = 0; i < index.pages.size(); i++) {
+      long end = i + 1 < index.pages.size() ? index.pages[i + 1] : trailer;
+      os << "%PST-Page: " << i + 1 << " " << index.pages[i] << " "
+         << end - index.pages[i] << "\n";
+    }
+    os << "%PST-Index: " << trailer << "\n";
+  }
+  os << "%%EOF\n";
+
+} // ps_write_trailer
+
+// ___________________________________________________________________________
+// The writers for every sink
+
+#define PST_SINK_WRITERS(Sink)                                              \
+  template void ps_draw_arc<Sink>(double, double, double, double, Sink&);  \
+  template void ps_draw_box<Sink>(double, double, double, double, Sink&);  \
+  template void ps_draw_string<Sink>(const std::string&, double, double,   \
+                                     Sink&);                                \
+  template void ps_draw_node<Sink>(pstree*, double, Sink&);                \
+  template void ps_draw_tree<Sink>(pstree*, double, Sink&);                \
+  template void ps_draw_tree_batched<Sink>(                                \
+      pstree*, const std::vector<pstree*>&, double, Sink&);                 \
+  template void ps_write_prolog<Sink>(const std::string&, double, int,     \
+                                      dsc_index&, Sink&);                   \
+  template void ps_write_procs<Sink>(const std::string&, double, Sink&);   \
+  template void ps_write_setup<Sink>(const page_plan&, Sink&);             \
+  template void ps_begin_page<Sink>(const page_plan&, int, int, double,    \
+                                    dsc_index&, Sink&);                     \
+  template void ps_end_page<Sink>(Sink&);                                  \
+  template void ps_write_trailer<Sink>(const dsc_index&, Sink&);
+
+PST_SINK_WRITERS(file_sink)
+PST_SINK_WRITERS(memory_sink)
+PST_SINK_WRITERS(counting_sink)
+PST_SINK_WRITERS(ostream_sink)
+
+// ___________________________________________________________________________
+// pst_sinks.cc
@@ -0,0 +1,281 @@
+// ___________________________________________________________________________
+// Includes and defines
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "pst.h"
+
+// ___________________________________________________________________________
+// Spill file records
+
+namespace {
+
+// One finished node, written in post-order as soon as the node's own layout
+// is done.  Coordinates are relative to the frame the node was laid out in;
+// the offsets by which the parent later moved each child's frame are kept
+// so that absolute positions can be recovered top-down from the root.
+struct node_record {
+  double xbox, ybox, stringswidth, boxheight;
+  double lxbox, lybox, rxbox, rybox;
+  double ldx, ldy, rdx, rdy;
+  std::int64_t label_offset;
+  std::int32_t branch;
+};
+
+struct frame {
+  double dx, dy;
+};
+
+using file_ptr = std::unique_ptr<std::FILE, int (*)(std::FILE*)>;
+
+struct stream_context {
+  const font* mainfont;
+  double fontsize, interspace;
+  std::FILE* records;
+  std::FILE* labels;
+  long nodes;
+};
+
+} // namespace
+
+// ___________________________________________________________________________
+
+static void write_labels(const std::vector<NodeString>& strings, std::FILE* f)
+{
+  auto count = static_cast<std::uint32_t>(strings.size());
+  std::fwrite(&count, sizeof(count), 1, f);
+  for (const auto& ns : strings) {
+    auto len = static_cast<std::uint32_t>(ns.text.size());
+    std::fwrite(&ns.width, sizeof(ns.width), 1, f);
+    std::fwrite(&len, sizeof(len), 1, f);
+    std::fwrite(ns.text.data(), 1, len, f);
+  }
+
+} // write_labels
+
+// ___________________________________________________________________________
+
+static bool read_labels(std::vector<NodeString>& strings, std::FILE* f)
+{
+  std::uint32_t count;
+  if (std::fread(&count, sizeof(count), 1, f) != 1)
+    return false;
+  strings.resize(count);
+  for (auto& ns : strings) {
+    std::uint32_t len;
+    if (std::fread(&ns.width, sizeof(ns.width), 1, f) != 1 ||
+        std::fread(&len, sizeof(len), 1, f) != 1)
+      return false;
+    ns.text.resize(len);
+    if (len && std::fread(&ns.text[0], 1, len, f) != len)
+      return false;
+  }
+  return true;
+
+} // read_labels
+
+// ___________________________________________________________________________
+
+static std::unique_ptr<pstree> stream_node(std::istream& is,
+                                           stream_context& ctx)
+{
+  int nodetype;
+  char c;
+  std::string line;
+  std::unique_ptr<pstree> thisnode;
+  switch (nodetype = is.get())
+  {
+   case 'B':
+   case 'L':
+    thisnode = std::make_unique<pstree>();
+    std::getline(is, line);
+    thisnode->nodestrings.push_back({line});
+    while ((c = static_cast<char>(is.get())) == '+')
+    {
+      std::getline(is, line);
+      thisnode->nodestrings.push_back({line});
+    }
+    is.putback(c);
+    break;
+
+   default:
+    std::cout << "This is not a proper tree data file\n";
+    return nullptr;
+  }
+
+  node_record rec = {};
+  if (nodetype == 'B') {
+    thisnode->left = stream_node(is, ctx);
+    if (!thisnode->left)
+      return nullptr;
+    thisnode->right = stream_node(is, ctx);
+    if (!thisnode->right)
+      return nullptr;
+    rec.branch = 1;
+    rec.ldx = -thisnode->left->xbox;
+    rec.ldy = -thisnode->left->ybox;
+    rec.rdx = -thisnode->right->xbox;
+    rec.rdy = -thisnode->right->ybox;
+  }
+
+  // The children are childless stand-ins at this point, so moving them
+  // during the layout only moves their boxes and segment lists.
+  set_node_size(thisnode.get(), *ctx.mainfont, ctx.fontsize, ctx.interspace);
+  thisnode->seglist.prune_to_outline();
+
+  rec.xbox = thisnode->xbox;
+  rec.ybox = thisnode->ybox;
+  rec.stringswidth = thisnode->stringswidth;
+  rec.boxheight = thisnode->boxheight;
+  rec.label_offset = std::ftell(ctx.labels);
+  if (rec.branch) {
+    rec.lxbox = thisnode->left->xbox;
+    rec.lybox = thisnode->left->ybox;
+    rec.rxbox = thisnode->right->xbox;
+    rec.rybox = thisnode->right->ybox;
+    rec.ldx += rec.lxbox;
+    rec.ldy += rec.lybox;
+    rec.rdx += rec.rxbox;
+    rec.rdy += rec.rybox;
+    thisnode->left.reset();
+    thisnode->right.reset();
+  }
+  write_labels(thisnode->nodestrings, ctx.labels);
+  std::fwrite(&rec, sizeof(rec), 1, ctx.records);
+  ctx.nodes++;
+
+  // Only the geometry and the segment list are needed by the parent
+  std::vector<NodeString>().swap(thisnode->nodestrings);
+
+  return thisnode;
+
+} // stream_node
+
+// ___________________________________________________________________________
+
+std::unique_ptr<spilled_tree> ps_stream_tree(std::istream& is,
+                                             const font& mainfont,
+                                             double fontsize,
+                                             double interspace)
+{
+  file_ptr records(std::tmpfile(), std::fclose);
+  file_ptr labels(std::tmpfile(), std::fclose);
+  auto t = std::make_unique<spilled_tree>();
+  t->arcs.reset(std::tmpfile());
+  t->boxes.reset(std::tmpfile());
+  if (!records || !labels || !t->arcs || !t->boxes) {
+    std::cout << "Unable to create temporary files\n";
+    return nullptr;
+  }
+
+  stream_context ctx = {&mainfont, fontsize, interspace, records.get(),
+                        labels.get(), 0};
+  auto root = stream_node(is, ctx);
+  if (!root)
+    return nullptr;
+  t->x = root->x;
+  t->y = root->y;
+  t->width = root->width;
+  t->height = root->height;
+  t->nodes = ctx.nodes;
+  root.reset();
+
+  // Read the records back from the root down, which visits every node
+  // before its subtrees (right one first), and resolve the frame offsets.
+  std::vector<frame> frames = {{0.0, 0.0}};
+  std::vector<node_record> chunk(4096);
+  std::vector<NodeString> strings;
+  long remaining = ctx.nodes;
+  while (remaining > 0) {
+    long n = std::min<long>(remaining, static_cast<long>(chunk.size()));
+    remaining -= n;
+    std::fseek(records.get(),
+               remaining * static_cast<long>(sizeof(node_record)), SEEK_SET);
+    if (std::fread(chunk.data(), sizeof(node_record), n, records.get()) !=
+        static_cast<std::size_t>(n)) {
+      std::cout << "Unable to read temporary file\n";
+      return nullptr;
+    }
+
+    for (long i = n - 1; i >= 0; i--) {
+      const node_record& rec = chunk[i];
+      frame f = frames.back();
+      frames.pop_back();
+
+      double box[4] = {f.dx + rec.xbox, f.dy + rec.ybox,
+                       rec.stringswidth, rec.boxheight};
+      std::fwrite(box, sizeof(box), 1, t->boxes.get());
+      std::fseek(labels.get(), static_cast<long>(rec.label_offset), SEEK_SET);
+      if (!read_labels(strings, labels.get())) {
+	std::cout << "Unable to read temporary file\n";
+	return nullptr;
+      }
+      write_labels(strings, t->boxes.get());
+
+      if (rec.branch) {
+	double arcs[8] = {box[0], box[1],
+                          f.dx + rec.lxbox, f.dy + rec.lybox,
+                          box[0], box[1],
+                          f.dx + rec.rxbox, f.dy + rec.rybox};
+	std::fwrite(arcs, sizeof(arcs), 1, t->arcs.get());
+	frames.push_back({f.dx + rec.ldx, f.dy + rec.ldy});
+	frames.push_back({f.dx + rec.rdx, f.dy + rec.rdy});
+      }
+    }
+  }
+
+  return t;
+
+} // ps_stream_tree
+
+// ___________________________________________________________________________
+
+template <class Sink, class>
+void ps_draw_spilled_tree(spilled_tree* t, double fontsize, Sink& sink)
+{
+  // All arcs go first so the white box fill still covers their ends
+  double arc[4];
+  std::rewind(t->arcs.get());
+  while (std::fread(arc, sizeof(arc), 1, t->arcs.get()) == 1)
+    ps_draw_arc(arc[0], arc[1], arc[2], arc[3], sink);
+
+  pstree node;
+  double box[4];
+  std::rewind(t->boxes.get());
+  while (std::fread(box, sizeof(box), 1, t->boxes.get()) == 1 &&
+         read_labels(node.nodestrings, t->boxes.get())) {
+    node.xbox = box[0];
+    node.ybox = box[1];
+    node.stringswidth = box[2];
+    node.boxheight = box[3];
+    ps_draw_node(&node, fontsize, sink);
+  }
+
+} // ps_draw_spilled_tree
+
+template void ps_draw_spilled_tree<file_sink>(spilled_tree*, double,
+                                              file_sink&);
+template void ps_draw_spilled_tree<memory_sink>(spilled_tree*, double,
+                                                memory_sink&);
+template void ps_draw_spilled_tree<counting_sink>(spilled_tree*, double,
+                                                  counting_sink&);
+template void ps_draw_spilled_tree<ostream_sink>(spilled_tree*, double,
+                                                 ostream_sink&);
+
+// ___________________________________________________________________________
+
+void ps_draw_spilled_tree(spilled_tree* t, double fontsize, std::ostream& os)
+{
+  ostream_sink sink(os);
+  ps_draw_spilled_tree(t, fontsize, sink);
+
+} // ps_draw_spilled_tree
+
+// ___________________________________________________________________________
+// pst_stream.cc
@@ -0,0 +1,274 @@
+// ___________________________________________________________________________
+// Includes and defines
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "pst.h"
+
+// ___________________________________________________________________________
+// SVG writer
+
+namespace {
+
+// arcs per <path>, so that no single element grows without bound
+const int arcs_per_path = 4096;
+
+// Gives every distinct label block the number of its <symbol>, writing
+// the symbol the first time the block is seen.
+// Without labels, the symbols are only boxes.
+class svg_symbols {
+ private:
+  std::unordered_map<std::string, int> ids;
+  std::string key;
+  bool labels;
+
+ public:
+  explicit svg_symbols(bool labels = true) : labels(labels) {}
+  int get(pstree* t, double fontsize, std::ostream& os);
+};
+
+} // namespace
+
+// ___________________________________________________________________________
+
+static void svg_text(const std::string& s, std::ostream& os)
+{
+  // the labels are in the fonts' Latin-1 encoding
+  for (char c : s) {
+    unsigned char u = static_cast<unsigned char>(c);
+    if (c == '&')
+      os << "&amp;";
+    else if (c == '<')
+      os << "&lt;";
+    else if (c == '>')
+      os << "&gt;";
+    else if (u >= 128 || u < 32)
+      os << "&#" << static_cast<int>(u) << ";";
+    else
+      os << c;
+  }
+
+} // svg_text
+
+// ___________________________________________________________________________
+
+int svg_symbols::get(pstree* t, double fontsize, std::ostream& os)
+{
+  key.clear();
+  for (const auto& ns : t->nodestrings) {
+    key += ns.text;
+    key += '\n';
+  }
+  auto found = ids.emplace(key, static_cast<int>(ids.size()));
+  if (!found.second)
+    return found.first->second;
+
+  // the box and lines of ps_draw_node, around the node's (xbox, ybox),
+  // with y pointing down
+  double half = t->stringswidth / 2.0 + 0.2 * fontsize;
+  os << "<symbol id=\"n" << found.first->second
+     << "\" overflow=\"visible\"><rect x=\"" << -half << "\" y=\""
+     << -0.8 * fontsize << "\" width=\"" << 2.0 * half << "\" height=\""
+     << t->boxheight << "\"/>";
+  double y = 0.4 * fontsize;
+  for (const auto& ns : t->nodestrings) {
+    if (!labels)
+      break;
+    os << "<text x=\"" << -ns.width / 2.0 << "\" y=\"" << y << "\">";
+    svg_text(ns.text, os);
+    os << "</text>";
+    y += 1.2 * fontsize;
+  }
+  os << "</symbol>\n";
+  return found.first->second;
+
+} // svg_symbols::get
+
+// ___________________________________________________________________________
+
+static void svg_collect_symbols(pstree* t, double fontsize,
+                                svg_symbols& symbols, std::vector<int>& ids,
+                                std::ostream& os)
+{
+  // in the order of svg_draw_nodes
+  if (t && !t->nodestrings.empty())
+  {
+    if (t->left && t->right) {
+      svg_collect_symbols(t->left.get(), fontsize, symbols, ids, os);
+      svg_collect_symbols(t->right.get(), fontsize, symbols, ids, os);
+    }
+    ids.push_back(symbols.get(t, fontsize, os));
+  }
+
+} // svg_collect_symbols
+
+// ___________________________________________________________________________
+
+static void svg_arc(const pstree* t, const pstree* child, int& count,
+                    std::ostream& os)
+{
+  if (count > 0 && count % arcs_per_path == 0)
+    os << "\"/>\n<path d=\"";
+  // the curve of ps_draw_arc
+  double y1 = -(t->ybox + child->ybox) / 2.0;
+  os << "M" << t->xbox << " " << -t->ybox << "C" << t->xbox << " " << y1
+     << " " << child->xbox << " " << y1 << " " << child->xbox << " "
+     << -child->ybox;
+  count++;
+
+} // svg_arc
+
+// ___________________________________________________________________________
+
+static void svg_draw_arcs(pstree* t, int& count, std::ostream& os)
+{
+  if (t && !t->nodestrings.empty() && t->left && t->right)
+    for (pstree* child : {t->left.get(), t->right.get()}) {
+      svg_arc(t, child, count, os);
+      svg_draw_arcs(child, count, os);
+    }
+
+} // svg_draw_arcs
+
+// ___________________________________________________________________________
+
+static void svg_use(const pstree* t, int id, std::ostream& os)
+{
+  os << "<use href=\"#n" << id << "\" x=\"" << t->xbox << "\" y=\""
+     << -t->ybox << "\"/>\n";
+
+} // svg_use
+
+// ___________________________________________________________________________
+
+static void svg_draw_nodes(pstree* t, const std::vector<int>& ids,
+                           std::size_t& next, std::ostream& os)
+{
+  if (t && !t->nodestrings.empty())
+  {
+    if (t->left && t->right) {
+      svg_draw_nodes(t->left.get(), ids, next, os);
+      svg_draw_nodes(t->right.get(), ids, next, os);
+    }
+    svg_use(t, ids[next++], os);
+  }
+
+} // svg_draw_nodes
+
+// ___________________________________________________________________________
+
+static void svg_open(double x, double y, double width, double height,
+                     double pixel_width, double pixel_height,
+                     const std::string& fontname, double fontsize,
+                     double stroke, std::ostream& os)
+{
+  // the region from (x, y) up to (x + width, y + height), with y flipped
+  os << std::fixed << std::setprecision(2);
+  os << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+  os << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << pixel_width
+     << "\" height=\"" << pixel_height << "\" viewBox=\"" << x << " "
+     << -(y + height) << " " << width << " " << height << "\">\n";
+
+  // viewers without the font fall back to its family
+  std::string family = fontname.substr(0, fontname.find('-'));
+  os << "<style>\n"
+     << "path { fill: none; stroke: black; stroke-width: " << stroke
+     << "; }\n"
+     << "rect { fill: white; stroke: black; stroke-width: " << stroke
+     << "; }\n"
+     << "text { font-family: '" << fontname << "', '" << family
+     << "', sans-serif; font-size: " << fontsize << "px;";
+  if (fontname.find("Narrow") != std::string::npos)
+    os << " font-stretch: condensed;";
+  if (fontname.find("Bold") != std::string::npos)
+    os << " font-weight: bold;";
+  if (fontname.find("Oblique") != std::string::npos ||
+      fontname.find("Italic") != std::string::npos)
+    os << " font-style: italic;";
+  os << " }\n</style>\n";
+
+} // svg_open
+
+// ___________________________________________________________________________
+
+void svg_write_tree(pstree* t, const std::string& fontname, double fontsize,
+                    std::ostream& os)
+{
+  // the whole tree on one canvas, with the margin of the PDF forms, as
+  // boxes reach a little past the layout's extent
+  double margin = 2.0 * fontsize;
+  double width = t->width + 2.0 * margin, height = t->height + 2.0 * margin;
+  svg_open(t->x - margin, t->y - margin, width, height, width, height,
+           fontname, fontsize, fontsize / 10.0, os);
+
+  // each distinct label block once
+  svg_symbols symbols;
+  std::vector<int> ids;
+  os << "<defs>\n";
+  svg_collect_symbols(t, fontsize, symbols, ids, os);
+  os << "</defs>\n";
+
+  // all arcs first, in a few paths, so that the white boxes cover their
+  // ends as in the PostScript
+  int count = 0;
+  os << "<path d=\"";
+  svg_draw_arcs(t, count, os);
+  os << "\"/>\n";
+
+  std::size_t next = 0;
+  svg_draw_nodes(t, ids, next, os);
+  os << "</svg>\n";
+
+} // svg_write_tree
+
+// ___________________________________________________________________________
+
+void svg_write_tile(const std::vector<const index_entry*>& hits, double x,
+                    double y, double width, double height, int pixel_width,
+                    int pixel_height, const std::string& fontname,
+                    double fontsize, std::ostream& os)
+{
+  // lines stay at least half a pixel wide, and labels too small to read
+  // are left out
+  double scale = pixel_width / width;
+  svg_open(x, y, width, height, pixel_width, pixel_height, fontname,
+           fontsize, std::max(fontsize / 10.0, 0.5 / scale), os);
+  if (std::any_of(hits.begin(), hits.end(),
+                  [](const index_entry* e) { return e->summary; }))
+    os << "<style>\n.s { fill: #c8c8c8; stroke: none; }\n</style>\n";
+
+  svg_symbols symbols(fontsize * scale >= 2.0);
+  std::vector<int> ids;
+  os << "<defs>\n";
+  for (const index_entry* e : hits)
+    if (!e->child && !e->summary)
+      ids.push_back(symbols.get(e->node, fontsize, os));
+  os << "</defs>\n";
+
+  // arcs, then whole subtrees, then boxes, as in svg_write_tree
+  int count = 0;
+  os << "<path d=\"";
+  for (const index_entry* e : hits)
+    if (e->child)
+      svg_arc(e->node, e->child, count, os);
+  os << "\"/>\n";
+  for (const index_entry* e : hits)
+    if (e->summary)
+      os << "<rect class=\"s\" x=\"" << e->x1 << "\" y=\"" << -e->y2
+         << "\" width=\"" << e->x2 - e->x1 << "\" height=\"" << e->y2 - e->y1
+         << "\"/>\n";
+  std::size_t next = 0;
+  for (const index_entry* e : hits)
+    if (!e->child && !e->summary)
+      svg_use(e->node, ids[next++], os);
+  os << "</svg>\n";
+
+} // svg_write_tile
+
+// ___________________________________________________________________________
+// pst_svg.cc
@@ -1,10 +1,18 @@
 #include "pst.h"
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <fstream>
 #include <iomanip>
+#include <iterator>
+#include <map>
+#include <random>
 #include <sstream>
 #include <string>
+#include <thread>
 
 #include "gtest/gtest.h"
 
@@ -25,6 +33,12 @@ static std::string FontsDir() {
   return TestDataPath("fonts");
 }
 
+static std::string ReadFile(const std::string& path) {
+  std::ifstream ifs(path);
+  return std::string((std::istreambuf_iterator<char>(ifs)),
+                     std::istreambuf_iterator<char>());
+}
+
 // ___________________________________________________________________________
 // segment::contains tests
 
@@ -163,6 +177,76 @@ TEST(SeglistsIntersect, NonIntersectingLists) {
   EXPECT_FALSE(seglists_intersect(s1, s2));
 }
 
+// Helper: both forms of a list of random segments on a coarse grid, so
+// that ends meet and segments touch and overlap often
+static void RandomSegments(std::mt19937& rng, int n,
+                           std::vector<segment>& plain, segment_list& typed) {
+  std::uniform_int_distribution<int> grid(0, 8), kind(0, 2);
+  for (int i = 0; i < n; i++) {
+    segment s = {grid(rng) * 1.25f, grid(rng) * 1.25f, grid(rng) * 1.25f,
+                 grid(rng) * 1.25f};
+    if (kind(rng) == 0)
+      s.x2 = s.x1;
+    else if (kind(rng) == 0)
+      s.y2 = s.y1;
+    plain.push_back(s);
+    typed.push_back(s);
+  }
+}
+
+TEST(SeglistsIntersect, TypedListsClassifySegments) {
+  segment_list segs;
+  segs.push_back({0, 0, 10, 0});
+  segs.push_back({10, 5, 2, 5});
+  segs.push_back({3, 8, 3, 1});
+  segs.push_back({0, 0, 10, 10});
+  ASSERT_EQ(segs.horizontal.size(), 2u);
+  ASSERT_EQ(segs.vertical.size(), 1u);
+  ASSERT_EQ(segs.diagonal.size(), 1u);
+  EXPECT_DOUBLE_EQ(segs.horizontal[1].x1, 2.0);
+  EXPECT_DOUBLE_EQ(segs.horizontal[1].x2, 10.0);
+  EXPECT_DOUBLE_EQ(segs.vertical[0].y1, 1.0);
+  EXPECT_DOUBLE_EQ(segs.vertical[0].y2, 8.0);
+  EXPECT_EQ(segs.size(), 4u);
+}
+
+TEST(SeglistsIntersect, TypedListsClassifyStoredCoordinates) {
+  // a segment is classified by its ends as stored, which in a compact
+  // build may meet although the computed ones do not
+  segment_list segs;
+  segs.push_back(1.0, 0.0, 1.0 + 1e-9, 4.0);
+  bool meet = static_cast<coord>(1.0 + 1e-9) == static_cast<coord>(1.0);
+  EXPECT_EQ(segs.vertical.size(), meet ? 1u : 0u);
+  EXPECT_EQ(segs.diagonal.size(), meet ? 0u : 1u);
+}
+
+TEST(SeglistsIntersect, TypedListsMatchGenericTest) {
+  // the generic test over every pair is the reference
+  std::mt19937 rng(38);
+  std::uniform_int_distribution<int> length(0, 6);
+  std::uniform_real_distribution<double> shift(-3.0, 3.0);
+  int hits = 0;
+  for (int round = 0; round < 20000; round++) {
+    std::vector<segment> p1, p2;
+    segment_list t1, t2;
+    RandomSegments(rng, length(rng), p1, t1);
+    RandomSegments(rng, length(rng), p2, t2);
+    if (round % 2) {
+      double dx = shift(rng), dy = shift(rng);
+      move_seglist_horizontally(p2, dx);
+      move_seglist_horizontally(t2, dx);
+      move_seglist_vertically(p2, dy);
+      move_seglist_vertically(t2, dy);
+    }
+    bool expected = seglists_intersect(p1, p2);
+    ASSERT_EQ(seglists_intersect(t1, t2), expected) << "round " << round;
+    hits += expected;
+  }
+  // both outcomes are well covered
+  EXPECT_GT(hits, 2000);
+  EXPECT_LT(hits, 18000);
+}
+
 // ___________________________________________________________________________
 // ps_restore_tree tests
 
@@ -232,6 +316,212 @@ TEST(PsRestoreTree, Sample2File) {
   EXPECT_EQ(tree->right->nodestrings[0].text, "Dropped it on the floor");
 }
 
+// ___________________________________________________________________________
+// Subtree collapsing and skipping tests
+
+TEST(PsRestoreTreeCollapse, DepthLimitSummarizesLastLevel) {
+  std::istringstream input("BRoot\nBMid\nLLL\nLLR\nLR\n");
+  collapse_limits limits;
+  limits.max_levels = 2;
+  auto tree = ps_restore_tree(input, limits);
+  ASSERT_NE(tree, nullptr);
+  ASSERT_NE(tree->left, nullptr);
+  EXPECT_EQ(tree->left->left, nullptr);
+  EXPECT_EQ(tree->left->right, nullptr);
+  ASSERT_EQ(tree->left->nodestrings.size(), 2);
+  EXPECT_EQ(tree->left->nodestrings[0].text, "Mid");
+  EXPECT_EQ(tree->left->nodestrings[1].text, "[subtree: 3 nodes, depth 2]");
+  ASSERT_NE(tree->right, nullptr);
+  EXPECT_EQ(tree->right->nodestrings[0].text, "R");
+}
+
+TEST(PsRestoreTreeCollapse, DepthLimitRejectsTruncatedSubtree) {
+  std::istringstream input("BRoot\nBa\nLb\n");
+  collapse_limits limits;
+  limits.max_levels = 1;
+  EXPECT_EQ(ps_restore_tree(input, limits), nullptr);
+}
+
+TEST(PsRestoreTreeCollapse, NodeThresholdKeepsLargeSubtrees) {
+  std::istringstream input("BRoot\nBMid\nLLL\nLLR\nLR\n");
+  collapse_limits limits;
+  limits.min_nodes = 4;
+  auto tree = ps_restore_tree(input, limits);
+  ASSERT_NE(tree, nullptr);
+  EXPECT_EQ(tree->nodestrings.size(), 1);
+  ASSERT_NE(tree->left, nullptr);
+  EXPECT_EQ(tree->left->left, nullptr);
+  EXPECT_EQ(tree->left->nodestrings.back().text,
+            "[subtree: 3 nodes, depth 2]");
+  EXPECT_EQ(tree->right->nodestrings.size(), 1);
+}
+
+TEST(PsRestoreTreeCollapse, NoLimitsMatchesPlainRestore) {
+  std::string path = TestDataPath("testdata/sample1.txt");
+  std::ifstream ifs1(path), ifs2(path);
+  auto t1 = ps_restore_tree(ifs1);
+  auto t2 = ps_restore_tree(ifs2, collapse_limits());
+  ASSERT_NE(t1, nullptr);
+  ASSERT_NE(t2, nullptr);
+  EXPECT_EQ(t1->right->right->nodestrings[0].text,
+            t2->right->right->nodestrings[0].text);
+}
+
+TEST(PsSkipTree, CountsNodesAndLevels) {
+  std::istringstream input("BRoot\n+more\nBMid\nLLL\n+x\nLLR\nLR\nLNext\n");
+  long nodes = 0;
+  int levels = 0;
+  EXPECT_TRUE(ps_skip_tree(input, nodes, levels));
+  EXPECT_EQ(nodes, 5);
+  EXPECT_EQ(levels, 3);
+  // The stream is left at the start of the following tree
+  auto next = ps_restore_tree(input);
+  ASSERT_NE(next, nullptr);
+  EXPECT_EQ(next->nodestrings[0].text, "Next");
+}
+
+TEST(PsSkipTree, RejectsMalformedInput) {
+  std::istringstream input("BRoot\nXbad\n");
+  long nodes = 0;
+  int levels = 0;
+  EXPECT_FALSE(ps_skip_tree(input, nodes, levels));
+}
+
+TEST(PsSeekSubtree, ReadsOnlyTheSubtreeOnThePath) {
+  const std::string data = "BA\nBB\nLB1\n+more\nLB2\nBC\nLC1\nLC2\n";
+  auto restore = [&](const std::string& path) -> std::string {
+    std::istringstream input(data);
+    if (!ps_seek_subtree(input, path))
+      return "";
+    auto t = ps_restore_tree(input);
+    return t ? t->nodestrings[0].text : "";
+  };
+  EXPECT_EQ(restore(""), "A");
+  EXPECT_EQ(restore("l"), "B");
+  EXPECT_EQ(restore("r"), "C");
+  EXPECT_EQ(restore("lr"), "B2");
+  EXPECT_EQ(restore("rl"), "C1");
+  EXPECT_EQ(restore("lrl"), "");
+  EXPECT_EQ(restore("x"), "");
+
+  std::istringstream input(data);
+  tree_stats stats;
+  ASSERT_TRUE(ps_seek_subtree(input, "l"));
+  ASSERT_TRUE(ps_scan_tree(input, stats));
+  EXPECT_EQ(stats.nodes(), 3);
+  EXPECT_EQ(stats.continuations, 1);
+}
+
+TEST(PsScanTree, CountsNodesLabelsAndDepth) {
+  std::istringstream input("BRoot\n+more\nBMid\nLLL\n+x\nLLR\nLR\nLNext\n");
+  tree_stats stats;
+  EXPECT_TRUE(ps_scan_tree(input, stats));
+  EXPECT_EQ(stats.trees, 1);
+  EXPECT_EQ(stats.branches, 2);
+  EXPECT_EQ(stats.leaves, 3);
+  EXPECT_EQ(stats.continuations, 2);
+  EXPECT_EQ(stats.label_bytes, 4 + 4 + 3 + 2 + 1 + 2 + 1);
+  EXPECT_EQ(stats.depth, 3);
+  EXPECT_EQ(stats.lines, 7);
+  // The stream is left at the start of the following tree
+  auto next = ps_restore_tree(input);
+  ASSERT_NE(next, nullptr);
+  EXPECT_EQ(next->nodestrings[0].text, "Next");
+}
+
+TEST(PsScanTree, ReportsWhereTheTreeIsBroken) {
+  std::ostringstream messages;
+  auto* old = std::cout.rdbuf(messages.rdbuf());
+  tree_stats bad, short_tree;
+  std::istringstream bad_input("BRoot\n+more\nLa\nXb\n");
+  std::istringstream short_input("BRoot\nBMid\nLa\nLb\n");
+  bool bad_ok = ps_scan_tree(bad_input, bad);
+  bool short_ok = ps_scan_tree(short_input, short_tree);
+  std::cout.rdbuf(old);
+  EXPECT_FALSE(bad_ok);
+  EXPECT_FALSE(short_ok);
+  EXPECT_NE(messages.str().find("line 4 does not start with B or L"),
+            std::string::npos);
+  EXPECT_NE(messages.str().find("ends inside the tree, after line 4"),
+            std::string::npos);
+}
+
+TEST(PsScanTree, ScansForestsAndWritesJson) {
+  std::istringstream input("BA\nLB\nLC\n\nLD\n\n");
+  tree_stats stats;
+  EXPECT_TRUE(ps_scan_forest(input, stats));
+  EXPECT_EQ(stats.trees, 2);
+  EXPECT_EQ(stats.nodes(), 4);
+  EXPECT_EQ(stats.lines, 6);
+  std::ostringstream os;
+  write_stats_json(stats, os);
+  EXPECT_EQ(os.str(), "{\"trees\": 2, \"nodes\": 4, \"branches\": 1, "
+            "\"leaves\": 3, \"label_lines\": 4, \"label_bytes\": 4, "
+            "\"depth\": 2}");
+}
+
+TEST(PsScanTree, ReservedSegmentsHoldTheOutline) {
+  std::istringstream input("BA\nBB\nLC\nLD\nLE\n");
+  tree_stats stats;
+  ASSERT_TRUE(ps_scan_tree(input, stats));
+  input.clear();
+  input.seekg(0);
+  auto tree = ps_restore_tree(input);
+  ASSERT_NE(tree, nullptr);
+  reserve_segments(tree.get(), stats);
+  const segment_list& first = tree->left->left->seglist;
+  EXPECT_EQ(first.horizontal.capacity(), 10u);
+  const hsegment* storage = first.horizontal.data();
+  font f;
+  set_sizes(tree.get(), f, 6.0, 9.0);
+  // the root took over the reserved storage without growing it
+  EXPECT_EQ(tree->seglist.horizontal.data(), storage);
+  EXPECT_EQ(tree->seglist.horizontal.size(), 10u);
+  EXPECT_EQ(tree->seglist.size(), 24u);
+}
+
+// A stream buffer that cannot seek, as for a pipe
+class pipe_streambuf : public std::stringbuf {
+ public:
+  explicit pipe_streambuf(const std::string& data)
+      : std::stringbuf(data, std::ios_base::in) {}
+
+ protected:
+  pos_type seekoff(off_type, std::ios_base::seekdir,
+                   std::ios_base::openmode) override {
+    return pos_type(off_type(-1));
+  }
+  pos_type seekpos(pos_type, std::ios_base::openmode) override {
+    return pos_type(off_type(-1));
+  }
+};
+
+TEST(PsScanTree, RewindsInputThatCannotSeek) {
+  std::string data = "BA\nBB\nLC\nLD\nLE\n";
+  auto input = rewindable(std::make_unique<pipe_streambuf>(data));
+  std::istream is(input.get());
+  tree_stats stats;
+  ASSERT_TRUE(ps_scan_tree(is, stats));
+  is.clear();
+  is.seekg(0);
+  ASSERT_TRUE(is);
+  auto tree = ps_restore_tree(is);
+  ASSERT_NE(tree, nullptr);
+  EXPECT_EQ(tree->right->nodestrings[0].text, "E");
+
+  // a buffer that can seek is used as it is
+  auto plain = std::make_unique<std::stringbuf>(data, std::ios_base::in);
+  std::streambuf* before = plain.get();
+  EXPECT_EQ(rewindable(std::move(plain)).get(), before);
+}
+
+TEST(SubtreeSummary, GroupsThousands) {
+  EXPECT_EQ(subtree_summary(1234, 17), "[subtree: 1,234 nodes, depth 17]");
+  EXPECT_EQ(subtree_summary(2000000, 21),
+            "[subtree: 2,000,000 nodes, depth 21]");
+  EXPECT_EQ(subtree_summary(999, 3), "[subtree: 999 nodes, depth 3]");
+}
+
 // ___________________________________________________________________________
 // Font loading tests
 
@@ -337,6 +627,70 @@ TEST(PsDrawString, EscapesBackslash) {
   EXPECT_NE(output.find("(a\\\\b)"), std::string::npos);
 }
 
+// Helper: a whole document with its pages, into any sink
+template <class Sink>
+static void WriteDocument(pstree* t, Sink& sink) {
+  page_plan plan = plan_pages(t->x, t->y, 2000.0, 1000.0);
+  dsc_index index;
+  ps_write_prolog("Helvetica-Narrow", 6.0, plan.pages(), index, sink);
+  for (int row = 0; row < plan.hpages; row++)
+    for (int col = 0; col < plan.wpages; col++) {
+      ps_begin_page(plan, row, col, 6.0, index, sink);
+      ps_draw_tree(t, 6.0, sink);
+      ps_end_page(sink);
+    }
+  ps_write_trailer(index, sink);
+}
+
+TEST(Sinks, AllSinksWriteTheSameDocument) {
+  tree_builder b;
+  b.branch({"Top (1)"});
+  b.leaf({"Left \\ child", "second line"});
+  b.leaf({"Right child"});
+  auto tree = b.finish();
+  font f;
+  set_sizes(tree.get(), f, 6.0, 9.0);
+
+  std::ostringstream os;
+  ostream_sink to_stream(os);
+  WriteDocument(tree.get(), to_stream);
+  memory_sink memory;
+  WriteDocument(tree.get(), memory);
+  counting_sink counter;
+  WriteDocument(tree.get(), counter);
+  std::FILE* file = std::tmpfile();
+  ASSERT_NE(file, nullptr);
+  file_sink to_file(file, 100);  // smaller than the document
+  WriteDocument(tree.get(), to_file);
+  EXPECT_TRUE(to_file.flush());
+  std::rewind(file);
+  std::string from_file;
+  for (int c; (c = std::fgetc(file)) != EOF;)
+    from_file += static_cast<char>(c);
+  std::fclose(file);
+
+  EXPECT_EQ(memory.data, os.str());
+  EXPECT_EQ(from_file, os.str());
+  EXPECT_EQ(counter.bytes, static_cast<long long>(os.str().size()));
+  EXPECT_EQ(to_file.offset(), counter.bytes);
+  // several pages, with the index of their offsets at the end
+  EXPECT_NE(os.str().find("\n%%Page: 2 2\n"), std::string::npos);
+  EXPECT_NE(os.str().find("%PST-Index: "), std::string::npos);
+}
+
+TEST(Sinks, NumbersMatchFixedStreams) {
+  // the ostream overloads give what a std::fixed stream would
+  memory_sink memory;
+  ps_draw_arc(1.005, -0.004, 123456.789, 1e-9, memory);
+  std::ostringstream os;
+  os << std::fixed << std::setprecision(2);
+  os << "np " << 1.005 << " " << -0.004 << " mt " << 1.005 << " "
+     << (-0.004 + 1e-9) / 2.0 << " " << 123456.789 << " "
+     << (-0.004 + 1e-9) / 2.0 << " " << 123456.789 << " " << 1e-9
+     << " ct sk\n";
+  EXPECT_EQ(memory.data, os.str());
+}
+
 // ___________________________________________________________________________
 // move_tree tests
 
@@ -402,6 +756,1324 @@ TEST(MoveSeglist, Vertical) {
   EXPECT_DOUBLE_EQ(segs[0].x1, 0.0);  // x unchanged
 }
 
+TEST(MoveSeglist, TypedHorizontalCollapse) {
+  // a segment too short to survive the move becomes a vertical one
+  segment_list segs;
+  segs.push_back({1.0, 0.0, std::nextafter(1.0, 2.0), 0.0});
+  segs.push_back({1.0, 0.0, std::nextafter(1.0, 2.0), 4.0});
+  segs.push_back({0.0, 0.0, 4.0, 0.0});
+  move_seglist_horizontally(segs, 1.0);
+  ASSERT_EQ(segs.horizontal.size(), 1u);
+  ASSERT_EQ(segs.diagonal.size(), 0u);
+  ASSERT_EQ(segs.vertical.size(), 2u);
+  EXPECT_DOUBLE_EQ(segs.vertical[0].x, 2.0);
+  EXPECT_DOUBLE_EQ(segs.vertical[1].y2, 4.0);
+  EXPECT_DOUBLE_EQ(segs.horizontal[0].x2, 5.0);
+}
+
+// ___________________________________________________________________________
+// Helper: the drawing of each page, without any document structure around it
+
+static std::vector<std::string> PageContents(const std::string& ps) {
+  std::vector<std::string> pages;
+  std::size_t end = 0;
+  while ((end = ps.find("gr showpage\n", end)) != std::string::npos) {
+    std::size_t start = ps.rfind("36 36 tr", end);
+    start = ps.rfind('\n', start) + 1;
+    end += 12;
+    pages.push_back(ps.substr(start, end - start));
+  }
+  return pages;
+}
+
+// ___________________________________________________________________________
+// tree_builder tests
+
+TEST(TreeBuilder, BuildsInPreOrder) {
+  tree_builder b;
+  EXPECT_NE(b.branch({"Root"}), nullptr);
+  EXPECT_NE(b.branch({"Mid", "second line"}), nullptr);
+  b.leaf({"LL"});
+  EXPECT_FALSE(b.complete());
+  b.leaf({"LR"});
+  b.leaf({"R"});
+  EXPECT_TRUE(b.complete());
+  EXPECT_EQ(b.leaf({"extra"}), nullptr);
+
+  auto tree = b.finish();
+  ASSERT_NE(tree, nullptr);
+  EXPECT_EQ(tree->nodestrings[0].text, "Root");
+  ASSERT_EQ(tree->left->nodestrings.size(), 2);
+  EXPECT_EQ(tree->left->nodestrings[1].text, "second line");
+  EXPECT_EQ(tree->left->left->nodestrings[0].text, "LL");
+  EXPECT_EQ(tree->left->right->nodestrings[0].text, "LR");
+  EXPECT_EQ(tree->right->nodestrings[0].text, "R");
+}
+
+TEST(TreeBuilder, IncompleteTreeIsNotReturned) {
+  tree_builder b;
+  b.branch({"Root"});
+  b.leaf({"Left"});
+  EXPECT_EQ(b.finish(), nullptr);
+}
+
+TEST(TreeBuilder, EmptyLabelGetsOneLine) {
+  tree_builder b;
+  b.leaf({});
+  auto tree = b.finish();
+  ASSERT_NE(tree, nullptr);
+  EXPECT_EQ(tree->nodestrings.size(), 1);
+}
+
+// ___________________________________________________________________________
+// Page plan tests
+
+TEST(PlanPages, SmallTreeFitsOnePage) {
+  page_plan plan = plan_pages(0.0, 0.0, 100.0, 100.0);
+  EXPECT_EQ(plan.pages(), 1);
+}
+
+TEST(PlanPages, WideTreeUsesLandscape) {
+  page_plan plan = plan_pages(0.0, 0.0, 1400.0, 500.0);
+  EXPECT_EQ(plan.orientation, 2);
+  EXPECT_EQ(plan.pwidth, 720);
+  EXPECT_EQ(plan.wpages, 2);
+  EXPECT_EQ(plan.hpages, 1);
+}
+
+TEST(FitFontSize, LargestSizeWithinPageBudget) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  std::ifstream ifs(TestDataPath("testdata/sample1.txt"));
+  auto tree = ps_restore_tree(ifs);
+  page_budget budget;
+  budget.pages = 4;
+  double size = fit_font_size(tree.get(), f, budget, 6.0);
+  ASSERT_GT(size, 6.0);
+  page_plan plan = plan_pages(tree->x, tree->y, tree->width, tree->height);
+  EXPECT_LE(plan.pages(), 4);
+
+  // the tree is left laid out at the size found, as set_sizes would do
+  for (double s : {size, size + 0.01}) {
+    std::ifstream again(TestDataPath("testdata/sample1.txt"));
+    auto fresh = ps_restore_tree(again);
+    set_sizes(fresh.get(), f, s, 1.5 * s);
+    if (s == size) {
+      EXPECT_EQ(fresh->width, tree->width);
+      EXPECT_EQ(fresh->height, tree->height);
+      EXPECT_EQ(fresh->xbox, tree->xbox);
+    }
+    else {
+      EXPECT_FALSE(fits_budget(budget, fresh->x, fresh->y, fresh->width,
+                               fresh->height));
+    }
+  }
+}
+
+TEST(FitFontSize, WidthBudget) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  std::ifstream ifs(TestDataPath("testdata/sample2.txt"));
+  auto tree = ps_restore_tree(ifs);
+  page_budget budget;
+  budget.width = 100.0;
+  double size = fit_font_size(tree.get(), f, budget, 12.0);
+  ASSERT_GT(size, 0.0);
+  EXPECT_LE(tree->width, 100.0);
+  EXPECT_EQ(fit_font_size(tree.get(), f, budget, size), size);
+}
+
+TEST(FitFontSize, NothingFits) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  tree_builder b;
+  b.leaf({"label"});
+  auto tree = b.finish();
+  page_budget budget;
+  budget.height = 0.001;
+  EXPECT_EQ(fit_font_size(tree.get(), f, budget, 6.0), 0.0);
+}
+
+TEST(WritePlanJson, ReportsSizeAndPages) {
+  std::ostringstream os;
+  write_plan_json(plan_pages(0.0, 0.0, 1400.0, 500.0), 6.0, os);
+  EXPECT_EQ(os.str(),
+            "{\"fontsize\": 6.00, \"x\": 0.00, \"y\": 0.00, "
+            "\"width\": 1400.00, \"height\": 500.00, \"pages\": 2, "
+            "\"wpages\": 2, \"hpages\": 1, \"orientation\": \"landscape\", "
+            "\"page_width\": 720, \"page_height\": 540}");
+}
+
+TEST(WritePlanJson, ReportsBytesWhenKnown) {
+  std::ostringstream os;
+  write_plan_json(plan_pages(0.0, 0.0, 100.0, 100.0), 6.0, os, 12345);
+  EXPECT_NE(os.str().find(", \"bytes\": 12345}"), std::string::npos);
+}
+
+// ___________________________________________________________________________
+// Streaming layout tests
+
+static std::vector<std::string> SortedLines(const std::string& text) {
+  std::vector<std::string> lines;
+  std::istringstream is(text);
+  for (std::string line; std::getline(is, line);)
+    lines.push_back(line);
+  std::sort(lines.begin(), lines.end());
+  return lines;
+}
+
+TEST(PsStreamTree, MatchesInMemoryLayout) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  for (const char* sample : {"sample1.txt", "sample2.txt", "sample3.txt"}) {
+    std::string path = TestDataPath(std::string("testdata/") + sample);
+    std::ifstream ifs1(path), ifs2(path);
+    auto tree = ps_restore_tree(ifs1);
+    ASSERT_NE(tree, nullptr);
+    set_sizes(tree.get(), f, 6.0, 9.0);
+    auto spilled = ps_stream_tree(ifs2, f, 6.0, 9.0);
+    ASSERT_NE(spilled, nullptr);
+
+    EXPECT_DOUBLE_EQ(spilled->x, tree->x);
+    EXPECT_DOUBLE_EQ(spilled->y, tree->y);
+    EXPECT_DOUBLE_EQ(spilled->width, tree->width);
+    EXPECT_DOUBLE_EQ(spilled->height, tree->height);
+
+    // Same arcs and boxes, though arcs are all drawn before the boxes
+    std::ostringstream expected, actual;
+    expected << std::fixed;
+    actual << std::fixed;
+    ps_draw_tree(tree.get(), 6.0, expected);
+    ps_draw_spilled_tree(spilled.get(), 6.0, actual);
+    EXPECT_EQ(SortedLines(actual.str()), SortedLines(expected.str()))
+        << sample;
+  }
+}
+
+TEST(SegmentList, PruneToOutlineDropsWhatIsHidden) {
+  segment_list segs;
+  for (double lo : {0.0, 4.0}) {
+    double hi = 10.0 - lo;
+    segs.push_back(lo, lo, lo, hi);
+    segs.push_back(hi, lo, hi, hi);
+    segs.push_back(lo, lo, hi, lo);
+    segs.push_back(lo, hi, hi, hi);
+  }
+  segs.push_back(10.0, 10.0, 15.0, 20.0);
+  segs.prune_to_outline();
+
+  // the outer box and the diagonal are left; the inner box is inside
+  EXPECT_EQ(segs.size(), 5u);
+  for (const auto& v : segs.vertical)
+    EXPECT_TRUE(v.x == 0.0 || v.x == 10.0);
+  for (const auto& h : segs.horizontal)
+    EXPECT_EQ(h.x1, 0.0);
+  EXPECT_EQ(segs.diagonal.size(), 1u);
+}
+
+TEST(PsStreamTree, CanBeDrawnRepeatedly) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  std::istringstream input("BRoot\nLLeft\n+two\nLRight\n");
+  auto spilled = ps_stream_tree(input, f, 6.0, 9.0);
+  ASSERT_NE(spilled, nullptr);
+  EXPECT_EQ(spilled->nodes, 3);
+  std::ostringstream first, second;
+  ps_draw_spilled_tree(spilled.get(), 6.0, first);
+  ps_draw_spilled_tree(spilled.get(), 6.0, second);
+  EXPECT_EQ(first.str(), second.str());
+  EXPECT_NE(first.str().find("(two) sh"), std::string::npos);
+}
+
+TEST(PsStreamTree, RejectsMalformedInput) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  std::istringstream input("BRoot\nLLeft\n");
+  EXPECT_EQ(ps_stream_tree(input, f, 6.0, 9.0), nullptr);
+}
+
+// ___________________________________________________________________________
+// Forest tests
+
+TEST(PsRestoreForest, ReadsConcatenatedTrees) {
+  std::istringstream input("BA\nLA1\nLA2\n\nLB\n+two\nBC\nLC1\nLC2\n\n");
+  auto forest = ps_restore_forest(input, collapse_limits());
+  ASSERT_EQ(forest.size(), 3);
+  EXPECT_EQ(forest[0]->nodestrings[0].text, "A");
+  EXPECT_EQ(forest[1]->nodestrings.size(), 2);
+  EXPECT_EQ(forest[2]->right->nodestrings[0].text, "C2");
+}
+
+TEST(SetForestSizes, MatchesSequentialLayout) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  std::string data;
+  for (int copy = 0; copy < 3; copy++)
+    for (const char* sample : {"sample1.txt", "sample2.txt", "sample3.txt"}) {
+      std::ifstream ifs(TestDataPath(std::string("testdata/") + sample));
+      data.append(std::istreambuf_iterator<char>(ifs),
+                  std::istreambuf_iterator<char>());
+    }
+
+  // sample1 has a stray leaf after its tree, which becomes a tree of its own
+  std::istringstream in1(data), in2(data);
+  auto sequential = ps_restore_forest(in1, collapse_limits());
+  auto parallel = ps_restore_forest(in2, collapse_limits());
+  ASSERT_EQ(sequential.size(), 12);
+  ASSERT_EQ(parallel.size(), 12);
+  set_forest_sizes(sequential, f, 6.0, 9.0, 1);
+  set_forest_sizes(parallel, f, 6.0, 9.0, 4);
+  for (std::size_t i = 0; i < sequential.size(); i++) {
+    EXPECT_EQ(sequential[i]->width, parallel[i]->width);
+    EXPECT_EQ(sequential[i]->height, parallel[i]->height);
+    EXPECT_EQ(sequential[i]->xbox, parallel[i]->xbox);
+  }
+}
+
+TEST(PsWriteForest, EachTreeStartsOnItsOwnPage) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  std::istringstream input("BA\nLA1\nLA2\nLB\n");
+  auto forest = ps_restore_forest(input, collapse_limits());
+  ASSERT_EQ(forest.size(), 2);
+  set_forest_sizes(forest, f, 6.0, 9.0, 2);
+  std::ostringstream os;
+  ps_write_forest(forest, f.name(), 6.0, os);
+  std::string ps = os.str();
+
+  EXPECT_EQ(ps.compare(0, 15, "%!PS-Adobe-3.0\n"), 0);
+  EXPECT_NE(ps.find("%%Pages: 2\n"), std::string::npos);
+  EXPECT_NE(ps.find("%%EndProlog\n"), std::string::npos);
+  std::size_t page1 = ps.find("%%Page: 1 1\n");
+  std::size_t page2 = ps.find("%%Page: 2 2\n");
+  ASSERT_NE(page1, std::string::npos);
+  ASSERT_NE(page2, std::string::npos);
+  EXPECT_NE(ps.find("(A1) sh", page1), std::string::npos);
+  EXPECT_LT(ps.find("(A1) sh", page1), page2);
+  EXPECT_NE(ps.find("(B) sh", page2), std::string::npos);
+  EXPECT_EQ(ps.find("(A1) sh", page2), std::string::npos);
+  EXPECT_NE(ps.find("\n%%Trailer\n"), std::string::npos);
+  EXPECT_EQ(ps.substr(ps.size() - 6), "%%EOF\n");
+}
+
+// ___________________________________________________________________________
+// Pipelined layout tests
+
+TEST(PsPipelineTree, MatchesSequentialLayout) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  collapse_limits limits;
+  limits.min_nodes = 3;
+  for (const collapse_limits& l : {collapse_limits(), limits}) {
+    std::ifstream a(TestDataPath("testdata/sample1.txt"));
+    std::ifstream b(TestDataPath("testdata/sample1.txt"));
+    auto sequential = ps_restore_tree(a, l);
+    set_sizes(sequential.get(), f, 6.0, 9.0);
+    auto pipelined = ps_pipeline_tree(b, f, 6.0, 9.0, l);
+    ASSERT_TRUE(pipelined);
+
+    std::ostringstream expected, actual;
+    expected << std::fixed;
+    actual << std::fixed;
+    ps_draw_tree(sequential.get(), 6.0, expected);
+    ps_draw_tree(pipelined.get(), 6.0, actual);
+    EXPECT_EQ(actual.str(), expected.str());
+    EXPECT_EQ(pipelined->shape, sequential->shape);
+  }
+}
+
+TEST(PsPipelineTree, RejectsMalformedInput) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  std::istringstream input("BA\nBB\nLC\nX\n");
+  EXPECT_FALSE(ps_pipeline_tree(input, f, 6.0, 9.0, collapse_limits()));
+
+  // also below the depth limit, where subtrees are only skipped
+  std::istringstream truncated("BRoot\nBa\nLb\n");
+  collapse_limits limits;
+  limits.max_levels = 1;
+  EXPECT_FALSE(ps_pipeline_tree(truncated, f, 6.0, 9.0, limits));
+}
+
+TEST(WriterStreambuf, WritesEverythingInOrder) {
+  std::string path = testing::TempDir() + "/writer_streambuf.txt";
+  std::string expected;
+  {
+    writer_streambuf buf(path, 64);
+    ASSERT_TRUE(buf.is_open());
+    std::ostream os(&buf);
+    for (int i = 0; i < 1000; i++) {
+      EXPECT_EQ(os.tellp(), static_cast<long>(expected.size()));
+      std::string line = "line " + std::to_string(i) + "\n";
+      os << line;
+      expected += line;
+    }
+    os.flush();
+    EXPECT_TRUE(buf.close());
+  }
+  EXPECT_EQ(ReadFile(path), expected);
+  std::remove(path.c_str());
+}
+
+// ___________________________________________________________________________
+// Compressed file tests
+
+TEST(GzipStreambuf, ReadsWhatTheWriterCompressed) {
+  if (!gzip_available())
+    GTEST_SKIP() << "built without zlib";
+  std::string path = testing::TempDir() + "/writer_streambuf.txt.gz";
+  std::string expected = ReadFile(TestDataPath("testdata/sample1.txt"));
+  {
+    writer_streambuf buf(path, 64, true);
+    ASSERT_TRUE(buf.is_open());
+    std::ostream os(&buf);
+    os << expected;
+    // offsets are those of the uncompressed data
+    EXPECT_EQ(os.tellp(), static_cast<long>(expected.size()));
+    os.flush();
+    EXPECT_TRUE(buf.close());
+  }
+  EXPECT_NE(ReadFile(path), expected);
+
+  gzip_streambuf buf(path);
+  ASSERT_TRUE(buf.is_open());
+  std::istream is(&buf);
+  std::string contents((std::istreambuf_iterator<char>(is)),
+                       std::istreambuf_iterator<char>());
+  EXPECT_EQ(contents, expected);
+
+  // a second pass, as after the scan of the file
+  is.clear();
+  is.seekg(0);
+  auto tree = ps_restore_tree(is);
+  ASSERT_TRUE(tree);
+  std::istringstream plain(expected);
+  EXPECT_EQ(tree->nodestrings[0].text,
+            ps_restore_tree(plain)->nodestrings[0].text);
+  std::remove(path.c_str());
+}
+
+// ___________________________________________________________________________
+// Shard tests
+
+TEST(Shards, MergedLayoutMatchesWholeLayout) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  std::ifstream ifs(TestDataPath("testdata/sample1.txt"));
+  std::string data((std::istreambuf_iterator<char>(ifs)),
+                   std::istreambuf_iterator<char>());
+  std::istringstream in(data);
+  auto whole = ps_restore_tree(in);
+  set_sizes(whole.get(), f, 6.0, 9.0);
+  const char* tmpdir = std::getenv("TEST_TMPDIR");
+  std::string base = std::string(tmpdir ? tmpdir : "/tmp") + "/pst_test." +
+                     std::to_string(::getpid()) + ".shard";
+
+  // each shard laid out on its own, as in separate processes
+  std::vector<std::string> summaries, records;
+  for (int i = 0; i < 4; i++) {
+    std::istringstream part(data);
+    std::vector<shard_info> shards;
+    auto top = ps_restore_top_levels(part, collapse_limits(), 2, i, shards);
+    ASSERT_TRUE(top);
+    ASSERT_EQ(shards.size(), 4);
+    set_sizes(shards[i].node, f, 6.0, 9.0);
+    std::ostringstream summary;
+    std::ofstream nodes(base + std::to_string(i));
+    write_shard(shards[i], f.name(), 6.0, summary, nodes);
+    summaries.push_back(summary.str());
+    records.push_back(base + std::to_string(i));
+    EXPECT_LT(summary.str().size(), data.size());
+  }
+
+  // the merge builds nothing below the shards' roots
+  std::istringstream top_part(data);
+  std::vector<shard_info> shards;
+  auto merged = ps_restore_top_levels(top_part, collapse_limits(), 2, -1,
+                                      shards);
+  ASSERT_EQ(shards.size(), 4);
+  for (int i = 0; i < 4; i++) {
+    EXPECT_FALSE(shards[i].node->left);
+    EXPECT_TRUE(shards[i].node->nodestrings.empty());
+    std::istringstream summary(summaries[i]);
+    EXPECT_TRUE(read_shard(summary, shards[i], f.name(), 6.0));
+  }
+  set_top_sizes(merged.get(), 2, f, 6.0, 9.0);
+
+  memory_sink expected, actual;
+  ps_draw_tree(whole.get(), 6.0, expected);
+  EXPECT_TRUE(ps_draw_merged_tree(merged.get(), 2, records, f, 6.0, actual));
+  EXPECT_EQ(actual.data, expected.data);
+  EXPECT_EQ(merged->width, whole->width);
+  EXPECT_EQ(merged->height, whole->height);
+
+  records.pop_back();
+  EXPECT_FALSE(ps_draw_merged_tree(merged.get(), 2, records, f, 6.0, actual));
+  for (int i = 0; i < 4; i++)
+    std::remove((base + std::to_string(i)).c_str());
+}
+
+TEST(Shards, CollapsedLevelsHoldNoShards) {
+  // with -c, a small subtree above the shard level takes its shards along,
+  // and the shards are numbered without them
+  std::vector<shard_info> shards;
+  std::istringstream input("BA\nBB\nLB1\nLB2\nBC\nBC1\nLC11\nLC12\nLC2\n");
+  collapse_limits limits;
+  limits.min_nodes = 4;
+  auto tree = ps_restore_top_levels(input, limits, 2, 0, shards);
+  ASSERT_TRUE(tree);
+  ASSERT_EQ(shards.size(), 2);
+  EXPECT_EQ(shards[0].nodes, 3);
+  EXPECT_EQ(shards[0].levels, 2);
+  EXPECT_EQ(shards[0].node->nodestrings[0].text, "C1");
+  EXPECT_EQ(shards[0].node->nodestrings.size(), 2);  // collapsed itself
+  EXPECT_FALSE(tree->left->left);
+  EXPECT_EQ(tree->left->nodestrings.back().text, subtree_summary(3, 2));
+  EXPECT_TRUE(tree->right->right->nodestrings.empty());
+}
+
+TEST(Shards, RejectsShardsOfOtherSubtreesOrSizes) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  std::istringstream input("BA\nBB\nLB1\nLB2\nLC\n");
+  std::vector<shard_info> shards;
+  auto tree = ps_restore_top_levels(input, collapse_limits(), 1, 0, shards);
+  ASSERT_EQ(shards.size(), 2);
+  set_sizes(shards[0].node, f, 6.0, 9.0);
+  std::stringstream file, nodes;
+  write_shard(shards[0], f.name(), 6.0, file, nodes);
+  std::string text = file.str();
+
+  std::istringstream other(text), resized(text), cut(text.substr(0, 100));
+  EXPECT_FALSE(read_shard(other, shards[1], f.name(), 6.0));
+  EXPECT_FALSE(read_shard(resized, shards[0], f.name(), 8.0));
+  EXPECT_FALSE(read_shard(cut, shards[0], f.name(), 6.0));
+  std::istringstream again("BA\nBB\nLB1\nLB2\nLC\n");
+  EXPECT_TRUE(ps_restore_top_levels(again, collapse_limits(), 3, -1, shards));
+  EXPECT_TRUE(shards.empty());
+}
+
+// ___________________________________________________________________________
+// Document structuring tests
+
+static std::string RenderSample1(double fontsize) {
+  font f;
+  EXPECT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  std::ifstream ifs(TestDataPath("testdata/sample1.txt"));
+  auto tree = ps_restore_tree(ifs);
+  std::ostringstream os;
+  ps_render(tree.get(), f, fontsize, os);
+  return os.str();
+}
+
+// Reads "%PST-<key>: a b c" lines from the trailer that the index points to
+static std::vector<std::vector<long>> TrailerIndex(const std::string& ps,
+                                                   const std::string& key) {
+  std::vector<std::vector<long>> entries;
+  std::size_t at = ps.rfind("%PST-Index: ");
+  if (at == std::string::npos)
+    return entries;
+  std::size_t trailer = std::stoul(ps.substr(at + 12));
+  std::istringstream is(ps.substr(trailer));
+  for (std::string line; std::getline(is, line);)
+    if (line.compare(0, key.size() + 6, "%PST-" + key + ":") == 0) {
+      std::istringstream ls(line.substr(key.size() + 6));
+      std::vector<long> values;
+      for (long v; ls >> v;)
+        values.push_back(v);
+      entries.push_back(values);
+    }
+  return entries;
+}
+
+TEST(PsDocument, HasStructuringComments) {
+  std::string ps = RenderSample1(40.0);
+  EXPECT_EQ(ps.compare(0, 15, "%!PS-Adobe-3.0\n"), 0);
+  for (const char* comment : {"\n%%EndComments\n", "\n%%BeginProlog\n",
+                              "\n%%EndProlog\n", "\n%%BeginSetup\n",
+                              "\n%%EndSetup\n", "\n%%Trailer\n"})
+    EXPECT_NE(ps.find(comment), std::string::npos) << comment;
+  EXPECT_EQ(ps.substr(ps.size() - 6), "%%EOF\n");
+
+  std::size_t at = ps.find("%%Pages: ");
+  ASSERT_NE(at, std::string::npos);
+  int pages = std::stoi(ps.substr(at + 9));
+  EXPECT_GT(pages, 1);
+  for (int page = 1; page <= pages; page++) {
+    std::string comment = "\n%%Page: " + std::to_string(page) + " " +
+                          std::to_string(page) + "\n";
+    EXPECT_NE(ps.find(comment), std::string::npos) << comment;
+  }
+  EXPECT_EQ(PageContents(ps).size(), static_cast<std::size_t>(pages));
+}
+
+TEST(PsDocument, TrailerIndexesEveryPage) {
+  std::string ps = RenderSample1(40.0);
+  auto prolog = TrailerIndex(ps, "Prolog");
+  ASSERT_EQ(prolog.size(), 1);
+  ASSERT_EQ(prolog[0].size(), 2);
+  EXPECT_EQ(ps.compare(prolog[0][1] - 11, 11, "%%EndSetup\n"), 0);
+
+  auto pages = TrailerIndex(ps, "Page");
+  ASSERT_GT(pages.size(), 1);
+  long expected_offset = prolog[0][1];
+  for (std::size_t i = 0; i < pages.size(); i++) {
+    ASSERT_EQ(pages[i].size(), 3);
+    EXPECT_EQ(pages[i][0], static_cast<long>(i + 1));
+    EXPECT_EQ(pages[i][1], expected_offset);
+    std::string page = ps.substr(pages[i][1], pages[i][2]);
+    EXPECT_EQ(page.compare(0, 9, "\n%%Page: "), 0);
+    EXPECT_EQ(page.substr(page.size() - 14), "%%PageTrailer\n");
+    expected_offset += pages[i][2];
+  }
+  EXPECT_EQ(ps.compare(expected_offset, 11, "\n%%Trailer\n"), 0);
+}
+
+TEST(PsDocument, SinglePageCanBeCutOut) {
+  std::string ps = RenderSample1(40.0);
+  auto prolog = TrailerIndex(ps, "Prolog");
+  auto pages = TrailerIndex(ps, "Page");
+  ASSERT_EQ(prolog.size(), 1);
+  ASSERT_GT(pages.size(), 2);
+
+  std::string single = ps.substr(0, prolog[0][1]) +
+                       ps.substr(pages[2][1], pages[2][2]) + "%%EOF\n";
+  auto contents = PageContents(single);
+  ASSERT_EQ(contents.size(), 1);
+  EXPECT_EQ(contents[0], PageContents(ps)[2]);
+  std::size_t save = single.find("/pgsave save def\n");
+  ASSERT_NE(save, std::string::npos);
+  EXPECT_NE(single.find("/sclip", save), std::string::npos);
+}
+
+// ___________________________________________________________________________
+// Shared layout tests
+
+// A tree in file format whose subtrees repeat at every level
+static std::string RepeatedTree(int levels) {
+  if (levels == 0)
+    return "Lleaf\n";
+  std::string sub = RepeatedTree(levels - 1);
+  return "Bsplit " + std::to_string(levels) + "\n" + sub +
+         (levels % 2 ? sub : "Lother\n");
+}
+
+static void ClearShapes(pstree* t) {
+  t->shape = 0;
+  if (t->left) {
+    ClearShapes(t->left.get());
+    ClearShapes(t->right.get());
+  }
+}
+
+TEST(ShapeHash, EqualSubtreesHashAlike) {
+  std::istringstream input("BA\nBB\nLC\nLD\nBB\nLC\nLD\n");
+  auto tree = ps_restore_tree(input);
+  ASSERT_TRUE(tree);
+  EXPECT_NE(tree->left->shape, 0u);
+  EXPECT_EQ(tree->left->shape, tree->right->shape);
+  EXPECT_NE(tree->left->left->shape, tree->left->right->shape);
+  EXPECT_NE(tree->shape, tree->left->shape);
+
+  tree_builder b;
+  b.branch({"A"});
+  b.branch({"B"});
+  b.leaf({"C"});
+  b.leaf({"D"});
+  b.branch({"B"});
+  b.leaf({"C"});
+  b.leaf({"D"});
+  auto built = b.finish();
+  EXPECT_EQ(built->shape, tree->shape);
+}
+
+TEST(SetSizes, SharedLayoutMatchesFullLayout) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  std::istringstream a(RepeatedTree(7)), b(RepeatedTree(7));
+  auto shared = ps_restore_tree(a);
+  auto full = ps_restore_tree(b);
+  ClearShapes(full.get());
+  set_sizes(shared.get(), f, 6.0, 9.0);
+  set_sizes(full.get(), f, 6.0, 9.0);
+
+  std::ostringstream shared_ps, full_ps;
+  shared_ps << std::fixed;
+  full_ps << std::fixed;
+  ps_draw_tree(shared.get(), 6.0, shared_ps);
+  ps_draw_tree(full.get(), 6.0, full_ps);
+  EXPECT_EQ(shared_ps.str(), full_ps.str());
+  EXPECT_EQ(shared->width, full->width);
+  EXPECT_EQ(shared->height, full->height);
+  EXPECT_EQ(shared->seglist.size(), full->seglist.size());
+}
+
+// ___________________________________________________________________________
+// Watch mode tests
+
+// An uneven tree in file format, with labels of different widths
+static std::string RandomTreeText(std::mt19937& rng, int branches) {
+  std::uniform_int_distribution<int> coin(0, 1), width(1, 12);
+  std::string text;
+  int open = 1, count = 0;
+  while (open > 0) {
+    bool branch = count < branches && (open < 3 || coin(rng));
+    text += branch ? "B" : "L";
+    text += std::string(width(rng), 'a' + count % 26) + "\n";
+    if (coin(rng) && coin(rng))
+      text += "+" + std::to_string(count) + "\n";
+    open += branch ? 1 : -1;
+    count++;
+  }
+  return text;
+}
+
+static std::string RenderText(const std::string& text, const font& f) {
+  std::istringstream input(text);
+  auto tree = ps_restore_tree(input);
+  std::ostringstream os;
+  ps_render(tree.get(), f, 6.0, os);
+  return os.str();
+}
+
+TEST(WatchedTree, EditsMatchLayoutFromScratch) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  std::mt19937 rng(49);
+  std::string text = RandomTreeText(rng, 300);
+  watched_tree watched(f, 6.0, 9.0);
+  ASSERT_TRUE(watched.update(text));
+  EXPECT_EQ(watched.reused_nodes(), 0);
+
+  // a label, a leaf made into a subtree, that subtree removed again, a
+  // line added to a label, which the bytes before it do not show, and the
+  // root's label
+  std::size_t middle = text.find("\nL", text.size() / 2) + 1;
+  std::size_t end = text.find('\n', middle) + 1;
+  std::string label = text.substr(0, middle) + "Lchanged\n" +
+                      text.substr(end);
+  std::string grown = text.substr(0, middle) + "Bnew\nLx\nLy\n" +
+                      text.substr(end);
+  std::string extra = text.substr(0, end) + "+extra\n" + text.substr(end);
+  std::string root = "Broot" + text.substr(text.find('\n'));
+  for (const std::string& version : {label, grown, text, extra, root}) {
+    ASSERT_TRUE(watched.update(version));
+    EXPECT_GT(watched.reused_nodes(), 100);
+    EXPECT_EQ(watched.source(), version);
+
+    // the same in double precision; floats round the moves differently
+    std::istringstream input(version);
+    auto fresh = ps_restore_tree(input);
+    set_sizes(fresh.get(), f, 6.0, 9.0);
+    EXPECT_NEAR(watched.tree()->width, fresh->width, 0.01);
+    EXPECT_NEAR(watched.tree()->height, fresh->height, 0.01);
+    if (std::is_same<coord, double>::value) {
+      std::ostringstream os;
+      ps_write_tree(watched.tree(), f.name(), 6.0, os);
+      EXPECT_EQ(os.str(), RenderText(version, f));
+    }
+  }
+}
+
+TEST(WatchedTree, MalformedVersionStartsAfresh) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  std::mt19937 rng(7);
+  std::string text = RandomTreeText(rng, 50);
+  watched_tree watched(f, 6.0, 9.0);
+  ASSERT_TRUE(watched.update(text));
+  EXPECT_FALSE(watched.update(text.substr(0, text.size() - 10)));
+  EXPECT_EQ(watched.tree(), nullptr);
+
+  ASSERT_TRUE(watched.update(text));
+  EXPECT_EQ(watched.reused_nodes(), 0);
+  std::ostringstream os;
+  ps_write_tree(watched.tree(), f.name(), 6.0, os);
+  EXPECT_EQ(os.str(), RenderText(text, f));
+}
+
+// ___________________________________________________________________________
+// Spatial index tests
+
+// A complete tree with the given number of levels, whose leaves are all
+// labeled with the given label if there is one
+static std::unique_ptr<pstree> BalancedTree(int levels,
+                                            const std::string& leaf = "") {
+  tree_builder b;
+  std::vector<int> depth = {1};
+  int count = 0;
+  while (!depth.empty()) {
+    int d = depth.back();
+    depth.pop_back();
+    std::string label = "N" + std::to_string(count++);
+    if (d < levels) {
+      b.branch({label});
+      depth.push_back(d + 1);
+      depth.push_back(d + 1);
+    }
+    else
+      b.leaf({leaf.empty() ? label : leaf});
+  }
+  return b.finish();
+}
+
+TEST(NodeIndex, FindsEveryNodeByItsCenter) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  auto tree = BalancedTree(9);
+  set_sizes(tree.get(), f, 6.0, 9.0);
+  node_index index(tree.get(), 6.0);
+  EXPECT_EQ(index.size(), 511 + 510);
+
+  std::vector<pstree*> pending = {tree.get()};
+  while (!pending.empty()) {
+    pstree* t = pending.back();
+    pending.pop_back();
+    EXPECT_EQ(index.node_at(t->xbox, t->ybox - 1.0), t);
+    if (t->left) {
+      pending.push_back(t->left.get());
+      pending.push_back(t->right.get());
+    }
+  }
+  EXPECT_EQ(index.node_at(tree->x - 100.0, tree->y - 100.0), nullptr);
+}
+
+TEST(NodeIndex, RegionQueryMatchesScan) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  auto tree = BalancedTree(10);
+  set_sizes(tree.get(), f, 6.0, 9.0);
+  node_index index(tree.get(), 6.0);
+
+  std::vector<const index_entry*> all;
+  index.query(tree->x - 50.0, tree->y - 50.0, tree->x + tree->width + 50.0,
+              tree->y + tree->height + 50.0, all);
+  ASSERT_EQ(all.size(), index.size());
+
+  for (int i = 0; i < 20; i++) {
+    double x1 = tree->x + tree->width * i / 20.0;
+    double y1 = tree->y + tree->height * (i % 7) / 7.0;
+    double x2 = x1 + 40.0 + 10.0 * i, y2 = y1 + 30.0;
+    std::vector<const index_entry*> hits;
+    index.query(x1, y1, x2, y2, hits);
+    std::size_t expected = 0;
+    for (const index_entry* e : all)
+      if (!(e->x2 < x1 || e->x1 > x2 || e->y2 < y1 || e->y1 > y2))
+        expected++;
+    EXPECT_EQ(hits.size(), expected);
+    for (pstree* n : index.nodes_in(x1, y1, x2, y2))
+      EXPECT_TRUE(n->xbox + n->stringswidth >= x1 - 5.0 &&
+                  n->xbox - n->stringswidth <= x2 + 5.0);
+  }
+}
+
+TEST(NodeIndex, SmallSubtreesAreSummarized) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  auto tree = BalancedTree(9);
+  set_sizes(tree.get(), f, 6.0, 9.0);
+  pstree* left = tree->left.get();
+  pstree* right = tree->right.get();
+  double limit = std::max({left->width, left->height, right->width,
+                           right->height}) + 1.0;
+  node_index index(tree.get(), 6.0, limit);
+
+  // the root's box and arcs, and its two subtrees as a whole
+  ASSERT_EQ(index.size(), 5u);
+  std::vector<const index_entry*> all;
+  index.query(tree->x, tree->y, tree->x + tree->width,
+              tree->y + tree->height, all);
+  ASSERT_EQ(all.size(), 5u);
+  int summaries = 0;
+  for (const index_entry* e : all)
+    if (e->summary) {
+      summaries++;
+      EXPECT_TRUE(e->node == left || e->node == right);
+      EXPECT_DOUBLE_EQ(e->x1, e->node->x);
+      EXPECT_DOUBLE_EQ(e->y1, e->node->y);
+      EXPECT_NEAR(e->x2 - e->x1, e->node->width, 1e-3);
+      EXPECT_NEAR(e->y2 - e->y1, e->node->height, 1e-3);
+    }
+  EXPECT_EQ(summaries, 2);
+}
+
+// ___________________________________________________________________________
+// Trace tests
+
+TEST(Trace, RecordsSpansOnlyWhileEnabled) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  std::string path = testing::TempDir() + "/trace.json";
+  {
+    trace_span ignored("ignored");
+  }
+  trace_span::enabled = true;
+  {
+    trace_span span("outer", "value", 1);
+    span.set(42);
+    trace_span dropped("dropped");
+    dropped.drop();
+    std::ifstream ifs(TestDataPath("testdata/sample1.txt"));
+    auto tree = ps_restore_tree(ifs);
+    set_sizes(tree.get(), f, 6.0, 9.0);
+  }
+  std::thread([] {
+    trace_thread_name("helper");
+    trace_span span("other");
+  }).join();
+  trace_span::enabled = false;
+
+  ASSERT_TRUE(write_trace(path));
+  std::string trace = ReadFile(path);
+  EXPECT_EQ(trace.compare(0, 17, "{\"traceEvents\": ["), 0);
+  EXPECT_NE(trace.find("\"name\": \"outer\", \"ph\": \"X\""),
+            std::string::npos);
+  EXPECT_NE(trace.find("\"args\": {\"value\": 42}"), std::string::npos);
+  EXPECT_NE(trace.find("\"name\": \"adjust\""), std::string::npos);
+  EXPECT_NE(trace.find("\"args\": {\"name\": \"helper\"}"),
+            std::string::npos);
+  EXPECT_NE(trace.find("\"name\": \"other\""), std::string::npos);
+  EXPECT_EQ(trace.find("ignored"), std::string::npos);
+  EXPECT_EQ(trace.find("dropped"), std::string::npos);
+  std::remove(path.c_str());
+}
+
+// ___________________________________________________________________________
+// Allocation statistics tests
+
+TEST(AllocStats, CountsThePhaseInUse) {
+  if (!alloc_stats_enabled()) {
+    // nothing is counted, and nothing is reported
+    EXPECT_EQ(get_alloc_stats(alloc_layout).allocations, 0);
+    std::ostringstream os;
+    write_alloc_stats(os);
+    EXPECT_TRUE(os.str().empty());
+    return;
+  }
+  set_alloc_phase(alloc_layout);
+  alloc_stats before = get_alloc_stats(alloc_layout);
+  alloc_stats parse = get_alloc_stats(alloc_parse);
+  {
+    std::vector<char> block(1 << 20);
+    EXPECT_GE(get_alloc_stats(alloc_layout).peak, before.peak + (1 << 20));
+  }
+  alloc_stats after = get_alloc_stats(alloc_layout);
+  EXPECT_GE(after.allocations, before.allocations + 1);
+  EXPECT_GE(after.bytes, before.bytes + (1 << 20));
+  EXPECT_EQ(get_alloc_stats(alloc_parse).allocations, parse.allocations);
+  set_alloc_phase(alloc_startup);
+
+  std::ostringstream os;
+  write_alloc_stats(os);
+  EXPECT_NE(os.str().find("layout"), std::string::npos);
+}
+
+// ___________________________________________________________________________
+// PDF output tests
+
+TEST(PdfDrawArc, ProducesExpectedOutput) {
+  std::ostringstream os;
+  os << std::fixed;
+  pdf_draw_arc(10.0, 20.0, 30.0, 40.0, os);
+  EXPECT_EQ(os.str(),
+            "10.00 20.00 m 10.00 30.00 30.00 30.00 30.00 40.00 c S\n");
+}
+
+TEST(PdfDrawString, EscapesParentheses) {
+  std::ostringstream os;
+  os << std::fixed;
+  pdf_draw_string("a(b)c", 0.0, 0.0, os);
+  EXPECT_EQ(os.str(), "BT 0.00 0.00 Td (a\\(b\\)c) Tj ET\n");
+}
+
+// Checks the cross reference table and returns the objects by number
+static std::map<int, std::string> PdfObjects(const std::string& pdf) {
+  std::map<int, std::string> objects;
+  std::size_t at = pdf.rfind("startxref\n");
+  EXPECT_NE(at, std::string::npos);
+  if (at == std::string::npos)
+    return objects;
+  std::istringstream is(pdf.substr(std::stoul(pdf.substr(at + 10))));
+  std::string word;
+  int first, count;
+  is >> word >> first >> count;
+  EXPECT_EQ(word, "xref");
+  for (int n = first; n < first + count; n++) {
+    long offset;
+    int generation;
+    std::string kind;
+    is >> offset >> generation >> kind;
+    if (kind != "n")
+      continue;
+    std::string header = std::to_string(n) + " 0 obj\n";
+    EXPECT_EQ(pdf.compare(offset, header.size(), header), 0) << n;
+    objects[n] = pdf.substr(offset, pdf.find("endobj\n", offset) - offset);
+  }
+  return objects;
+}
+
+TEST(PdfWriteTrees, EveryPageShowsTheTreeForm) {
+  font f, rule;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  ASSERT_TRUE(rule.load("Helvetica", FontsDir()));
+  std::ifstream ifs(TestDataPath("testdata/sample1.txt"));
+  auto tree = ps_restore_tree(ifs);
+  set_sizes(tree.get(), f, 40.0, 60.0);
+  page_plan plan = plan_pages(tree->x, tree->y, tree->width, tree->height);
+  ASSERT_GT(plan.pages(), 1);
+
+  std::ostringstream os;
+  pdf_write_trees({tree.get()}, f, rule, 40.0, os);
+  std::string pdf = os.str();
+  EXPECT_EQ(pdf.compare(0, 9, "%PDF-1.4\n"), 0);
+  EXPECT_EQ(pdf.substr(pdf.size() - 6), "%%EOF\n");
+
+  int pages = 0, forms = 0;
+  for (const auto& object : PdfObjects(pdf)) {
+    if (object.second.find("/Type /Page ") != std::string::npos) {
+      pages++;
+      EXPECT_NE(object.second.find("/XObject << /T0 "), std::string::npos);
+    }
+    if (object.second.find("/Subtype /Form") != std::string::npos)
+      forms++;
+    if (object.second.find("/BaseFont /Helvetica-Narrow") !=
+        std::string::npos) {
+      EXPECT_NE(object.second.find("/FontDescriptor"), std::string::npos);
+    }
+  }
+  EXPECT_EQ(pages, plan.pages());
+  EXPECT_EQ(forms, 1);
+  EXPECT_NE(pdf.find("/Count " + std::to_string(plan.pages()) + " "),
+            std::string::npos);
+}
+
+TEST(PdfWriteTrees, OneFormPerTree) {
+  font f, rule;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  ASSERT_TRUE(rule.load("Helvetica", FontsDir()));
+  std::istringstream input("BA\nLA1\nLA2\nLB\n");
+  auto forest = ps_restore_forest(input, collapse_limits());
+  ASSERT_EQ(forest.size(), 2);
+  set_forest_sizes(forest, f, 6.0, 9.0, 1);
+
+  std::ostringstream os;
+  pdf_write_trees({forest[0].get(), forest[1].get()}, f, rule, 6.0, os);
+  std::string pdf = os.str();
+  int forms = 0;
+  for (const auto& object : PdfObjects(pdf))
+    if (object.second.find("/Subtype /Form") != std::string::npos)
+      forms++;
+  EXPECT_EQ(forms, 2);
+  EXPECT_NE(pdf.find("/XObject << /T1 "), std::string::npos);
+  EXPECT_NE(pdf.find("/Count 2 "), std::string::npos);
+}
+
+// ___________________________________________________________________________
+// SVG tests
+
+static int Occurrences(const std::string& s, const std::string& part) {
+  int n = 0;
+  for (auto pos = s.find(part); pos != std::string::npos;
+       pos = s.find(part, pos + 1))
+    n++;
+  return n;
+}
+
+TEST(SvgWriteTree, EachLabelBlockIsOneSymbol) {
+  tree_builder b;
+  b.branch({"x < 1"});
+  b.branch({"same", "two lines"});
+  b.leaf({"leaf"});
+  b.leaf({"leaf"});
+  b.leaf({"same", "two lines"});
+  auto tree = b.finish();
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  set_sizes(tree.get(), f, 6.0, 9.0);
+
+  std::ostringstream os;
+  svg_write_tree(tree.get(), "Helvetica-Narrow", 6.0, os);
+  std::string svg = os.str();
+  EXPECT_EQ(Occurrences(svg, "<symbol "), 3);
+  EXPECT_EQ(Occurrences(svg, "<use "), 5);
+  EXPECT_EQ(Occurrences(svg, "<path "), 1);
+  EXPECT_EQ(Occurrences(svg, "C"), 4);
+  EXPECT_NE(svg.find(">x &lt; 1</text>"), std::string::npos);
+  EXPECT_EQ(svg.substr(svg.size() - 7), "</svg>\n");
+
+  // the root, and its box, at the layout's own coordinates with y flipped
+  std::ostringstream root;
+  root << std::fixed << std::setprecision(2) << "x=\"" << tree->xbox
+       << "\" y=\"" << -tree->ybox << "\"/>\n</svg>";
+  EXPECT_NE(svg.find(root.str()), std::string::npos);
+}
+
+TEST(SvgWriteTile, DrawsOnlyTheHits) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  auto tree = BalancedTree(6);
+  set_sizes(tree.get(), f, 6.0, 9.0);
+  node_index index(tree.get(), 6.0,
+                   std::max(tree->left->width, tree->right->width) + 1.0);
+  std::vector<const index_entry*> hits;
+  index.query(tree->x, tree->y, tree->x + tree->width,
+              tree->y + tree->height, hits);
+
+  // at a tenth of a pixel per point, labels are left out
+  std::ostringstream os;
+  svg_write_tile(hits, tree->x, tree->y, tree->width, tree->height,
+                 static_cast<int>(tree->width / 10.0),
+                 static_cast<int>(tree->height / 10.0), "Helvetica-Narrow",
+                 6.0, os);
+  std::string svg = os.str();
+  EXPECT_EQ(Occurrences(svg, "<symbol "), 1);
+  EXPECT_EQ(Occurrences(svg, "<use "), 1);
+  EXPECT_EQ(Occurrences(svg, "C"), 2);
+  EXPECT_EQ(Occurrences(svg, "<rect class=\"s\""), 2);
+  EXPECT_EQ(Occurrences(svg, "<text"), 0);
+
+  // at full size they are drawn
+  std::ostringstream full;
+  svg_write_tile(hits, tree->x, tree->y, tree->width, tree->height,
+                 static_cast<int>(tree->width),
+                 static_cast<int>(tree->height), "Helvetica-Narrow", 6.0,
+                 full);
+  EXPECT_EQ(Occurrences(full.str(), "<text"), 1);
+}
+
+TEST(WriteTilePyramid, WritesEveryLevel) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  // leaves narrower than the summary size, which are still drawn in full
+  // on the last level
+  auto tree = BalancedTree(8, "a");
+  set_sizes(tree.get(), f, 6.0, 9.0);
+  std::string base = testing::TempDir() + "/pyramid";
+  ASSERT_TRUE(write_tile_pyramid(tree.get(), "Helvetica-Narrow", 6.0, base,
+                                 3));
+  std::string dzi = ReadFile(base + ".dzi");
+  EXPECT_NE(dzi.find("TileSize=\"256\""), std::string::npos);
+
+  // a single tile on level 0, and the tree at full size on the last
+  double side = std::max(tree->width, tree->height) + 24.0;
+  int last = static_cast<int>(std::ceil(std::log2(side)));
+  EXPECT_EQ(ReadFile(base + "_files/0/0_0.svg").substr(0, 5), "<?xml");
+  std::string corner = ReadFile(base + "_files/" + std::to_string(last) +
+                                "/0_0.svg");
+  EXPECT_NE(corner.find("width=\"256.00\""), std::string::npos);
+  int columns = static_cast<int>(std::ceil((tree->width + 24.0) / 256.0));
+  int rows = static_cast<int>(std::ceil((tree->height + 24.0) / 256.0));
+  int labeled = 0;
+  for (int column = 0; column < columns; column++)
+    for (int row = 0; row < rows; row++) {
+      std::string tile = ReadFile(base + "_files/" + std::to_string(last) +
+                                  "/" + std::to_string(column) + "_" +
+                                  std::to_string(row) + ".svg");
+      EXPECT_EQ(tile.find("class=\"s\""), std::string::npos);
+      labeled += tile.find(">a</text>") != std::string::npos;
+    }
+  EXPECT_GT(labeled, 0);
+}
+
+// ___________________________________________________________________________
+// Batched path tests
+
+TEST(NodesAlongCurve, EveryNodeOnceAndCloseTogether) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  auto tree = BalancedTree(10);
+  set_sizes(tree.get(), f, 6.0, 9.0);
+  std::vector<pstree*> nodes = nodes_along_curve(tree.get());
+  ASSERT_EQ(nodes.size(), 1023u);
+  std::vector<pstree*> sorted = nodes;
+  std::sort(sorted.begin(), sorted.end());
+  EXPECT_EQ(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+  // a shorter way through the nodes than the pre-order of the file
+  std::vector<pstree*> preorder;
+  std::vector<pstree*> pending = {tree.get()};
+  while (!pending.empty()) {
+    pstree* t = pending.back();
+    pending.pop_back();
+    preorder.push_back(t);
+    if (t->left) {
+      pending.push_back(t->right.get());
+      pending.push_back(t->left.get());
+    }
+  }
+  auto length = [](const std::vector<pstree*>& v) {
+    double sum = 0.0;
+    for (std::size_t i = 1; i < v.size(); i++)
+      sum += std::hypot(v[i]->xbox - v[i - 1]->xbox,
+                        v[i]->ybox - v[i - 1]->ybox);
+    return sum;
+  };
+  EXPECT_LT(length(nodes), length(preorder));
+}
+
+TEST(PsDrawTreeBatched, DrawsTheSameInFewPaths) {
+  font f;
+  ASSERT_TRUE(f.load("Helvetica-Narrow", FontsDir()));
+  auto tree = BalancedTree(11);
+  set_sizes(tree.get(), f, 6.0, 9.0);
+  std::ostringstream plain, batched;
+  ps_draw_tree(tree.get(), 6.0, plain);
+  ps_draw_tree_batched(tree.get(), nodes_along_curve(tree.get()), 6.0,
+                       batched);
+
+  // 2046 arcs and 2047 boxes, a thousand to a path
+  std::string ps = batched.str();
+  EXPECT_EQ(Occurrences(plain.str(), "sk\n"), 2046 + 2047);
+  EXPECT_EQ(Occurrences(ps, "np "), 3 + 3);
+  EXPECT_EQ(Occurrences(ps, "ct sk\n"), 2);
+  EXPECT_EQ(Occurrences(ps, "\nsk\n"), 1);
+  EXPECT_EQ(Occurrences(ps, "er sk\n"), 3);
+  EXPECT_EQ(Occurrences(ps, " ct"), 2046);
+  EXPECT_EQ(Occurrences(ps, " cp"), 2047);
+  EXPECT_EQ(Occurrences(ps, ") sh\n"), Occurrences(plain.str(), ") sh\n"));
+
+  // every arc before the first box, and every label after its box
+  EXPECT_LT(ps.rfind(" ct"), ps.find(" cp"));
+  std::string root = "(" + tree->nodestrings[0].text + ") sh";
+  std::size_t label = ps.find(root);
+  ASSERT_NE(label, std::string::npos);
+  std::ostringstream box;
+  box << std::fixed << std::setprecision(2)
+      << tree->xbox - tree->stringswidth / 2.0 - 1.2 << " "
+      << tree->ybox + 4.8 - tree->boxheight << " mt";
+  std::size_t at = ps.find(box.str());
+  ASSERT_NE(at, std::string::npos);
+  EXPECT_LT(at, label);
+  EXPECT_LT(ps.find("er sk", at), label);
+}
+
+// ___________________________________________________________________________
+// Render server tests
+
+static std::string TreeRequest(const std::string& fontname,
+                               const std::string& treedata) {
+  return "tree " + fontname + " 6 " + std::to_string(treedata.size()) + "\n" +
+         treedata;
+}
+
+static std::string RenderFile(const std::string& path) {
+  font mainfont;
+  EXPECT_TRUE(mainfont.load("Helvetica-Narrow", FontsDir()));
+  std::ifstream ifs(path);
+  auto tree = ps_restore_tree(ifs);
+  std::ostringstream os;
+  ps_render(tree.get(), mainfont, 6.0, os);
+  return os.str();
+}
+
+TEST(ServeRequests, AnswersEachRequestInTurn) {
+  std::string tree = ReadFile(TestDataPath("testdata/sample2.txt"));
+  std::string golden = RenderFile(TestDataPath("testdata/sample2.txt"));
+  std::istringstream in(TreeRequest("Helvetica-Narrow", tree) +
+                        TreeRequest("NoSuchFont", tree) +
+                        TreeRequest("Helvetica-Narrow", "Xbad\n") +
+                        TreeRequest("Helvetica-Narrow", tree) + "quit\n");
+  std::ostringstream out;
+  font_cache fonts(FontsDir());
+  EXPECT_FALSE(serve_requests(in, out, fonts));
+
+  std::istringstream replies(out.str());
+  std::string line;
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(std::getline(replies, line));
+    if (i == 1) {
+      EXPECT_EQ(line, "error unable to load font NoSuchFont");
+      continue;
+    }
+    if (i == 2) {
+      EXPECT_EQ(line, "error not a proper tree data file");
+      continue;
+    }
+    ASSERT_EQ(line, "ok");
+    std::string document;
+    while (std::getline(replies, line) && line != "0") {
+      std::string chunk(std::stoul(line), '\0');
+      replies.read(&chunk[0], static_cast<std::streamsize>(chunk.size()));
+      document += chunk;
+    }
+    EXPECT_EQ(document, golden);
+  }
+}
+
+TEST(ServeRequests, ShutdownStopsServer) {
+  std::istringstream in("shutdown\n");
+  std::ostringstream out;
+  font_cache fonts(FontsDir());
+  EXPECT_TRUE(serve_requests(in, out, fonts));
+  EXPECT_EQ(out.str(), "");
+}
+
+TEST(ServeRequests, RejectsBadSizesAndFontNames) {
+  // a bad size ends the connection, as nothing after it can be framed
+  for (const char* size : {"-1", "99999999999999", "x"}) {
+    std::istringstream in(std::string("tree Helvetica-Narrow 6 ") + size +
+                          "\nL a\n");
+    std::ostringstream out;
+    font_cache fonts(FontsDir());
+    EXPECT_FALSE(serve_requests(in, out, fonts));
+    EXPECT_EQ(out.str(), "error bad request\n") << size;
+  }
+
+  // fonts outside the fonts directory are not loaded
+  std::istringstream in(TreeRequest("../fonts/Helvetica-Narrow", "L a\n") +
+                        "quit\n");
+  std::ostringstream out;
+  font_cache fonts(FontsDir());
+  EXPECT_FALSE(serve_requests(in, out, fonts));
+  EXPECT_EQ(out.str(),
+            "error unable to load font ../fonts/Helvetica-Narrow\n");
+}
+
+TEST(RequestRender, RejectsBadChunkHeader) {
+  // the reply is read after the request written past it
+  std::stringstream io("ok\n12x\n", std::ios_base::in | std::ios_base::out |
+                                         std::ios_base::ate);
+  std::ostringstream ps;
+  std::string error;
+  EXPECT_FALSE(request_render(io, "Helvetica-Narrow", 6.0, "L a\n", ps,
+                              error));
+  EXPECT_EQ(error, "bad reply from server");
+}
+
+TEST(ServeRequests, UnixSocketRoundTrip) {
+  const char* tmpdir = std::getenv("TEST_TMPDIR");
+  std::string path = std::string(tmpdir ? tmpdir : "/tmp") + "/pst_test." +
+                     std::to_string(::getpid()) + ".sock";
+  font_cache fonts(FontsDir());
+  std::thread server([&] { serve_unix_socket(path, fonts); });
+
+  int fd = -1;
+  for (int tries = 0; fd < 0 && tries < 200; tries++) {
+    fd = connect_unix_socket(path);
+    if (fd < 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_GE(fd, 0) << "server did not start";
+  {
+    fd_streambuf buf(fd);
+    std::iostream io(&buf);
+    for (const char* sample : {"sample1.txt", "sample3.txt"}) {
+      std::string tree = ReadFile(TestDataPath(std::string("testdata/") +
+                                               sample));
+      std::ostringstream ps;
+      std::string error;
+      EXPECT_TRUE(request_render(io, "Helvetica-Narrow", 6.0, tree, ps, error))
+          << error;
+      EXPECT_EQ(ps.str(), RenderFile(TestDataPath(std::string("testdata/") +
+                                                  sample)));
+    }
+    io << "shutdown\n";
+    io.flush();
+  }
+  ::close(fd);
+  server.join();
+}
+
 // ___________________________________________________________________________
 // Golden file integration tests: full pipeline for each sample
 
@@ -566,5 +2238,36 @@ TEST_F(GoldenTest, Sample3) {
   EXPECT_EQ(actual, expected);
 }
 
+TEST_F(GoldenTest, RenderMatchesPipeline) {
+  font mainfont;
+  ASSERT_TRUE(mainfont.load("Helvetica-Narrow", FontsDir()));
+  for (const char* sample : {"sample1.txt", "sample2.txt", "sample3.txt"}) {
+    std::ifstream ifp(TestDataPath(std::string("testdata/") + sample));
+    auto tree = ps_restore_tree(ifp);
+    ASSERT_NE(tree, nullptr);
+    std::ostringstream os;
+    ps_render(tree.get(), mainfont, 6.0, os);
+    EXPECT_EQ(os.str().compare(0, 15, "%!PS-Adobe-3.0\n"), 0);
+    auto pages = PageContents(os.str());
+    EXPECT_FALSE(pages.empty());
+    EXPECT_EQ(pages, PageContents(ReadGoldenFile(sample))) << sample;
+  }
+}
+
+TEST_F(GoldenTest, BuilderRenderMatchesSample2) {
+  font mainfont;
+  ASSERT_TRUE(mainfont.load("Helvetica-Narrow", FontsDir()));
+  tree_builder b;
+  b.branch({"Top Node A"});
+  b.leaf({"Left Child A11"});
+  b.leaf({"Dropped it on the floor"});
+  auto tree = b.finish();
+  ASSERT_NE(tree, nullptr);
+  std::ostringstream os;
+  ps_render(tree.get(), mainfont, 6.0, os);
+  EXPECT_EQ(PageContents(os.str()),
+            PageContents(ReadGoldenFile("sample2.txt")));
+}
+
 // ___________________________________________________________________________
 // pst_test.cc
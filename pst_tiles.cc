@@ -0,0 +1,135 @@
+// ___________________________________________________________________________
+// Includes and defines
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pst.h"
+
+// Tiles are square, in pixels
+static const int tile_size = 256;
+
+// Subtrees smaller than this many pixels on a level are one gray box
+static const double summary_pixels = 16.0;
+
+// ___________________________________________________________________________
+
+static bool make_directory(const std::string& path)
+{
+  if (mkdir(path.c_str(), 0777) == 0 || errno == EEXIST)
+    return true;
+  std::cout << "Unable to create directory " << path << "\n";
+  return false;
+
+} // make_directory
+
+// ___________________________________________________________________________
+
+bool write_tile_pyramid(pstree* t, const std::string& fontname,
+                        double fontsize, const std::string& basename,
+                        int threads)
+{
+  // A Deep Zoom image: the last level shows the tree at one pixel per
+  // point, and every level before it at half the size of the next, down
+  // to a single pixel.  Level n is in {basename}_files/n/, as tiles
+  // named {column}_{row}.svg.
+  double margin = 2.0 * fontsize;
+  double x0 = t->x - margin, y0 = t->y - margin;
+  double width = t->width + 2.0 * margin, height = t->height + 2.0 * margin;
+  int last = static_cast<int>(std::ceil(std::log2(std::max(width, height))));
+
+  std::string dzi = basename + ".dzi";
+  std::ofstream dfp(dzi);
+  dfp << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\""
+      << " TileSize=\"" << tile_size << "\" Overlap=\"0\" Format=\"svg\">\n"
+      << "  <Size Width=\"" << static_cast<long long>(std::ceil(width))
+      << "\" Height=\"" << static_cast<long long>(std::ceil(height))
+      << "\"/>\n"
+      << "</Image>\n";
+  dfp.close();
+  if (!dfp) {
+    std::cout << "Unable to write file " << dzi << "\n";
+    return false;
+  }
+  std::string files = basename + "_files";
+  if (!make_directory(files))
+    return false;
+
+  for (int level = 0; level <= last; level++) {
+    trace_span span("level", "level", level);
+    std::string dir = files + "/" + std::to_string(level);
+    if (!make_directory(dir))
+      return false;
+
+    // what is drawn on this level, with small subtrees summarized but for
+    // the last, where everything is drawn
+    double scale = std::ldexp(1.0, level - last);
+    node_index index(t, fontsize,
+                     level == last ? 0.0 : summary_pixels / scale);
+    int columns = static_cast<int>(std::ceil(width * scale / tile_size));
+    int rows = static_cast<int>(std::ceil(height * scale / tile_size));
+    double side = tile_size / scale;
+
+    // Tiles share nothing but the index; workers take the next one.  Rows
+    // count from the top, and empty tiles are not written.
+    std::atomic<int> next(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&] {
+      std::vector<const index_entry*> hits;
+      for (int i; (i = next++) < columns * rows && !failed;) {
+	int column = i % columns, row = i / columns;
+	double x = x0 + column * side;
+	double y = y0 + height - (row + 1) * side;
+	double w = std::min(side, x0 + width - x);
+	double h = side;
+	if (y < y0) {
+	  h -= y0 - y;
+	  y = y0;
+	}
+	hits.clear();
+	index.query(x, y, x + w, y + h, hits);
+	if (hits.empty())
+	  continue;
+
+	trace_span tile("tile", "entries", static_cast<long long>(hits.size()));
+	std::string name = dir + "/" + std::to_string(column) + "_" +
+          std::to_string(row) + ".svg";
+	std::ofstream os(name);
+	svg_write_tile(hits, x, y, w, h,
+                       static_cast<int>(std::ceil(w * scale)),
+                       static_cast<int>(std::ceil(h * scale)), fontname,
+                       fontsize, os);
+	os.close();
+	if (!os && !failed.exchange(true))
+	  std::cout << "Unable to write file " << name << "\n";
+      }
+    };
+
+    std::vector<std::thread> pool;
+    for (int i = 1; i < std::min(threads, columns * rows); i++)
+      pool.emplace_back([&] {
+	trace_thread_name("tiles");
+	worker();
+      });
+    worker();
+    for (auto& th : pool)
+      th.join();
+    if (failed)
+      return false;
+  }
+  return true;
+
+} // write_tile_pyramid
+
+// ___________________________________________________________________________
+// pst_tiles.cc
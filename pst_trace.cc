@@ -0,0 +1,141 @@
+// ___________________________________________________________________________
+// Includes and defines
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "pst.h"
+
+// ___________________________________________________________________________
+// Trace events, kept per thread until the end of the run
+
+namespace {
+
+struct trace_event {
+  const char* name;
+  const char* arg_name;  // null for a span without an argument
+  long long arg;
+  long long start, duration;  // nanoseconds since start_trace
+};
+
+struct thread_events {
+  int tid;
+  const char* name = nullptr;
+  std::vector<trace_event> events;
+};
+
+std::mutex registry_lock;
+std::vector<std::unique_ptr<thread_events>> registry;
+std::chrono::steady_clock::time_point trace_start;
+std::string trace_path;
+
+thread_events& this_thread_events()
+{
+  // registered once per thread, and only then under the lock
+  thread_local thread_events* events = nullptr;
+  if (!events) {
+    std::lock_guard<std::mutex> guard(registry_lock);
+    registry.push_back(std::make_unique<thread_events>());
+    events = registry.back().get();
+    events->tid = static_cast<int>(registry.size());
+  }
+  return *events;
+}
+
+} // namespace
+
+bool trace_span::enabled = false;
+
+// ___________________________________________________________________________
+
+long long trace_span::now()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - trace_start).count();
+
+} // trace_span::now
+
+// ___________________________________________________________________________
+
+void trace_span::record()
+{
+  this_thread_events().events.push_back({name, arg_name, arg, start,
+                                         now() - start});
+
+} // trace_span::record
+
+// ___________________________________________________________________________
+
+static void finish_trace()
+{
+  if (!write_trace(trace_path))
+    std::cerr << "Unable to write file " << trace_path << "\n";
+
+} // finish_trace
+
+// ___________________________________________________________________________
+
+void start_trace(const std::string& path)
+{
+  // written when the program ends, after all threads have stopped
+  trace_start = std::chrono::steady_clock::now();
+  trace_path = path;
+  trace_span::enabled = true;
+  std::atexit(finish_trace);
+
+} // start_trace
+
+// ___________________________________________________________________________
+
+void trace_thread_name(const char* name)
+{
+  if (trace_span::enabled)
+    this_thread_events().name = name;
+
+} // trace_thread_name
+
+// ___________________________________________________________________________
+
+bool write_trace(const std::string& path)
+{
+  // the trace event format of chrome://tracing and Perfetto, with
+  // complete ("X") events in microseconds
+  std::ofstream os(path);
+  std::lock_guard<std::mutex> guard(registry_lock);
+  char buf[64];
+  os << "{\"traceEvents\": [";
+  const char* separator = "\n";
+  for (const auto& thread : registry) {
+    if (thread->name) {
+      os << separator << "{\"name\": \"thread_name\", \"ph\": \"M\", "
+         << "\"pid\": 1, \"tid\": " << thread->tid
+         << ", \"args\": {\"name\": \"" << thread->name << "\"}}";
+      separator = ",\n";
+    }
+    for (const auto& e : thread->events) {
+      std::snprintf(buf, sizeof(buf), "\"ts\": %.3f, \"dur\": %.3f",
+                    e.start / 1000.0, e.duration / 1000.0);
+      os << separator << "{\"name\": \"" << e.name << "\", \"ph\": \"X\", "
+         << buf << ", \"pid\": 1, \"tid\": " << thread->tid;
+      if (e.arg_name)
+	os << ", \"args\": {\"" << e.arg_name << "\": " << e.arg << "}";
+      os << "}";
+      separator = ",\n";
+    }
+  }
+  os << "\n], \"displayTimeUnit\": \"ms\"}\n";
+  os.close();
+  return static_cast<bool>(os);
+
+} // write_trace
+
+// ___________________________________________________________________________
+// pst_trace.cc
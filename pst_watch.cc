@@ -0,0 +1,217 @@
+// ___________________________________________________________________________
+// Includes and defines
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "pst.h"
+
+// ___________________________________________________________________________
+
+bool watched_tree::starts_before(const node_span& s, std::size_t pos)
+{
+  return s.begin < pos;
+
+} // watched_tree::starts_before
+
+// ___________________________________________________________________________
+
+std::unique_ptr<pstree> watched_tree::read_node(
+    const std::string& next, std::size_t& pos, std::size_t same_start,
+    std::size_t same_end, std::unique_ptr<pstree>* owner,
+    std::vector<node_span>& next_spans, bool& laid_out)
+{
+  // A subtree whose bytes all lie in the unchanged start or end of the
+  // file is the same subtree as before, and is taken over whole.  In the
+  // start, the byte after it must be unchanged too, as a '+' line there
+  // would add to its last label.
+  std::size_t old = pos < same_start ? pos
+    : pos >= same_end ? pos + text.size() - next.size()
+    : std::string::npos;
+  auto found = std::lower_bound(spans.begin(), spans.end(), old,
+                                starts_before);
+  if (old != std::string::npos && found != spans.end() &&
+      found->begin == old && *found->owner &&
+      (pos >= same_end || found->end < same_start)) {
+    std::unique_ptr<pstree> node = std::move(*found->owner);
+    auto last = std::lower_bound(found, spans.end(), found->end,
+                                 starts_before);
+    std::size_t first = next_spans.size();
+    for (auto s = found; s != last; s++)
+      next_spans.push_back({s->begin + pos - old, s->end + pos - old,
+                            s->owner});
+    next_spans[first].owner = owner;
+    reused += static_cast<long>(last - found);
+    pos = next_spans[first].end;
+
+    // its seglist went to its old parent
+    rebuild_seglist(node.get(), fontsize);
+    laid_out = true;
+    return node;
+  }
+
+  if (pos >= next.size() || (next[pos] != 'B' && next[pos] != 'L')) {
+    std::cout << "This is not a proper tree data file\n";
+    return nullptr;
+  }
+  bool branch = next[pos] == 'B';
+  auto node = std::make_unique<pstree>();
+  std::size_t span = next_spans.size();
+  next_spans.push_back({pos, 0, owner});
+
+  // the label lines, as restore_node reads them
+  do {
+    std::size_t eol = std::min(next.find('\n', pos), next.size());
+    node->nodestrings.push_back({next.substr(pos + 1, eol - pos - 1)});
+    pos = std::min(eol + 1, next.size());
+  } while (pos < next.size() && next[pos] == '+');
+
+  // New subtrees are laid out as a whole, once it is known that they
+  // meet one that was kept; a new tree is laid out by update.
+  laid_out = false;
+  if (branch) {
+    bool left = false, right = false;
+    node->left = read_node(next, pos, same_start, same_end, &node->left,
+                           next_spans, left);
+    if (!node->left)
+      return nullptr;
+    node->right = read_node(next, pos, same_start, same_end, &node->right,
+                            next_spans, right);
+    if (!node->right)
+      return nullptr;
+    laid_out = left || right;
+    if (laid_out) {
+      if (!left)
+	set_sizes(node->left.get(), mainfont, fontsize, interspace);
+      if (!right)
+	set_sizes(node->right.get(), mainfont, fontsize, interspace);
+      set_node_size(node.get(), mainfont, fontsize, interspace);
+    }
+  }
+  node->shape = shape_hash(node.get());
+  next_spans[span].end = pos;
+  return node;
+
+} // watched_tree::read_node
+
+// ___________________________________________________________________________
+
+bool watched_tree::update(std::string next)
+{
+  // the bytes that are the same at the start and at the end of the file
+  std::size_t common = std::min(text.size(), next.size());
+  std::size_t prefix = static_cast<std::size_t>(
+      std::mismatch(next.begin(), next.begin() + common, text.begin())
+          .first - next.begin());
+  std::size_t suffix = 0;
+  while (suffix < common - prefix &&
+         next[next.size() - 1 - suffix] == text[text.size() - 1 - suffix])
+    suffix++;
+
+  std::vector<node_span> next_spans;
+  std::size_t pos = 0;
+  bool laid_out = false;
+  reused = 0;
+  std::unique_ptr<pstree> t = read_node(next, pos, prefix,
+                                        next.size() - suffix, &root,
+                                        next_spans, laid_out);
+  if (!t) {
+    // the kept subtrees went into the part that was read; start afresh
+    root.reset();
+    text.clear();
+    spans.clear();
+    return false;
+  }
+
+  // Kept subtrees are still where the last layout moved them, and the
+  // layout around them follows.  Bring the tree back to where a layout
+  // from scratch puts it: the bottom at 0, and the leftmost leaf at 0 as
+  // the left child of every branch stays in place horizontally.
+  if (laid_out) {
+    const pstree* leftmost = t.get();
+    while (leftmost->left)
+      leftmost = leftmost->left.get();
+    double dx = -leftmost->x, dy = -t->y;
+    move_tree_horizontally(t.get(), dx);
+    move_seglist_horizontally(t->seglist, dx);
+    move_tree_vertically(t.get(), dy);
+    move_seglist_vertically(t->seglist, dy);
+  }
+  else
+    set_sizes(t.get(), mainfont, fontsize, interspace);
+
+  root = std::move(t);
+  text = std::move(next);
+  spans = std::move(next_spans);
+  return true;
+
+} // watched_tree::update
+
+// ___________________________________________________________________________
+
+file_watch::file_watch(const std::string& path)
+{
+#ifdef __linux__
+  std::size_t slash = path.rfind('/');
+  std::string dir = slash == std::string::npos ? "."
+    : slash == 0 ? "/" : path.substr(0, slash);
+  name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+  fd = inotify_init1(IN_CLOEXEC);
+  if (fd >= 0 &&
+      inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    close(fd);
+    fd = -1;
+  }
+#else
+  (void)path;
+#endif
+
+} // file_watch::file_watch
+
+// ___________________________________________________________________________
+
+file_watch::~file_watch()
+{
+  if (fd >= 0)
+    close(fd);
+
+} // file_watch::~file_watch
+
+// ___________________________________________________________________________
+
+bool file_watch::wait()
+{
+#ifdef __linux__
+  // events for other files in the directory are passed over
+  alignas(inotify_event) char buf[4096];
+  bool changed = false;
+  while (fd >= 0 && !changed) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    for (char* p = buf; p < buf + n;) {
+      const inotify_event* e = reinterpret_cast<const inotify_event*>(p);
+      if (e->len > 0 && name == e->name)
+	changed = true;
+      p += sizeof(inotify_event) + e->len;
+    }
+  }
+  return changed;
+#else
+  return false;
+#endif
+
+} // file_watch::wait
+
+// ___________________________________________________________________________
+// pst_watch.cc